@@ -136,6 +136,8 @@ static int parse_opts(char *opts, struct p9_client *clnt)
  *
  */
 
+static void p9_req_work(struct work_struct *work);
+
 static struct p9_req_t *p9_tag_alloc(struct p9_client *c, u16 tag)
 {
 	unsigned long flags;
@@ -178,6 +180,7 @@ static struct p9_req_t *p9_tag_alloc(struct p9_client *c, u16 tag)
 			return ERR_PTR(-ENOMEM);
 		}
 		init_waitqueue_head(req->wq);
+		INIT_WORK(&req->work, p9_req_work);
 		req->tc = kmalloc(sizeof(struct p9_fcall)+c->msize,
 								GFP_KERNEL);
 		req->rc = kmalloc(sizeof(struct p9_fcall)+c->msize,
@@ -202,6 +205,7 @@ static struct p9_req_t *p9_tag_alloc(struct p9_client *c, u16 tag)
 
 	req->tc->tag = tag-1;
 	req->status = REQ_STATUS_ALLOC;
+	req->cb = NULL;
 
 	return &c->reqs[row][col];
 }
@@ -321,11 +325,43 @@ static void p9_free_req(struct p9_client *c, struct p9_req_t *r)
 void p9_client_cb(struct p9_client *c, struct p9_req_t *req)
 {
 	P9_DPRINTK(P9_DEBUG_MUX, " tag %d\n", req->tc->tag);
-	wake_up(req->wq);
+	if (req->cb)
+		schedule_work(&req->work);
+	else
+		wake_up(req->wq);
 	P9_DPRINTK(P9_DEBUG_MUX, "wakeup: %d\n", req->tc->tag);
 }
 EXPORT_SYMBOL(p9_client_cb);
 
+/**
+ * p9_req_work - run the completion callback of a request issued without
+ * waiting
+ * @work: work struct embedded in the request
+ *
+ * Transports complete requests from interrupt or softirq context; the
+ * callback gets process context so it may sleep.
+ */
+
+static void p9_req_work(struct work_struct *work)
+{
+	struct p9_req_t *req = container_of(work, struct p9_req_t, work);
+
+	req->cb(req, req->cb_arg);
+}
+
+/**
+ * p9_client_put_req - release a request issued without waiting
+ * @c: client state
+ * @req: request to release
+ *
+ */
+
+void p9_client_put_req(struct p9_client *c, struct p9_req_t *req)
+{
+	p9_free_req(c, req);
+}
+EXPORT_SYMBOL(p9_client_put_req);
+
 /**
  * p9_parse_header - parse header arguments out of a packet
  * @pdu: packet to parse
@@ -451,47 +487,31 @@ static int p9_client_flush(struct p9_client *c, struct p9_req_t *oldreq)
 	if (IS_ERR(req))
 		return PTR_ERR(req);
 
-
-	/* if we haven't received a response for oldreq,
-	   remove it from the list. */
-	spin_lock(&c->lock);
-	if (oldreq->status == REQ_STATUS_FLSH)
-		list_del(&oldreq->req_list);
-	spin_unlock(&c->lock);
-
 	p9_free_req(c, req);
 	return 0;
 }
 
 /**
- * p9_client_rpc - issue a request and wait for a response
+ * p9_client_prepare - allocate a tag and marshall a request
  * @c: client session
  * @type: type of request
  * @fmt: protocol format string (see protocol.c)
+ * @ap: arguments for @fmt
  *
- * Returns request structure (which client must free using p9_free_req)
  */
 
 static struct p9_req_t *
-p9_client_rpc(struct p9_client *c, int8_t type, const char *fmt, ...)
+p9_client_prepare(struct p9_client *c, int8_t type, const char *fmt,
+								va_list ap)
 {
-	va_list ap;
 	int tag, err;
 	struct p9_req_t *req;
-	unsigned long flags;
-	int sigpending;
 
 	P9_DPRINTK(P9_DEBUG_MUX, "client %p op %d\n", c, type);
 
 	if (c->status != Connected)
 		return ERR_PTR(-EIO);
 
-	if (signal_pending(current)) {
-		sigpending = 1;
-		clear_thread_flag(TIF_SIGPENDING);
-	} else
-		sigpending = 0;
-
 	tag = P9_NOTAG;
 	if (type != P9_TVERSION) {
 		tag = p9_idpool_get(c->tagpool);
@@ -505,22 +525,77 @@ p9_client_rpc(struct p9_client *c, int8_t type, const char *fmt, ...)
 
 	/* marshall the data */
 	p9pdu_prepare(req->tc, tag, type);
-	va_start(ap, fmt);
 	err = p9pdu_vwritef(req->tc, c->dotu, fmt, ap);
-	va_end(ap);
 	p9pdu_finalize(req->tc);
+	if (err) {
+		p9_free_req(c, req);
+		return ERR_PTR(err);
+	}
 
+	return req;
+}
+
+/**
+ * p9_client_post - issue a request without waiting for the response
+ * @c: client session
+ * @cb: called in process context once the response (or an error) is in
+ * @arg: argument for @cb
+ * @type: type of request
+ * @fmt: protocol format string (see protocol.c)
+ *
+ * @cb owns the request and must release it with p9_client_put_req.
+ * Requests issued this way are not flushed on signals.
+ */
+
+static struct p9_req_t *
+p9_client_post(struct p9_client *c, p9_req_cb_t cb, void *arg, int8_t type,
+							const char *fmt, ...)
+{
+	va_list ap;
+	int err;
+	struct p9_req_t *req;
+
+	va_start(ap, fmt);
+	req = p9_client_prepare(c, type, fmt, ap);
+	va_end(ap);
+	if (IS_ERR(req))
+		return req;
+
+	req->cb = cb;
+	req->cb_arg = arg;
 	err = c->trans_mod->request(c, req);
 	if (err < 0) {
-		c->status = Disconnected;
-		goto reterr;
+		if (err != -ERESTARTSYS)
+			c->status = Disconnected;
+		p9_free_req(c, req);
+		return ERR_PTR(err);
 	}
 
-	P9_DPRINTK(P9_DEBUG_MUX, "wait %p tag: %d\n", req->wq, tag);
-	err = wait_event_interruptible(*req->wq,
+	return req;
+}
+
+/**
+ * p9_client_wait - wait for the response to a request
+ * @c: client session
+ * @req: request issued without a callback
+ *
+ * A signal flushes the request.  Returns 0 or a transport error; the
+ * response itself is left to the caller to check.
+ */
+
+static int p9_client_wait(struct p9_client *c, struct p9_req_t *req)
+{
+	int err;
+	unsigned long flags;
+
+	P9_DPRINTK(P9_DEBUG_MUX, "wait %p tag: %d\n", req->wq, req->tc->tag);
+	if (c->trans_mod->wait)
+		err = c->trans_mod->wait(c, req);
+	else
+		err = wait_event_interruptible(*req->wq,
 						req->status >= REQ_STATUS_RCVD);
 	P9_DPRINTK(P9_DEBUG_MUX, "wait %p tag: %d returned %d\n",
-						req->wq, tag, err);
+						req->wq, req->tc->tag, err);
 
 	if (req->status == REQ_STATUS_ERROR) {
 		P9_DPRINTK(P9_DEBUG_ERROR, "req_status error %d\n", req->t_err);
@@ -529,7 +604,6 @@ p9_client_rpc(struct p9_client *c, int8_t type, const char *fmt, ...)
 
 	if ((err == -ERESTARTSYS) && (c->status == Connected)) {
 		P9_DPRINTK(P9_DEBUG_MUX, "flushing\n");
-		sigpending = 1;
 		clear_thread_flag(TIF_SIGPENDING);
 
 		if (c->trans_mod->cancel(c, req))
@@ -538,8 +612,56 @@ p9_client_rpc(struct p9_client *c, int8_t type, const char *fmt, ...)
 		/* if we received the response anyway, don't signal error */
 		if (req->status == REQ_STATUS_RCVD)
 			err = 0;
+
+		spin_lock_irqsave(&current->sighand->siglock, flags);
+		recalc_sigpending();
+		spin_unlock_irqrestore(&current->sighand->siglock, flags);
+	}
+
+	return err;
+}
+
+/**
+ * p9_client_rpc - issue a request and wait for a response
+ * @c: client session
+ * @type: type of request
+ * @fmt: protocol format string (see protocol.c)
+ *
+ * Returns request structure (which client must free using p9_free_req)
+ */
+
+static struct p9_req_t *
+p9_client_rpc(struct p9_client *c, int8_t type, const char *fmt, ...)
+{
+	va_list ap;
+	int err;
+	struct p9_req_t *req;
+	unsigned long flags;
+	int sigpending;
+
+	va_start(ap, fmt);
+	req = p9_client_prepare(c, type, fmt, ap);
+	va_end(ap);
+	if (IS_ERR(req))
+		return req;
+
+	if (signal_pending(current)) {
+		sigpending = 1;
+		clear_thread_flag(TIF_SIGPENDING);
+	} else
+		sigpending = 0;
+
+	err = c->trans_mod->request(c, req);
+	if (err < 0) {
+		/* a transport may be interrupted waiting for room to send */
+		if (err != -ERESTARTSYS)
+			c->status = Disconnected;
+		goto restore_sig;
 	}
 
+	err = p9_client_wait(c, req);
+
+restore_sig:
 	if (sigpending) {
 		spin_lock_irqsave(&current->sighand->siglock, flags);
 		recalc_sigpending();
@@ -586,6 +708,8 @@ static struct p9_fid *p9_fid_create(struct p9_client *clnt)
 	fid->uid = current_fsuid();
 	fid->clnt = clnt;
 	fid->aux = NULL;
+	fid->rdir = NULL;
+	atomic_set(&fid->ref, 1);
 
 	spin_lock_irqsave(&clnt->lock, flags);
 	list_add(&fid->flist, &clnt->fidlist);
@@ -948,6 +1072,7 @@ int p9_client_open(struct p9_fid *fid, int mode)
 				(unsigned long long)qid.path,
 				qid.version, iounit);
 
+	memmove(&fid->qid, &qid, sizeof(struct p9_qid));
 	fid->mode = mode;
 	fid->iounit = iounit;
 
@@ -1029,6 +1154,36 @@ error:
 }
 EXPORT_SYMBOL(p9_client_clunk);
 
+/**
+ * p9_fid_get - take another reference to a fid
+ * @fid: the fid
+ *
+ */
+
+struct p9_fid *p9_fid_get(struct p9_fid *fid)
+{
+	atomic_inc(&fid->ref);
+	return fid;
+}
+EXPORT_SYMBOL(p9_fid_get);
+
+/**
+ * p9_fid_put - drop a reference to a fid
+ * @fid: the fid
+ *
+ * The last reference clunks it.  p9_client_clunk clunks whatever
+ * references are left, so it is only for fids that were never shared.
+ */
+
+int p9_fid_put(struct p9_fid *fid)
+{
+	if (!atomic_dec_and_test(&fid->ref))
+		return 0;
+
+	return p9_client_clunk(fid);
+}
+EXPORT_SYMBOL(p9_fid_put);
+
 int p9_client_remove(struct p9_fid *fid)
 {
 	int err;
@@ -1055,6 +1210,21 @@ error:
 }
 EXPORT_SYMBOL(p9_client_remove);
 
+/* the most a single Tread or Twrite of @count bytes on @fid can move */
+static int p9_client_iosize(struct p9_fid *fid, u32 count)
+{
+	int rsize;
+
+	rsize = fid->iounit;
+	if (!rsize || rsize > fid->clnt->msize-P9_IOHDRSZ)
+		rsize = fid->clnt->msize - P9_IOHDRSZ;
+
+	if (count < rsize)
+		rsize = count;
+
+	return rsize;
+}
+
 int
 p9_client_read(struct p9_fid *fid, char *data, char __user *udata, u64 offset,
 								u32 count)
@@ -1070,12 +1240,7 @@ p9_client_read(struct p9_fid *fid, char *data, char __user *udata, u64 offset,
 	clnt = fid->clnt;
 	total = 0;
 
-	rsize = fid->iounit;
-	if (!rsize || rsize > clnt->msize-P9_IOHDRSZ)
-		rsize = clnt->msize - P9_IOHDRSZ;
-
-	if (count < rsize)
-		rsize = count;
+	rsize = p9_client_iosize(fid, count);
 
 	req = p9_client_rpc(clnt, P9_TREAD, "dqd", fid->fid, offset, rsize);
 	if (IS_ERR(req)) {
@@ -1113,6 +1278,167 @@ error:
 }
 EXPORT_SYMBOL(p9_client_read);
 
+static struct p9_req_t *
+p9_client_tread(struct p9_fid *fid, u64 offset, u32 count, p9_req_cb_t cb,
+								void *arg)
+{
+	int rsize;
+	struct p9_client *clnt;
+
+	P9_DPRINTK(P9_DEBUG_9P, ">>> TREAD fid %d offset %llu %d (%s)\n",
+			fid->fid, (long long unsigned) offset, count,
+			cb ? "async" : "posted");
+	clnt = fid->clnt;
+
+	rsize = p9_client_iosize(fid, count);
+
+	return p9_client_post(clnt, cb, arg, P9_TREAD, "dqd", fid->fid, offset,
+									rsize);
+}
+
+/**
+ * p9_client_read_async - issue a Tread without waiting for the Rread
+ * @fid: fid to read from
+ * @offset: offset to read at
+ * @count: bytes to read, clamped like p9_client_read
+ * @cb: called in process context with the request once it completes
+ * @arg: argument for @cb
+ *
+ * @cb collects the data with p9_client_read_reply and then releases the
+ * request with p9_client_put_req.  @cb is not called if this fails.
+ */
+
+int
+p9_client_read_async(struct p9_fid *fid, u64 offset, u32 count,
+					p9_req_cb_t cb, void *arg)
+{
+	struct p9_req_t *req;
+
+	req = p9_client_tread(fid, offset, count, cb, arg);
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+
+	return 0;
+}
+EXPORT_SYMBOL(p9_client_read_async);
+
+/**
+ * p9_client_read_post - issue a Tread to be waited for later
+ * @fid: fid to read from
+ * @offset: offset to read at
+ * @count: bytes to read, clamped like p9_client_read
+ *
+ * Several Treads can be posted before waiting for the first, which must
+ * then each be collected with p9_client_read_wait.
+ */
+
+struct p9_req_t *
+p9_client_read_post(struct p9_fid *fid, u64 offset, u32 count)
+{
+	return p9_client_tread(fid, offset, count, NULL, NULL);
+}
+EXPORT_SYMBOL(p9_client_read_post);
+
+/**
+ * p9_client_read_wait - wait for a Tread issued by p9_client_read_post
+ * @clnt: client state
+ * @req: the posted request, released on return
+ * @data: kernel buffer to copy the data into
+ * @udata: user buffer to copy the data into
+ * @count: size of the buffer
+ *
+ * Returns the number of bytes read or a negative error.
+ */
+
+int
+p9_client_read_wait(struct p9_client *clnt, struct p9_req_t *req, char *data,
+				char __user *udata, u32 count)
+{
+	int err;
+	char *dataptr;
+
+	err = p9_client_wait(clnt, req);
+	if (!err)
+		err = p9_client_read_reply(clnt, req, &dataptr);
+
+	/* never trust the server with the size of our buffer */
+	if (err > 0 && err > count)
+		err = -EIO;
+
+	if (err > 0 && data)
+		memmove(data, dataptr, err);
+
+	if (err > 0 && udata && copy_to_user(udata, dataptr, err))
+		err = -EFAULT;
+
+	p9_free_req(clnt, req);
+	return err;
+}
+EXPORT_SYMBOL(p9_client_read_wait);
+
+/**
+ * p9_client_read_collect - wait for a posted Tread, keeping the reply
+ * @clnt: client state
+ * @req: the posted request
+ * @data: set to the data in the reply, valid until @req is released
+ *
+ * Like p9_client_read_wait, but the data is left in the reply instead of
+ * being copied out.  The caller releases @req with p9_client_put_req,
+ * whatever this returns.
+ *
+ * Returns the number of bytes read or a negative error.
+ */
+
+int
+p9_client_read_collect(struct p9_client *clnt, struct p9_req_t *req,
+								char **data)
+{
+	int err;
+
+	err = p9_client_wait(clnt, req);
+	if (!err)
+		err = p9_client_read_reply(clnt, req, data);
+
+	return err;
+}
+EXPORT_SYMBOL(p9_client_read_collect);
+
+/**
+ * p9_client_read_reply - collect the result of p9_client_read_async
+ * @clnt: client state
+ * @req: completed request
+ * @data: set to the data in the reply, valid until @req is released
+ *
+ * Returns the number of bytes read or a negative error.
+ */
+
+int
+p9_client_read_reply(struct p9_client *clnt, struct p9_req_t *req,
+								char **data)
+{
+	int err;
+	u32 count;
+
+	if (req->status == REQ_STATUS_ERROR) {
+		P9_DPRINTK(P9_DEBUG_ERROR, "req_status error %d\n", req->t_err);
+		return req->t_err;
+	}
+
+	err = p9_check_errors(clnt, req);
+	if (err)
+		return err;
+
+	err = p9pdu_readf(req->rc, clnt->dotu, "D", &count, data);
+	if (err) {
+		p9pdu_dump(1, req->rc);
+		return err;
+	}
+
+	P9_DPRINTK(P9_DEBUG_9P, "<<< RREAD count %d\n", count);
+	return count;
+}
+EXPORT_SYMBOL(p9_client_read_reply);
+
 int
 p9_client_write(struct p9_fid *fid, char *data, const char __user *udata,
 							u64 offset, u32 count)
@@ -1127,12 +1453,7 @@ p9_client_write(struct p9_fid *fid, char *data, const char __user *udata,
 	clnt = fid->clnt;
 	total = 0;
 
-	rsize = fid->iounit;
-	if (!rsize || rsize > clnt->msize-P9_IOHDRSZ)
-		rsize = clnt->msize - P9_IOHDRSZ;
-
-	if (count < rsize)
-		rsize = count;
+	rsize = p9_client_iosize(fid, count);
 	if (data)
 		req = p9_client_rpc(clnt, P9_TWRITE, "dqD", fid->fid, offset,
 								rsize, data);
@@ -1162,6 +1483,74 @@ error:
 }
 EXPORT_SYMBOL(p9_client_write);
 
+/**
+ * p9_client_write_post - issue a Twrite to be waited for later
+ * @fid: fid to write to
+ * @data: kernel buffer to write from
+ * @udata: user buffer to write from
+ * @offset: offset to write at
+ * @count: bytes to write, clamped like p9_client_write
+ *
+ * The data is copied into the request before this returns.  Each posted
+ * Twrite must be collected with p9_client_write_wait.
+ */
+
+struct p9_req_t *
+p9_client_write_post(struct p9_fid *fid, char *data,
+			const char __user *udata, u64 offset, u32 count)
+{
+	int rsize;
+	struct p9_client *clnt;
+
+	P9_DPRINTK(P9_DEBUG_9P, ">>> TWRITE fid %d offset %llu count %d "
+			"(posted)\n", fid->fid, (long long unsigned) offset,
+			count);
+	clnt = fid->clnt;
+
+	rsize = p9_client_iosize(fid, count);
+	if (data)
+		return p9_client_post(clnt, NULL, NULL, P9_TWRITE, "dqD",
+					fid->fid, offset, rsize, data);
+	else
+		return p9_client_post(clnt, NULL, NULL, P9_TWRITE, "dqU",
+					fid->fid, offset, rsize, udata);
+}
+EXPORT_SYMBOL(p9_client_write_post);
+
+/**
+ * p9_client_write_wait - wait for a Twrite issued by p9_client_write_post
+ * @clnt: client state
+ * @req: the posted request, released on return
+ *
+ * Returns the number of bytes written or a negative error.
+ */
+
+int p9_client_write_wait(struct p9_client *clnt, struct p9_req_t *req)
+{
+	int err;
+	u32 count;
+
+	err = p9_client_wait(clnt, req);
+	if (!err)
+		err = p9_check_errors(clnt, req);
+	if (err)
+		goto out;
+
+	err = p9pdu_readf(req->rc, clnt->dotu, "d", &count);
+	if (err) {
+		p9pdu_dump(1, req->rc);
+		goto out;
+	}
+
+	P9_DPRINTK(P9_DEBUG_9P, "<<< RWRITE count %d\n", count);
+	err = count;
+
+out:
+	p9_free_req(clnt, req);
+	return err;
+}
+EXPORT_SYMBOL(p9_client_write_wait);
+
 struct p9_wstat *p9_client_stat(struct p9_fid *fid)
 {
 	int err;
@@ -33,6 +33,7 @@
 #include "transport.h"
 #include <linux/list.h>
 #include <linux/spinlock.h>
+#include <linux/debugfs.h>
 
 #ifdef CONFIG_NET_9P_DEBUG
 unsigned int p9_debug_level = 0;	/* feature-rific global debug level  */
@@ -41,6 +42,10 @@ module_param_named(debug, p9_debug_level, uint, 0);
 MODULE_PARM_DESC(debug, "9P debugging level");
 #endif
 
+/* debugfs directory for transport statistics (NULL without debugfs) */
+struct dentry *p9_debugfs_root;
+EXPORT_SYMBOL(p9_debugfs_root);
+
 /*
  * Dynamic Transport Registration Routines
  *
@@ -148,6 +153,9 @@ static int __init init_p9(void)
 
 	p9_error_init();
 	printk(KERN_INFO "Installing 9P2000 support\n");
+	p9_debugfs_root = debugfs_create_dir("9p", NULL);
+	if (IS_ERR(p9_debugfs_root))
+		p9_debugfs_root = NULL;
 	p9_trans_fd_init();
 
 	return ret;
@@ -163,6 +171,7 @@ static void __exit exit_p9(void)
 	printk(KERN_INFO "Unloading 9P2000 support\n");
 
 	p9_trans_fd_exit();
+	debugfs_remove_recursive(p9_debugfs_root);
 }
 
 module_init(init_p9)
@@ -30,6 +30,7 @@
 #include <linux/net.h>
 #include <linux/ipv6.h>
 #include <linux/kthread.h>
+#include <linux/sched.h>
 #include <linux/errno.h>
 #include <linux/kernel.h>
 #include <linux/un.h>
@@ -38,6 +39,16 @@
 #include <linux/idr.h>
 #include <linux/file.h>
 #include <linux/parser.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#ifdef CONFIG_NET_RX_BUSY_POLL
+#include <net/busy_poll.h>
+#endif
+#include <linux/socket.h>
+#ifdef AF_VSOCK
+#include <linux/vm_sockets.h>
+#endif
 #include "9p.h"
 #include "client.h"
 #include "transport.h"
@@ -50,7 +61,9 @@
  * struct p9_fd_opts - per-transport options
  * @rfd: file descriptor for reading (trans=fd)
  * @wfd: file descriptor for writing (trans=fd)
- * @port: port to connect to (trans=tcp)
+ * @port: port to connect to (trans=tcp and trans=vsock)
+ * @busypoll: microseconds to poll for a reply before sleeping
+ * @rxleader: let tasks waiting for replies read them from the connection
  *
  */
 
@@ -58,12 +71,15 @@ struct p9_fd_opts {
 	int rfd;
 	int wfd;
 	u16 port;
+	unsigned int busypoll;
+	int rxleader;
 };
 
 /**
  * struct p9_trans_fd - transport state
  * @rd: reference to file to read from
  * @wr: reference of file to write to
+ * @sock: socket behind @rd and @wr, if we created it
  * @conn: connection state reference
  *
  */
@@ -71,6 +87,7 @@ struct p9_fd_opts {
 struct p9_trans_fd {
 	struct file *rd;
 	struct file *wr;
+	struct socket *sock;
 	struct p9_conn *conn;
 };
 
@@ -81,13 +98,18 @@ struct p9_trans_fd {
 
 enum {
 	/* Options that take integer arguments */
-	Opt_port, Opt_rfdno, Opt_wfdno, Opt_err,
+	Opt_port, Opt_rfdno, Opt_wfdno, Opt_busypoll,
+	/* Options that take no arguments */
+	Opt_rxleader,
+	Opt_err,
 };
 
 static const match_table_t tokens = {
 	{Opt_port, "port=%u"},
 	{Opt_rfdno, "rfdno=%u"},
 	{Opt_wfdno, "wfdno=%u"},
+	{Opt_busypoll, "busypoll=%u"},
+	{Opt_rxleader, "rxleader"},
 	{Opt_err, NULL},
 };
 
@@ -108,9 +130,12 @@ struct p9_poll_wait {
  * struct p9_conn - fd mux connection state information
  * @mux_list: list link for mux to manage multiple connections (?)
  * @client: reference to client instance for this connection
+ * @lock: protects @err and @leader
  * @err: error state
- * @req_list: accounting for requests which have been sent
- * @unsent_req_list: accounting for requests that haven't been sent
+ * @unsent: requests queued by submitters, drained by the writer
+ * @sent: requests passed from the writer to the receive path
+ * @req_list: requests which have been sent (receive path only)
+ * @unsent_req_list: requests that haven't been sent (writer only)
  * @req: current request being processed (if any)
  * @tmp_buf: temporary buffer to read in header
  * @rsize: amount to read for current frame
@@ -125,13 +150,19 @@ struct p9_poll_wait {
  * @rq: current read work
  * @wq: current write work
  * @wsched: ????
+ * @busypoll: busy-poll budget in microseconds (see p9_fd_busy_wait)
+ * @rxleader: waiting tasks take turns reading replies (see p9_fd_wait)
+ * @leader: task currently reading replies on behalf of the connection
  *
  */
 
 struct p9_conn {
 	struct list_head mux_list;
 	struct p9_client *client;
+	spinlock_t lock;
 	int err;
+	struct p9_req_t *unsent;
+	struct p9_req_t *sent;
 	struct list_head req_list;
 	struct list_head unsent_req_list;
 	struct p9_req_t *req;
@@ -148,6 +179,9 @@ struct p9_conn {
 	struct work_struct rq;
 	struct work_struct wq;
 	unsigned long wsched;
+	unsigned int busypoll;
+	int rxleader;
+	struct task_struct *leader;
 };
 
 static DEFINE_SPINLOCK(p9_poll_lock);
@@ -155,6 +189,12 @@ static LIST_HEAD(p9_poll_pending_list);
 static struct workqueue_struct *p9_mux_wq;
 static struct task_struct *p9_poll_task;
 
+/* busy-poll accounting, exported through debugfs */
+static atomic_t p9_fd_polls;
+static atomic_t p9_fd_poll_hits;
+static atomic_t p9_fd_poll_misses;
+static struct dentry *p9_fd_debugfs;
+
 static void p9_mux_poll_stop(struct p9_conn *m)
 {
 	unsigned long flags;
@@ -174,6 +214,85 @@ static void p9_mux_poll_stop(struct p9_conn *m)
 	spin_unlock_irqrestore(&p9_poll_lock, flags);
 }
 
+/*
+ * Requests travel from the submitters to the writer, and from the writer
+ * to the receive path, over lock-free multi-producer single-consumer
+ * stacks linked through req->aux.  The consumer takes the whole stack at
+ * once and puts it back in submission order on its private list, so the
+ * only shared state between the two sides is a pair of pointers.
+ */
+
+static void p9_req_push(struct p9_req_t **head, struct p9_req_t *req)
+{
+	struct p9_req_t *first;
+
+	do {
+		first = ACCESS_ONCE(*head);
+		req->aux = first;
+	} while (cmpxchg(head, first, req) != first);
+}
+
+static void p9_req_splice(struct p9_req_t **head, struct list_head *list)
+{
+	struct p9_req_t *req, *next;
+	LIST_HEAD(batch);
+
+	for (req = xchg(head, NULL); req; req = next) {
+		next = req->aux;
+		list_add(&req->req_list, &batch);
+	}
+	list_splice_tail(&batch, list);
+}
+
+static void p9_conn_fail(struct p9_conn *m, struct list_head *list)
+{
+	struct p9_req_t *req, *rtmp;
+
+	list_for_each_entry_safe(req, rtmp, list, req_list) {
+		P9_DPRINTK(P9_DEBUG_ERROR, "call back req %p\n", req);
+		list_del(&req->req_list);
+		req->status = REQ_STATUS_ERROR;
+		if (!req->t_err)
+			req->t_err = m->err;
+		p9_client_cb(m->client, req);
+	}
+}
+
+/**
+ * p9_conn_reap - fail the requests of a cancelled connection
+ * @m: mux data
+ *
+ * The writer and the receive path each own their request lists, so a
+ * side is only emptied here if it can be claimed.  A busy side is reaped
+ * by its owner on the way out (see p9_read_done and p9_write_done).
+ */
+
+static void p9_conn_reap(struct p9_conn *m)
+{
+	LIST_HEAD(cancel_list);
+
+	if (m->err >= 0)
+		return;
+
+	if (!test_and_set_bit(Wworksched, &m->wsched)) {
+		p9_req_splice(&m->unsent, &m->unsent_req_list);
+		list_splice_init(&m->unsent_req_list, &cancel_list);
+		m->wpos = m->wsize = 0;
+		clear_bit(Wworksched, &m->wsched);
+	}
+
+	if (!test_and_set_bit(Rworksched, &m->wsched)) {
+		p9_req_splice(&m->sent, &m->req_list);
+		list_splice_init(&m->req_list, &cancel_list);
+		m->req = NULL;
+		m->rbuf = NULL;
+		m->rpos = m->rsize = 0;
+		clear_bit(Rworksched, &m->wsched);
+	}
+
+	p9_conn_fail(m, &cancel_list);
+}
+
 /**
  * p9_conn_cancel - cancel all pending requests with error
  * @m: mux data
@@ -183,40 +302,26 @@ static void p9_mux_poll_stop(struct p9_conn *m)
 
 static void p9_conn_cancel(struct p9_conn *m, int err)
 {
-	struct p9_req_t *req, *rtmp;
 	unsigned long flags;
-	LIST_HEAD(cancel_list);
 
 	P9_DPRINTK(P9_DEBUG_ERROR, "mux %p err %d\n", m, err);
 
-	spin_lock_irqsave(&m->client->lock, flags);
-
-	if (m->err) {
-		spin_unlock_irqrestore(&m->client->lock, flags);
-		return;
+	spin_lock_irqsave(&m->lock, flags);
+	if (!m->err) {
+		m->err = err;
+		if (m->leader)
+			wake_up_process(m->leader);
 	}
+	spin_unlock_irqrestore(&m->lock, flags);
 
-	m->err = err;
-
-	list_for_each_entry_safe(req, rtmp, &m->req_list, req_list) {
-		req->status = REQ_STATUS_ERROR;
-		if (!req->t_err)
-			req->t_err = err;
-		list_move(&req->req_list, &cancel_list);
-	}
-	list_for_each_entry_safe(req, rtmp, &m->unsent_req_list, req_list) {
-		req->status = REQ_STATUS_ERROR;
-		if (!req->t_err)
-			req->t_err = err;
-		list_move(&req->req_list, &cancel_list);
-	}
-	spin_unlock_irqrestore(&m->client->lock, flags);
+	p9_conn_reap(m);
+}
 
-	list_for_each_entry_safe(req, rtmp, &cancel_list, req_list) {
-		P9_DPRINTK(P9_DEBUG_ERROR, "call back req %p\n", req);
-		list_del(&req->req_list);
-		p9_client_cb(m->client, req);
-	}
+static void p9_read_done(struct p9_conn *m)
+{
+	clear_bit(Rworksched, &m->wsched);
+	smp_mb__after_clear_bit();
+	p9_conn_reap(m);
 }
 
 static unsigned int
@@ -280,22 +385,46 @@ static int p9_fd_read(struct p9_client *client, void *v, int len)
 }
 
 /**
- * p9_read_work - called when there is some data to be read from a transport
- * @work: container of work to be done
+ * p9_read_flushed - retire the request a Rflush answers
+ * @m: mux data
+ * @freq: the flush request
  *
+ * Only the receive path touches the sent list, so the flushed request is
+ * taken off it here, before the flushing task is woken and frees it.
  */
 
-static void p9_read_work(struct work_struct *work)
+static void p9_read_flushed(struct p9_conn *m, struct p9_req_t *freq)
 {
-	int n, err;
-	struct p9_conn *m;
+	struct p9_req_t *oldreq;
+	u16 oldtag;
+
+	oldtag = le16_to_cpu(*(__le16 *) (freq->tc->sdata + 7));
+	oldreq = p9_tag_lookup(m->client, oldtag);
+	if (oldreq->status == REQ_STATUS_FLSH) {
+		P9_DPRINTK(P9_DEBUG_TRANS, "mux %p flushed tag %d\n", m,
+								oldtag);
+		list_del(&oldreq->req_list);
+		oldreq->status = REQ_STATUS_FLSHD;
+	}
+}
 
-	m = container_of(work, struct p9_conn, rq);
+/**
+ * p9_read_once - read what is available and complete finished replies
+ * @m: connection to read from
+ *
+ * The caller must own the receive side of the connection (Rworksched).
+ * Returns the number of bytes read, -EAGAIN if there was nothing to read,
+ * or a negative error after the connection has been cancelled.
+ */
+
+static int p9_read_once(struct p9_conn *m)
+{
+	int n, err;
 
 	if (m->err < 0)
-		return;
+		return m->err;
 
-	P9_DPRINTK(P9_DEBUG_TRANS, "start mux %p pos %d\n", m, m->rpos);
+	p9_req_splice(&m->sent, &m->req_list);
 
 	if (!m->rbuf) {
 		m->rbuf = m->tmp_buf;
@@ -309,12 +438,12 @@ static void p9_read_work(struct work_struct *work)
 	err = p9_fd_read(m->client, m->rbuf + m->rpos,
 						m->rsize - m->rpos);
 	P9_DPRINTK(P9_DEBUG_TRANS, "mux %p got %d bytes\n", m, err);
-	if (err == -EAGAIN) {
-		clear_bit(Rworksched, &m->wsched);
-		return;
-	}
+	if (err == -EAGAIN)
+		return err;
 
-	if (err <= 0)
+	if (err == 0)
+		err = -EREMOTEIO;
+	if (err < 0)
 		goto error;
 
 	m->rpos += err;
@@ -361,11 +490,17 @@ static void p9_read_work(struct work_struct *work)
 	/* not an else because some packets (like clunk) have no payload */
 	if ((m->req) && (m->rpos == m->rsize)) { /* packet is read in */
 		P9_DPRINTK(P9_DEBUG_TRANS, "got new packet\n");
-		spin_lock(&m->client->lock);
+		/*
+		 * The request (or the one a Rflush answers) may have been
+		 * sent since the splice above; a reply without payload
+		 * completes in the same call.
+		 */
+		p9_req_splice(&m->sent, &m->req_list);
+		if (m->req->tc->id == P9_TFLUSH)
+			p9_read_flushed(m, m->req);
 		if (m->req->status != REQ_STATUS_ERROR)
 			m->req->status = REQ_STATUS_RCVD;
 		list_del(&m->req->req_list);
-		spin_unlock(&m->client->lock);
 		p9_client_cb(m->client, m->req);
 		m->rbuf = NULL;
 		m->rpos = 0;
@@ -373,6 +508,34 @@ static void p9_read_work(struct work_struct *work)
 		m->req = NULL;
 	}
 
+	return err;
+
+error:
+	p9_conn_cancel(m, err);
+	return err;
+}
+
+/**
+ * p9_read_work - called when there is some data to be read from a transport
+ * @work: container of work to be done
+ *
+ */
+
+static void p9_read_work(struct work_struct *work)
+{
+	int n, err;
+	struct p9_conn *m;
+
+	m = container_of(work, struct p9_conn, rq);
+
+	P9_DPRINTK(P9_DEBUG_TRANS, "start mux %p pos %d\n", m, m->rpos);
+
+	err = p9_read_once(m);
+	if (err < 0) {
+		p9_read_done(m);
+		return;
+	}
+
 	if (!list_empty(&m->req_list)) {
 		if (test_and_clear_bit(Rpending, &m->wsched))
 			n = POLLIN;
@@ -383,14 +546,9 @@ static void p9_read_work(struct work_struct *work)
 			P9_DPRINTK(P9_DEBUG_TRANS, "sched read work %p\n", m);
 			queue_work(p9_mux_wq, &m->rq);
 		} else
-			clear_bit(Rworksched, &m->wsched);
+			p9_read_done(m);
 	} else
-		clear_bit(Rworksched, &m->wsched);
-
-	return;
-error:
-	p9_conn_cancel(m, err);
-	clear_bit(Rworksched, &m->wsched);
+		p9_read_done(m);
 }
 
 /**
@@ -427,6 +585,42 @@ static int p9_fd_write(struct p9_client *client, void *v, int len)
 	return ret;
 }
 
+/**
+ * p9_write_kick - schedule the write work if the transport can take data
+ * @m: mux data
+ *
+ */
+
+static void p9_write_kick(struct p9_conn *m)
+{
+	int n;
+
+	if (test_and_clear_bit(Wpending, &m->wsched))
+		n = POLLOUT;
+	else
+		n = p9_fd_poll(m->client, NULL);
+
+	if (n & POLLOUT && !test_and_set_bit(Wworksched, &m->wsched)) {
+		P9_DPRINTK(P9_DEBUG_TRANS, "sched write work %p\n", m);
+		queue_work(p9_mux_wq, &m->wq);
+	}
+}
+
+static void p9_write_done(struct p9_conn *m)
+{
+	int queued;
+
+	/* the private queue is only ours to look at while we are the writer */
+	queued = !list_empty(&m->unsent_req_list);
+	clear_bit(Wworksched, &m->wsched);
+	smp_mb__after_clear_bit();
+	if (m->err < 0)
+		p9_conn_reap(m);
+	else if (queued || m->unsent)
+		/* left over, or queued while we held the writer */
+		p9_write_kick(m);
+}
+
 /**
  * p9_write_work - called when a transport can send some data
  * @work: container for work to be done
@@ -442,27 +636,32 @@ static void p9_write_work(struct work_struct *work)
 	m = container_of(work, struct p9_conn, wq);
 
 	if (m->err < 0) {
-		clear_bit(Wworksched, &m->wsched);
+		p9_write_done(m);
 		return;
 	}
 
 	if (!m->wsize) {
+		p9_req_splice(&m->unsent, &m->unsent_req_list);
 		if (list_empty(&m->unsent_req_list)) {
-			clear_bit(Wworksched, &m->wsched);
+			p9_write_done(m);
 			return;
 		}
 
-		spin_lock(&m->client->lock);
 		req = list_entry(m->unsent_req_list.next, struct p9_req_t,
 			       req_list);
-		req->status = REQ_STATUS_SENT;
+		list_del(&req->req_list);
+
+		/*
+		 * A request cancelled while queued is still sent as FLSH so
+		 * that the Tflush behind it finds it on the sent list.
+		 */
+		cmpxchg(&req->status, REQ_STATUS_UNSENT, REQ_STATUS_SENT);
 		P9_DPRINTK(P9_DEBUG_TRANS, "move req %p\n", req);
-		list_move_tail(&req->req_list, &m->req_list);
+		p9_req_push(&m->sent, req);
 
 		m->wbuf = req->tc->sdata;
 		m->wsize = req->tc->size;
 		m->wpos = 0;
-		spin_unlock(&m->client->lock);
 	}
 
 	P9_DPRINTK(P9_DEBUG_TRANS, "mux %p pos %d size %d\n", m, m->wpos,
@@ -471,7 +670,7 @@ static void p9_write_work(struct work_struct *work)
 	err = p9_fd_write(m->client, m->wbuf + m->wpos, m->wsize - m->wpos);
 	P9_DPRINTK(P9_DEBUG_TRANS, "mux %p sent %d bytes\n", m, err);
 	if (err == -EAGAIN) {
-		clear_bit(Wworksched, &m->wsched);
+		p9_write_done(m);
 		return;
 	}
 
@@ -486,7 +685,7 @@ static void p9_write_work(struct work_struct *work)
 	if (m->wpos == m->wsize)
 		m->wpos = m->wsize = 0;
 
-	if (m->wsize == 0 && !list_empty(&m->unsent_req_list)) {
+	if (m->wsize == 0 && (m->unsent || !list_empty(&m->unsent_req_list))) {
 		if (test_and_clear_bit(Wpending, &m->wsched))
 			n = POLLOUT;
 		else
@@ -496,15 +695,15 @@ static void p9_write_work(struct work_struct *work)
 			P9_DPRINTK(P9_DEBUG_TRANS, "sched write work %p\n", m);
 			queue_work(p9_mux_wq, &m->wq);
 		} else
-			clear_bit(Wworksched, &m->wsched);
+			p9_write_done(m);
 	} else
-		clear_bit(Wworksched, &m->wsched);
+		p9_write_done(m);
 
 	return;
 
 error:
 	p9_conn_cancel(m, err);
-	clear_bit(Wworksched, &m->wsched);
+	p9_write_done(m);
 }
 
 static int p9_pollwake(wait_queue_t *wait, unsigned mode, int sync, void *key)
@@ -515,6 +714,14 @@ static int p9_pollwake(wait_queue_t *wait, unsigned mode, int sync, void *key)
 	unsigned long flags;
 	DECLARE_WAITQUEUE(dummy_wait, p9_poll_task);
 
+	spin_lock_irqsave(&m->lock, flags);
+	if (m->leader) {
+		/* the reading task is waiting, skip the workqueue hops */
+		set_bit(Rpending, &m->wsched);
+		wake_up_process(m->leader);
+	}
+	spin_unlock_irqrestore(&m->lock, flags);
+
 	spin_lock_irqsave(&p9_poll_lock, flags);
 	if (list_empty(&m->poll_pending_link))
 		list_add_tail(&m->poll_pending_link, &p9_poll_pending_list);
@@ -561,14 +768,17 @@ p9_pollwait(struct file *filp, wait_queue_head_t *wait_address, poll_table *p)
 /**
  * p9_conn_create - allocate and initialize the per-session mux data
  * @client: client instance
+ * @opts: transport options
  *
  * Note: Creates the polling task if this is the first session.
  */
 
-static struct p9_conn *p9_conn_create(struct p9_client *client)
+static struct p9_conn *
+p9_conn_create(struct p9_client *client, struct p9_fd_opts *opts)
 {
 	int n;
 	struct p9_conn *m;
+	struct p9_trans_fd *ts = client->trans;
 
 	P9_DPRINTK(P9_DEBUG_TRANS, "client %p msize %d\n", client,
 								client->msize);
@@ -578,6 +788,7 @@ static struct p9_conn *p9_conn_create(struct p9_client *client)
 
 	INIT_LIST_HEAD(&m->mux_list);
 	m->client = client;
+	spin_lock_init(&m->lock);
 
 	INIT_LIST_HEAD(&m->req_list);
 	INIT_LIST_HEAD(&m->unsent_req_list);
@@ -586,6 +797,20 @@ static struct p9_conn *p9_conn_create(struct p9_client *client)
 	INIT_LIST_HEAD(&m->poll_pending_link);
 	init_poll_funcptr(&m->pt, p9_pollwait);
 
+	m->rxleader = opts->rxleader;
+	if (m->rxleader && !(ts->rd->f_flags & O_NONBLOCK)) {
+		P9_DPRINTK(P9_DEBUG_ERROR,
+			"rxleader needs a non-blocking read fd, ignored\n");
+		m->rxleader = 0;
+	}
+
+	m->busypoll = opts->busypoll;
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	/* let the network stack poll the device queue on our behalf */
+	if (m->busypoll && ts->sock)
+		ts->sock->sk->sk_ll_usec = m->busypoll;
+#endif
+
 	n = p9_fd_poll(client, &m->pt);
 	if (n & POLLIN) {
 		P9_DPRINTK(P9_DEBUG_TRANS, "mux %p can read\n", m);
@@ -633,7 +858,8 @@ static void p9_poll_mux(struct p9_conn *m)
 	if (n & POLLOUT) {
 		set_bit(Wpending, &m->wsched);
 		P9_DPRINTK(P9_DEBUG_TRANS, "mux %p can write\n", m);
-		if ((m->wsize || !list_empty(&m->unsent_req_list))
+		if ((m->wsize || m->unsent ||
+		     !list_empty(&m->unsent_req_list))
 		    && !test_and_set_bit(Wworksched, &m->wsched)) {
 			P9_DPRINTK(P9_DEBUG_TRANS, "sched write work %p\n", m);
 			queue_work(p9_mux_wq, &m->wq);
@@ -654,7 +880,6 @@ static void p9_poll_mux(struct p9_conn *m)
 
 static int p9_fd_request(struct p9_client *client, struct p9_req_t *req)
 {
-	int n;
 	struct p9_trans_fd *ts = client->trans;
 	struct p9_conn *m = ts->conn;
 
@@ -663,42 +888,228 @@ static int p9_fd_request(struct p9_client *client, struct p9_req_t *req)
 	if (m->err < 0)
 		return m->err;
 
-	spin_lock(&client->lock);
 	req->status = REQ_STATUS_UNSENT;
-	list_add_tail(&req->req_list, &m->unsent_req_list);
-	spin_unlock(&client->lock);
+	p9_req_push(&m->unsent, req);
 
-	if (test_and_clear_bit(Wpending, &m->wsched))
-		n = POLLOUT;
-	else
-		n = p9_fd_poll(m->client, NULL);
-
-	if (n & POLLOUT && !test_and_set_bit(Wworksched, &m->wsched))
-		queue_work(p9_mux_wq, &m->wq);
+	p9_write_kick(m);
+	if (m->err < 0)
+		p9_conn_reap(m);
 
 	return 0;
 }
 
 static int p9_fd_cancel(struct p9_client *client, struct p9_req_t *req)
 {
+	struct p9_trans_fd *ts = client->trans;
+	struct p9_conn *m = ts->conn;
 	int ret = 1;
 
 	P9_DPRINTK(P9_DEBUG_TRANS, "client %p req %p\n", client, req);
 
-	spin_lock(&client->lock);
-
-	if (req->status == REQ_STATUS_UNSENT) {
-		list_del(&req->req_list);
-		req->status = REQ_STATUS_FLSHD;
-		ret = 0;
-	} else if (req->status == REQ_STATUS_SENT)
-		req->status = REQ_STATUS_FLSH;
+	/* an idle writer can be claimed to pull the request off its queue */
+	if (!test_and_set_bit(Wworksched, &m->wsched)) {
+		p9_req_splice(&m->unsent, &m->unsent_req_list);
+		if (req->status == REQ_STATUS_UNSENT) {
+			list_del(&req->req_list);
+			req->status = REQ_STATUS_FLSHD;
+			ret = 0;
+		}
+		p9_write_done(m);
+	}
 
-	spin_unlock(&client->lock);
+	if (ret && cmpxchg(&req->status, REQ_STATUS_UNSENT,
+				REQ_STATUS_FLSH) != REQ_STATUS_UNSENT)
+		cmpxchg(&req->status, REQ_STATUS_SENT, REQ_STATUS_FLSH);
 
 	return ret;
 }
 
+static void p9_fd_set_leader(struct p9_conn *m, struct task_struct *task)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&m->lock, flags);
+	m->leader = task;
+	spin_unlock_irqrestore(&m->lock, flags);
+}
+
+/**
+ * p9_fd_lead - read replies for the connection until @req is answered
+ * @m: connection to read from
+ * @req: request the calling task is waiting for
+ *
+ * The caller owns the receive side.  When the socket runs dry it sleeps
+ * until p9_pollwake wakes it directly or its own reply is completed.
+ */
+
+static int p9_fd_lead(struct p9_conn *m, struct p9_req_t *req)
+{
+	int err;
+	DEFINE_WAIT(wait);
+
+	while (req->status < REQ_STATUS_RCVD) {
+		err = p9_read_once(m);
+		if (err != -EAGAIN) {
+			if (err < 0)
+				break;
+			continue;
+		}
+
+		prepare_to_wait(req->wq, &wait, TASK_INTERRUPTIBLE);
+		if (req->status < REQ_STATUS_RCVD && m->err == 0 &&
+		    !test_bit(Rpending, &m->wsched)) {
+			if (signal_pending(current)) {
+				finish_wait(req->wq, &wait);
+				return -ERESTARTSYS;
+			}
+			schedule();
+		}
+		finish_wait(req->wq, &wait);
+	}
+
+	return 0;
+}
+
+/**
+ * p9_fd_handoff - give up the receive side after leading
+ * @m: connection
+ *
+ * Wakes the oldest task asleep waiting for a reply so that it takes over
+ * reading.  Requests nobody sleeps on (the caller's own, asynchronous
+ * ones, posted ones not waited for yet) are passed over, and without
+ * rxleader waiters never read, so otherwise the descriptor is polled
+ * again: data that arrived while we held the receive side only set
+ * Rpending.
+ */
+
+static void p9_fd_handoff(struct p9_conn *m)
+{
+	struct p9_req_t *req, *next;
+	int outstanding;
+
+	p9_req_splice(&m->sent, &m->req_list);
+	outstanding = !list_empty(&m->req_list);
+	next = NULL;
+	if (m->rxleader) {
+		list_for_each_entry(req, &m->req_list, req_list) {
+			if (req->status == REQ_STATUS_SENT &&
+			    waitqueue_active(req->wq)) {
+				next = req;
+				break;
+			}
+		}
+	}
+
+	p9_read_done(m);
+	if (m->err < 0)
+		return;
+
+	if (next) {
+		P9_DPRINTK(P9_DEBUG_TRANS, "mux %p hand off to %p\n", m, next);
+		wake_up(next->wq);
+	} else if (outstanding || test_bit(Rpending, &m->wsched))
+		p9_poll_mux(m);
+}
+
+static inline void p9_fd_busy_loop(struct p9_trans_fd *ts)
+{
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	if (ts->sock && sk_can_busy_loop(ts->sock->sk))
+		sk_busy_loop(ts->sock->sk, 1);
+#endif
+}
+
+/**
+ * p9_fd_busy_wait - poll for a reply before going to sleep
+ * @m: connection
+ * @req: request to wait for
+ *
+ * Spins for at most @m->busypoll microseconds.  If the receive side is
+ * free and the descriptor is non-blocking, the socket is read directly
+ * (with the network stack's busy polling where available); otherwise only
+ * the request status is watched.  Returns nonzero if the wait is over.
+ */
+
+static int p9_fd_busy_wait(struct p9_conn *m, struct p9_req_t *req)
+{
+	struct p9_trans_fd *ts = m->client->trans;
+	int lead, err;
+	u64 end;
+
+	atomic_inc(&p9_fd_polls);
+	end = ktime_to_ns(ktime_get()) + (u64)m->busypoll * NSEC_PER_USEC;
+	lead = (ts->rd->f_flags & O_NONBLOCK) &&
+			!test_and_set_bit(Rworksched, &m->wsched);
+
+	while (req->status < REQ_STATUS_RCVD) {
+		if (lead) {
+			p9_fd_busy_loop(ts);
+			err = p9_read_once(m);
+			if (err < 0 && err != -EAGAIN)
+				break;
+		}
+
+		if (need_resched() || signal_pending(current) ||
+		    ktime_to_ns(ktime_get()) >= end)
+			break;
+
+		cpu_relax();
+	}
+
+	if (lead)
+		p9_fd_handoff(m);
+
+	if (req->status == REQ_STATUS_RCVD)
+		atomic_inc(&p9_fd_poll_hits);
+	else
+		atomic_inc(&p9_fd_poll_misses);
+
+	return req->status >= REQ_STATUS_RCVD;
+}
+
+/**
+ * p9_fd_wait - wait for the reply to a request
+ * @client: client instance
+ * @req: request to wait for
+ *
+ * With the rxleader option the first waiter becomes the receive leader
+ * and reads replies itself, waking the owners of other replies directly.
+ * The remaining waiters sleep until their reply arrives or the leader
+ * hands the receive side on to them.
+ */
+
+static int p9_fd_wait(struct p9_client *client, struct p9_req_t *req)
+{
+	int err;
+	struct p9_trans_fd *ts = client->trans;
+	struct p9_conn *m = ts->conn;
+
+	if (m->busypoll && p9_fd_busy_wait(m, req))
+		return 0;
+
+	if (!m->rxleader)
+		return wait_event_interruptible(*req->wq,
+					req->status >= REQ_STATUS_RCVD);
+
+	while (req->status < REQ_STATUS_RCVD) {
+		if (!test_and_set_bit(Rworksched, &m->wsched)) {
+			P9_DPRINTK(P9_DEBUG_TRANS, "mux %p leader %p\n", m,
+								current);
+			p9_fd_set_leader(m, current);
+			err = p9_fd_lead(m, req);
+			p9_fd_set_leader(m, NULL);
+			p9_fd_handoff(m);
+		} else
+			err = wait_event_interruptible(*req->wq,
+				req->status >= REQ_STATUS_RCVD ||
+				!test_bit(Rworksched, &m->wsched));
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
 /**
  * parse_opts - parse mount options into p9_fd_opts structure
  * @params: options string passed from mount
@@ -718,6 +1129,8 @@ static int parse_opts(char *params, struct p9_fd_opts *opts)
 	opts->port = P9_PORT;
 	opts->rfd = ~0;
 	opts->wfd = ~0;
+	opts->busypoll = 0;
+	opts->rxleader = 0;
 
 	if (!params)
 		return 0;
@@ -735,7 +1148,7 @@ static int parse_opts(char *params, struct p9_fd_opts *opts)
 		if (!*p)
 			continue;
 		token = match_token(p, tokens, args);
-		if (token != Opt_err) {
+		if (token < Opt_rxleader) {
 			r = match_int(&args[0], &option);
 			if (r < 0) {
 				P9_DPRINTK(P9_DEBUG_ERROR,
@@ -754,6 +1167,12 @@ static int parse_opts(char *params, struct p9_fd_opts *opts)
 		case Opt_wfdno:
 			opts->wfd = option;
 			break;
+		case Opt_busypoll:
+			opts->busypoll = option;
+			break;
+		case Opt_rxleader:
+			opts->rxleader = 1;
+			break;
 		default:
 			continue;
 		}
@@ -780,6 +1199,7 @@ static int p9_fd_open(struct p9_client *client, int rfd, int wfd)
 		return -EIO;
 	}
 
+	ts->sock = NULL;
 	client->trans = ts;
 	client->status = Connected;
 
@@ -805,6 +1225,7 @@ static int p9_socket_open(struct p9_client *client, struct socket *csocket)
 	}
 
 	((struct p9_trans_fd *)client->trans)->rd->f_flags |= O_NONBLOCK;
+	((struct p9_trans_fd *)client->trans)->sock = csocket;
 
 	return 0;
 }
@@ -824,6 +1245,9 @@ static void p9_conn_destroy(struct p9_conn *m)
 	cancel_work_sync(&m->rq);
 	cancel_work_sync(&m->wq);
 
+	/* works cancelled before they ran leave their bits set */
+	clear_bit(Rworksched, &m->wsched);
+	clear_bit(Wworksched, &m->wsched);
 	p9_conn_cancel(m, -ECONNRESET);
 
 	m->client = NULL;
@@ -920,7 +1344,7 @@ p9_fd_create_tcp(struct p9_client *client, const char *addr, char *args)
 		goto error;
 
 	p = (struct p9_trans_fd *) client->trans;
-	p->conn = p9_conn_create(client);
+	p->conn = p9_conn_create(client, &opts);
 	if (IS_ERR(p->conn)) {
 		err = PTR_ERR(p->conn);
 		p->conn = NULL;
@@ -944,10 +1368,15 @@ p9_fd_create_unix(struct p9_client *client, const char *addr, char *args)
 	int err;
 	struct socket *csocket;
 	struct sockaddr_un sun_server;
+	struct p9_fd_opts opts;
 	struct p9_trans_fd *p = NULL; /* this gets allocated in p9_fd_open */
 
 	csocket = NULL;
 
+	err = parse_opts(args, &opts);
+	if (err < 0)
+		return err;
+
 	if (strlen(addr) > UNIX_PATH_MAX) {
 		P9_EPRINTK(KERN_ERR, "p9_trans_unix: address too long: %s\n",
 			addr);
@@ -972,7 +1401,7 @@ p9_fd_create_unix(struct p9_client *client, const char *addr, char *args)
 		goto error;
 
 	p = (struct p9_trans_fd *) client->trans;
-	p->conn = p9_conn_create(client);
+	p->conn = p9_conn_create(client, &opts);
 	if (IS_ERR(p->conn)) {
 		err = PTR_ERR(p->conn);
 		p->conn = NULL;
@@ -989,6 +1418,101 @@ error:
 	return err;
 }
 
+#ifdef AF_VSOCK
+
+#ifndef VMADDR_CID_LOCAL
+#define VMADDR_CID_LOCAL 1
+#endif
+
+/*
+ * The address of a vsock mount is a context id, either as a number or as
+ * "host" for the hypervisor side or "local" for the loopback transport.
+ */
+static int p9_vsock_cid(const char *addr, unsigned int *cid)
+{
+	char *end;
+
+	if (!strcmp(addr, "host")) {
+		*cid = VMADDR_CID_HOST;
+		return 0;
+	}
+	if (!strcmp(addr, "local")) {
+		*cid = VMADDR_CID_LOCAL;
+		return 0;
+	}
+
+	*cid = simple_strtoul(addr, &end, 0);
+	if (end == addr || *end)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int
+p9_fd_create_vsock(struct p9_client *client, const char *addr, char *args)
+{
+	int err;
+	struct socket *csocket;
+	struct sockaddr_vm svm_server;
+	struct p9_fd_opts opts;
+	struct p9_trans_fd *p = NULL; /* this gets allocated in p9_fd_open */
+
+	err = parse_opts(args, &opts);
+	if (err < 0)
+		return err;
+
+	memset(&svm_server, 0, sizeof(svm_server));
+	svm_server.svm_family = AF_VSOCK;
+	svm_server.svm_port = opts.port;
+	if (p9_vsock_cid(addr, &svm_server.svm_cid) < 0) {
+		P9_EPRINTK(KERN_ERR, "p9_trans_vsock: bad cid: %s\n", addr);
+		return -EINVAL;
+	}
+
+	csocket = NULL;
+	sock_create_kern(PF_VSOCK, SOCK_STREAM, 0, &csocket);
+	if (!csocket) {
+		P9_EPRINTK(KERN_ERR,
+			"p9_trans_vsock: problem creating socket\n");
+		err = -EIO;
+		goto error;
+	}
+
+	err = csocket->ops->connect(csocket,
+				    (struct sockaddr *)&svm_server,
+				    sizeof(struct sockaddr_vm), 0);
+	if (err < 0) {
+		P9_EPRINTK(KERN_ERR,
+			"p9_trans_vsock: problem connecting socket to %s:%d\n",
+			addr, opts.port);
+		goto error;
+	}
+
+	err = p9_socket_open(client, csocket);
+	if (err < 0)
+		goto error;
+
+	p = (struct p9_trans_fd *) client->trans;
+	p->conn = p9_conn_create(client, &opts);
+	if (IS_ERR(p->conn)) {
+		err = PTR_ERR(p->conn);
+		p->conn = NULL;
+		goto error;
+	}
+
+	return 0;
+
+error:
+	if (csocket)
+		sock_release(csocket);
+
+	kfree(p);
+
+	return err;
+}
+
+#endif /* AF_VSOCK */
+
 static int
 p9_fd_create(struct p9_client *client, const char *addr, char *args)
 {
@@ -1008,7 +1532,7 @@ p9_fd_create(struct p9_client *client, const char *addr, char *args)
 		goto error;
 
 	p = (struct p9_trans_fd *) client->trans;
-	p->conn = p9_conn_create(client);
+	p->conn = p9_conn_create(client, &opts);
 	if (IS_ERR(p->conn)) {
 		err = PTR_ERR(p->conn);
 		p->conn = NULL;
@@ -1030,6 +1554,7 @@ static struct p9_trans_module p9_tcp_trans = {
 	.close = p9_fd_close,
 	.request = p9_fd_request,
 	.cancel = p9_fd_cancel,
+	.wait = p9_fd_wait,
 	.owner = THIS_MODULE,
 };
 
@@ -1041,6 +1566,7 @@ static struct p9_trans_module p9_unix_trans = {
 	.close = p9_fd_close,
 	.request = p9_fd_request,
 	.cancel = p9_fd_cancel,
+	.wait = p9_fd_wait,
 	.owner = THIS_MODULE,
 };
 
@@ -1052,9 +1578,24 @@ static struct p9_trans_module p9_fd_trans = {
 	.close = p9_fd_close,
 	.request = p9_fd_request,
 	.cancel = p9_fd_cancel,
+	.wait = p9_fd_wait,
 	.owner = THIS_MODULE,
 };
 
+#ifdef AF_VSOCK
+static struct p9_trans_module p9_vsock_trans = {
+	.name = "vsock",
+	.maxsize = MAX_SOCK_BUF,
+	.def = 0,
+	.create = p9_fd_create_vsock,
+	.close = p9_fd_close,
+	.request = p9_fd_request,
+	.cancel = p9_fd_cancel,
+	.wait = p9_fd_wait,
+	.owner = THIS_MODULE,
+};
+#endif
+
 /**
  * p9_poll_proc - poll worker thread
  * @a: thread state and arguments
@@ -1098,6 +1639,27 @@ static int p9_poll_proc(void *a)
 	return 0;
 }
 
+static int p9_fd_stats_show(struct seq_file *s, void *unused)
+{
+	seq_printf(s, "polls: %d\nhits: %d\nmisses: %d\n",
+		atomic_read(&p9_fd_polls), atomic_read(&p9_fd_poll_hits),
+		atomic_read(&p9_fd_poll_misses));
+	return 0;
+}
+
+static int p9_fd_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, p9_fd_stats_show, NULL);
+}
+
+static const struct file_operations p9_fd_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = p9_fd_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 int p9_trans_fd_init(void)
 {
 	p9_mux_wq = create_workqueue("v9fs");
@@ -1116,16 +1678,27 @@ int p9_trans_fd_init(void)
 	v9fs_register_trans(&p9_tcp_trans);
 	v9fs_register_trans(&p9_unix_trans);
 	v9fs_register_trans(&p9_fd_trans);
+#ifdef AF_VSOCK
+	v9fs_register_trans(&p9_vsock_trans);
+#endif
+
+	if (p9_debugfs_root)
+		p9_fd_debugfs = debugfs_create_file("fd_busy_poll", S_IRUGO,
+				p9_debugfs_root, NULL, &p9_fd_stats_fops);
 
 	return 0;
 }
 
 void p9_trans_fd_exit(void)
 {
+	debugfs_remove(p9_fd_debugfs);
 	kthread_stop(p9_poll_task);
 	v9fs_unregister_trans(&p9_tcp_trans);
 	v9fs_unregister_trans(&p9_unix_trans);
 	v9fs_unregister_trans(&p9_fd_trans);
+#ifdef AF_VSOCK
+	v9fs_unregister_trans(&p9_vsock_trans);
+#endif
 
 	destroy_workqueue(p9_mux_wq);
 }
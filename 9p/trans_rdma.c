@@ -39,7 +39,9 @@
 #include <linux/idr.h>
 #include <linux/file.h>
 #include <linux/parser.h>
-#include <linux/semaphore.h>
+#include <linux/interrupt.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
 #include "9p.h"
 #include "client.h"
 #include "transport.h"
@@ -59,6 +61,114 @@
 						 * of 64k */
 
 #define P9_RDMA_MAX_SGE (P9_RDMA_MAXSIZE >> PAGE_SHIFT)
+
+/* completions reaped per ib_poll_cq call, and per interrupt or tasklet run */
+#define P9_RDMA_CQ_BATCH	16
+#define P9_RDMA_CQ_BUDGET	64
+
+/* size of a shared receive queue, in buffers */
+#define P9_RDMA_SRQ_DEPTH	256
+
+/* largest message with direct data placement, see below */
+#define P9_RDMA_DDP_MAXSIZE	(1024*1024)
+/* pages a chunk can span, its buffer need not be page aligned */
+#define P9_RDMA_DDP_MAXPAGES	((P9_RDMA_DDP_MAXSIZE >> PAGE_SHIFT) + 1)
+
+/*
+ * Direct data placement
+ *
+ * Without it, every message travels by send/recv through the pre-mapped
+ * buffers, which limits msize to P9_RDMA_MAXSIZE.  With the ddp mount
+ * option the client offers it in its connect private data:
+ *
+ *	struct p9_rdma_connect { magic, version, flags, max_msize }
+ *
+ * and uses it if the server's accept private data carries the same magic
+ * and version with P9_RDMA_F_DDP set; max_msize then bounds msize.  A
+ * server that ignores the private data gets plain 9P as before.
+ *
+ * Once negotiated, every send in both directions starts with a struct
+ * p9_rdma_hdr, followed by the 9P message unless it was moved to a chunk:
+ *
+ *  - a T-message that doesn't fit in P9_RDMA_MAXSIZE, the inline limit
+ *    both sides size their receive buffers for, is sent as a header alone
+ *    with P9_RDMA_CALL_CHUNK set; the server RDMA reads the message from
+ *    call.addr/call.rkey (call.len bytes);
+ *  - a request whose reply may not fit inline (a large Tread) offers a
+ *    reply chunk, P9_RDMA_REPLY_CHUNK with reply.addr/rkey/len; the server
+ *    may RDMA write the whole R-message there and then send a header alone
+ *    with P9_RDMA_REPLY_CHUNK set and len the size of the R-message.
+ *
+ * The 9P framing itself is unchanged, and tag in the header always names
+ * the 9P tag of the message.  All fields are big endian.  Each chunk is
+ * registered with a fast registration memory region of its own, posted
+ * ahead of the send, and invalidated when the request gets its reply, is
+ * flushed, or the connection is torn down, so the server can only reach
+ * the buffers of requests in flight.  Devices without fast registration
+ * don't offer ddp.
+ */
+#define P9_RDMA_MAGIC		0x39524d41	/* "9RMA" */
+#define P9_RDMA_VERSION		1
+#define P9_RDMA_F_DDP		0x01
+
+#define P9_RDMA_CALL_CHUNK	0x0001
+#define P9_RDMA_REPLY_CHUNK	0x0002
+
+struct p9_rdma_connect {
+	__be32 magic;
+	u8 version;
+	u8 flags;
+	__be16 reserved;
+	__be32 max_msize;
+} __attribute__((packed));
+
+struct p9_rdma_chunk {
+	__be64 addr;
+	__be32 rkey;
+	__be32 len;
+} __attribute__((packed));
+
+struct p9_rdma_hdr {
+	__be16 flags;
+	__be16 tag;
+	__be32 len;
+	struct p9_rdma_chunk call;
+	struct p9_rdma_chunk reply;
+} __attribute__((packed));
+
+/**
+ * p9_rdma_mr - fast registration memory region for a chunk
+ * @mr: The region, registered only while a request uses it
+ * @pl: Page list the region is registered with
+ */
+struct p9_rdma_mr {
+	struct ib_mr *mr;
+	struct ib_fast_reg_page_list *pl;
+};
+
+/**
+ * p9_rdma_ddp - chunks mapped for one request
+ * @call_busa: Bus address of the T-message, if sent as a call chunk
+ * @call_len: Length of the call chunk, 0 if none
+ * @call_mr: Region the server reads the call chunk through
+ * @reply_busa: Bus address of the reply buffer, if offered
+ * @reply_len: Length of the reply chunk, 0 if none
+ * @reply_mr: Region the server writes the reply chunk through
+ * @reg_wr: Registrations of the regions, posted ahead of the send
+ * @nr_reg: Number of @reg_wr built
+ * @posted: The registrations were posted, so the regions are valid
+ */
+struct p9_rdma_ddp {
+	dma_addr_t call_busa;
+	u32 call_len;
+	struct p9_rdma_mr *call_mr;
+	dma_addr_t reply_busa;
+	u32 reply_len;
+	struct p9_rdma_mr *reply_mr;
+	struct ib_send_wr reg_wr[2];
+	int nr_reg;
+	int posted;
+};
 /**
  * struct p9_trans_rdma - RDMA transport instance
  *
@@ -69,14 +179,32 @@
  * @cq: Completion Queue pointer
  * @dm_mr: DMA Memory Region pointer
  * @lkey: The local access only memory region key
+ * @mrs: Fast registration regions for chunks, two per credit
+ * @nr_mrs: Number of @mrs
+ * @mr_map: Bitmap of the regions in use
+ * @ddp: Direct data placement negotiated with the server
+ * @max_msize: Largest message the server accepts with @ddp
  * @timeout: Number of uSecs to wait for connection management events
  * @sq_depth: The depth of the Send Queue
- * @sq_sem: Semaphore for the SQ
+ * @sq_slots: SQ entries not currently posted
  * @rq_depth: The depth of the Receive Queue.
- * @rq_count: Count of requests in the Receive Queue.
+ * @credits: Requests that may still be sent before a reply comes back
+ * @send_wait: Where requests wait for a credit or an SQ slot
+ * @bufsize: Size of each pool buffer, the largest message
+ * @srq: Shared receive queue, if receives come from one
+ * @recv_ctx: Receive contexts, one per RQ entry, always posted
+ * @send_ctx: Send contexts, one per SQ entry
+ * @send_map: Bitmap of the send contexts currently posted
  * @addr: The remote peer's address
  * @req_lock: Protects the active request list
+ * @cq_tasklet: Polls the CQ when an interrupt's budget ran out
+ * @wc: Completions being handled, only touched by the CQ poller
  * @cm_done: Completion event for connection management tracking
+ *
+ * Flow control is by credits: every request in flight needs a receive
+ * buffer for its reply, so @credits starts at @rq_depth and a credit is
+ * returned when the reply is received or the request is flushed.  Neither
+ * credits nor send contexts take a lock to get or give back.
  */
 struct p9_trans_rdma {
 	enum {
@@ -94,14 +222,28 @@ struct p9_trans_rdma {
 	struct ib_cq *cq;
 	struct ib_mr *dma_mr;
 	u32 lkey;
+	struct p9_rdma_mr *mrs;
+	int nr_mrs;
+	unsigned long *mr_map;
+	int ddp;
+	u32 max_msize;
 	long timeout;
 	int sq_depth;
-	struct semaphore sq_sem;
+	atomic_t sq_slots;
 	int rq_depth;
-	atomic_t rq_count;
+	atomic_t credits;
+	wait_queue_head_t send_wait;
+	int bufsize;
+	struct p9_rdma_srq *srq;
+	struct p9_rdma_context *recv_ctx;
+	struct p9_rdma_context *send_ctx;
+	unsigned long *send_map;
 	struct sockaddr_in addr;
 	spinlock_t req_lock;
 
+	struct tasklet_struct cq_tasklet;
+	struct ib_wc wc[P9_RDMA_CQ_BATCH];
+
 	struct completion cm_done;
 };
 
@@ -109,20 +251,53 @@ struct p9_trans_rdma {
  * p9_rdma_context - Keeps track of in-process WR
  *
  * @wc_op: The original WR op for when the CQE completes in error.
- * @busa: Bus address to unmap when the WR completes
+ * @busa: Bus address of @buf, mapped for the life of the transport
+ * @buf: Pre-registered buffer the WR sends from or receives into
  * @req: Keeps track of requests (send)
- * @rc: Keepts track of replies (receive)
+ *
+ * Contexts and their buffers are allocated and mapped once per connection,
+ * so posting a request or a receive does no allocation or mapping.
  */
-struct p9_rdma_req;
 struct p9_rdma_context {
 	enum ib_wc_opcode wc_op;
 	dma_addr_t busa;
-	union {
-		struct p9_req_t *req;
-		struct p9_fcall *rc;
-	};
+	char *buf;
+	struct p9_req_t *req;
 };
 
+/**
+ * p9_rdma_srq - Receive queue shared by the mounts on a device
+ * @list: Links the shared queues
+ * @ref: Mounts using the queue
+ * @device: The device it belongs to
+ * @pd: Protection Domain, shared by the mounts too
+ * @dma_mr: DMA Memory Region for the buffers, if the device needs one
+ * @lkey: The local access key of the buffers
+ * @srq: Shared Receive Queue pointer
+ * @depth: Number of receive buffers
+ * @bufsize: Size of each buffer
+ * @ctx: Receive contexts, always posted
+ *
+ * Replies are completed on the CQ of the connection they arrived on, so
+ * only the buffers are shared.  A server that finds no buffer posted gets
+ * an RNR NAK and retries.
+ */
+struct p9_rdma_srq {
+	struct list_head list;
+	struct kref ref;
+	struct ib_device *device;
+	struct ib_pd *pd;
+	struct ib_mr *dma_mr;
+	u32 lkey;
+	struct ib_srq *srq;
+	int depth;
+	int bufsize;
+	struct p9_rdma_context *ctx;
+};
+
+static LIST_HEAD(p9_rdma_srqs);
+static DEFINE_MUTEX(p9_rdma_srq_lock);
+
 /**
  * p9_rdma_opts - Collection of mount options
  * @port: port of connection
@@ -130,12 +305,16 @@ struct p9_rdma_context {
  * to be any deeper than the number of threads used in the client
  * @rq_depth: The depth of the RQ. Should be greater than or equal to SQ depth
  * @timeout: Time to wait in msecs for CM events
+ * @ddp: Offer direct data placement to the server
+ * @srq: Receive into a queue shared with the other mounts on the device
  */
 struct p9_rdma_opts {
 	short port;
 	int sq_depth;
 	int rq_depth;
 	long timeout;
+	int ddp;
+	int srq;
 };
 
 /*
@@ -143,7 +322,10 @@ struct p9_rdma_opts {
  */
 enum {
 	/* Options that take integer arguments */
-	Opt_port, Opt_rq_depth, Opt_sq_depth, Opt_timeout, Opt_err,
+	Opt_port, Opt_rq_depth, Opt_sq_depth, Opt_timeout,
+	/* Options that take no arguments */
+	Opt_ddp, Opt_srq,
+	Opt_err,
 };
 
 static match_table_t tokens = {
@@ -151,6 +333,8 @@ static match_table_t tokens = {
 	{Opt_sq_depth, "sq=%u"},
 	{Opt_rq_depth, "rq=%u"},
 	{Opt_timeout, "timeout=%u"},
+	{Opt_ddp, "ddp"},
+	{Opt_srq, "srq"},
 	{Opt_err, NULL},
 };
 
@@ -173,6 +357,8 @@ static int parse_opts(char *params, struct p9_rdma_opts *opts)
 	opts->sq_depth = P9_RDMA_SQ_DEPTH;
 	opts->rq_depth = P9_RDMA_RQ_DEPTH;
 	opts->timeout = P9_RDMA_TIMEOUT;
+	opts->ddp = 0;
+	opts->srq = 0;
 
 	if (!params)
 		return 0;
@@ -190,12 +376,14 @@ static int parse_opts(char *params, struct p9_rdma_opts *opts)
 		if (!*p)
 			continue;
 		token = match_token(p, tokens, args);
-		r = match_int(&args[0], &option);
-		if (r < 0) {
-			P9_DPRINTK(P9_DEBUG_ERROR,
-				   "integer field, but no integer?\n");
-			ret = r;
-			continue;
+		if (token < Opt_ddp) {
+			r = match_int(&args[0], &option);
+			if (r < 0) {
+				P9_DPRINTK(P9_DEBUG_ERROR,
+					   "integer field, but no integer?\n");
+				ret = r;
+				continue;
+			}
 		}
 		switch (token) {
 		case Opt_port:
@@ -210,6 +398,12 @@ static int parse_opts(char *params, struct p9_rdma_opts *opts)
 		case Opt_timeout:
 			opts->timeout = option;
 			break;
+		case Opt_ddp:
+			opts->ddp = 1;
+			break;
+		case Opt_srq:
+			opts->srq = 1;
+			break;
 		default:
 			continue;
 		}
@@ -220,6 +414,37 @@ static int parse_opts(char *params, struct p9_rdma_opts *opts)
 	return 0;
 }
 
+/**
+ * rdma_accept_ddp - check the server's answer to our ddp offer
+ * @rdma: transport
+ * @data: accept private data
+ * @len: length of @data
+ *
+ */
+static void rdma_accept_ddp(struct p9_trans_rdma *rdma, const void *data,
+								u8 len)
+{
+	const struct p9_rdma_connect *cp = data;
+
+	if (!rdma->mrs || !cp || len < sizeof(*cp))
+		return;
+
+	if (be32_to_cpu(cp->magic) != P9_RDMA_MAGIC ||
+	    cp->version != P9_RDMA_VERSION || !(cp->flags & P9_RDMA_F_DDP))
+		return;
+
+	rdma->ddp = 1;
+	rdma->max_msize = be32_to_cpu(cp->max_msize);
+}
+
+/* let waiting requests see a returned credit or slot, or a dead link */
+static void rdma_wake_senders(struct p9_trans_rdma *rdma)
+{
+	smp_mb();
+	if (waitqueue_active(&rdma->send_wait))
+		wake_up_all(&rdma->send_wait);
+}
+
 static int
 p9_cm_event_handler(struct rdma_cm_id *id, struct rdma_cm_event *event)
 {
@@ -238,12 +463,16 @@ p9_cm_event_handler(struct rdma_cm_id *id, struct rdma_cm_event *event)
 
 	case RDMA_CM_EVENT_ESTABLISHED:
 		BUG_ON(rdma->state != P9_RDMA_ROUTE_RESOLVED);
+		rdma_accept_ddp(rdma, event->param.conn.private_data,
+				event->param.conn.private_data_len);
 		rdma->state = P9_RDMA_CONNECTED;
 		break;
 
 	case RDMA_CM_EVENT_DISCONNECTED:
-		if (rdma)
+		if (rdma) {
 			rdma->state = P9_RDMA_CLOSED;
+			rdma_wake_senders(rdma);
+		}
 		if (c)
 			c->status = Disconnected;
 		break;
@@ -272,40 +501,214 @@ p9_cm_event_handler(struct rdma_cm_id *id, struct rdma_cm_event *event)
 	return 0;
 }
 
+static int post_recv(struct p9_client *client, struct p9_rdma_context *c);
+
+/* take a free chunk region; credits keep two per request in flight */
+static struct p9_rdma_mr *rdma_get_mr(struct p9_trans_rdma *rdma)
+{
+	int i;
+
+	for (;;) {
+		i = find_first_zero_bit(rdma->mr_map, rdma->nr_mrs);
+		if (i >= rdma->nr_mrs)
+			return NULL;
+		if (!test_and_set_bit(i, rdma->mr_map))
+			return &rdma->mrs[i];
+	}
+}
+
+/**
+ * rdma_put_mr - invalidate a chunk region and give it back
+ * @rdma: transport
+ * @m: region
+ * @valid: the region was registered
+ *
+ * The invalidation is unsignaled and goes on the SQ ahead of any later
+ * registration of the region.  Once the QP is gone there is nothing to
+ * post to; deregistering the region takes care of it.
+ */
+static void rdma_put_mr(struct p9_trans_rdma *rdma, struct p9_rdma_mr *m,
+								int valid)
+{
+	struct ib_send_wr wr, *bad_wr;
+
+	if (valid && rdma->qp) {
+		memset(&wr, 0, sizeof(wr));
+		wr.opcode = IB_WR_LOCAL_INV;
+		wr.ex.invalidate_rkey = m->mr->rkey;
+		if (ib_post_send(rdma->qp, &wr, &bad_wr))
+			P9_DPRINTK(P9_DEBUG_ERROR, "invalidate failed\n");
+	}
+	clear_bit(m - rdma->mrs, rdma->mr_map);
+	smp_mb__after_clear_bit();
+}
+
+/**
+ * rdma_unmap_ddp - invalidate and unmap the chunks of a request
+ * @rdma: transport
+ * @req: request
+ *
+ */
+static void rdma_unmap_ddp(struct p9_trans_rdma *rdma, struct p9_req_t *req)
+{
+	struct ib_device *dev = rdma->cm_id->device;
+	struct p9_rdma_ddp *ddp = req->aux;
+
+	if (!ddp)
+		return;
+
+	if (ddp->call_mr)
+		rdma_put_mr(rdma, ddp->call_mr, ddp->posted);
+	if (ddp->reply_mr)
+		rdma_put_mr(rdma, ddp->reply_mr, ddp->posted);
+	if (ddp->call_len)
+		ib_dma_unmap_single(dev, ddp->call_busa, ddp->call_len,
+							DMA_TO_DEVICE);
+	if (ddp->reply_len)
+		ib_dma_unmap_single(dev, ddp->reply_busa, ddp->reply_len,
+							DMA_FROM_DEVICE);
+	kfree(ddp);
+	req->aux = NULL;
+}
+
+/* give back a credit: a receive buffer no longer waits for a reply */
+static void rdma_put_credit(struct p9_trans_rdma *rdma)
+{
+	atomic_inc(&rdma->credits);
+	rdma_wake_senders(rdma);
+}
+
+/* give back a send context and its SQ slot */
+static void rdma_put_slot(struct p9_trans_rdma *rdma, struct p9_rdma_context *c)
+{
+	c->req = NULL;
+	clear_bit(c - rdma->send_ctx, rdma->send_map);
+	smp_mb__after_clear_bit();
+	atomic_inc(&rdma->sq_slots);
+	rdma_wake_senders(rdma);
+}
+
+/**
+ * rdma_flushed - retire the request a Rflush answers
+ * @client: client instance
+ * @rdma: transport
+ * @freq: the flush request
+ *
+ * If the old request hasn't been answered by now it never will be, so the
+ * receive buffer its credit stood for is free again.
+ */
+static void rdma_flushed(struct p9_client *client, struct p9_trans_rdma *rdma,
+							struct p9_req_t *freq)
+{
+	struct p9_req_t *oldreq;
+	u16 oldtag;
+
+	oldtag = le16_to_cpu(*(__le16 *) (freq->tc->sdata + 7));
+	oldreq = p9_tag_lookup(client, oldtag);
+	if (!oldreq || cmpxchg(&oldreq->status, REQ_STATUS_FLSH,
+				REQ_STATUS_FLSHD) != REQ_STATUS_FLSH)
+		return;
+
+	P9_DPRINTK(P9_DEBUG_TRANS, "flushed tag %d\n", oldtag);
+	rdma_unmap_ddp(rdma, oldreq);
+	rdma_put_credit(rdma);
+}
+
 static void
 handle_recv(struct p9_client *client, struct p9_trans_rdma *rdma,
 	    struct p9_rdma_context *c, enum ib_wc_status status, u32 byte_len)
 {
+	struct ib_device *dev = rdma->cm_id->device;
+	struct p9_rdma_hdr *hdr;
+	struct p9_rdma_ddp *ddp;
 	struct p9_req_t *req;
+	char *msg;
 	int err = 0;
-	int16_t tag;
+	u32 len;
+	u16 tag;
 
 	req = NULL;
-	ib_dma_unmap_single(rdma->cm_id->device, c->busa, client->msize,
-							 DMA_FROM_DEVICE);
-
 	if (status != IB_WC_SUCCESS)
 		goto err_out;
 
-	err = p9_parse_header(c->rc, NULL, NULL, &tag, 1);
-	if (err)
-		goto err_out;
+	ib_dma_sync_single_for_cpu(dev, c->busa, rdma->bufsize,
+							DMA_FROM_DEVICE);
+	err = -EIO;
+	msg = c->buf;
+	len = byte_len;
+	hdr = NULL;
+	if (rdma->ddp) {
+		if (len < sizeof(*hdr))
+			goto err_out;
+		hdr = (struct p9_rdma_hdr *) c->buf;
+		msg += sizeof(*hdr);
+		len -= sizeof(*hdr);
+		tag = be16_to_cpu(hdr->tag);
+	} else {
+		if (len < 7)
+			goto err_out;
+		tag = le16_to_cpu(*(__le16 *) (msg + 5));
+	}
 
 	req = p9_tag_lookup(client, tag);
 	if (!req)
 		goto err_out;
 
-	req->rc = c->rc;
-	req->status = REQ_STATUS_RCVD;
+	/* nobody waits for a reply to a request that was flushed */
+	if (req->status != REQ_STATUS_SENT && req->status != REQ_STATUS_FLSH) {
+		P9_DPRINTK(P9_DEBUG_TRANS, "stale tag %d status %d\n", tag,
+								req->status);
+		req = NULL;
+		goto repost;
+	}
+
+	if (hdr && (be16_to_cpu(hdr->flags) & P9_RDMA_REPLY_CHUNK)) {
+		/* the server wrote the reply straight into req->rc */
+		ddp = req->aux;
+		len = be32_to_cpu(hdr->len);
+		if (!ddp || !ddp->reply_len || len < 7 || len > ddp->reply_len)
+			goto err_out;
+	} else {
+		if (len < 7 || len > client->msize)
+			goto err_out;
+		memcpy(req->rc->sdata, msg, len);
+	}
+	rdma_unmap_ddp(rdma, req);
+
+ repost:
+	/* the buffer is free again as soon as the reply is copied out */
+	ib_dma_sync_single_for_device(dev, c->busa, rdma->bufsize,
+							DMA_FROM_DEVICE);
+	err = post_recv(client, c);
+	if (err)
+		goto err_dead;
+
+	if (!req)
+		return;
+
+	rdma_put_credit(rdma);
+	if (cmpxchg(&req->status, REQ_STATUS_SENT,
+				REQ_STATUS_RCVD) != REQ_STATUS_SENT)
+		cmpxchg(&req->status, REQ_STATUS_FLSH, REQ_STATUS_RCVD);
+	if (req->tc->id == P9_TFLUSH)
+		rdma_flushed(client, rdma, req);
 	p9_client_cb(client, req);
 
 	return;
 
  err_out:
+	/* don't let the other mounts lose a shared buffer */
+	if (rdma->srq) {
+		ib_dma_sync_single_for_device(dev, c->busa, rdma->bufsize,
+							DMA_FROM_DEVICE);
+		post_recv(client, c);
+	}
+ err_dead:
 	P9_DPRINTK(P9_DEBUG_ERROR, "req %p err %d status %d\n",
 		   req, err, status);
 	rdma->state = P9_RDMA_FLUSHING;
 	client->status = Disconnected;
+	rdma_wake_senders(rdma);
 	return;
 }
 
@@ -313,9 +716,7 @@ static void
 handle_send(struct p9_client *client, struct p9_trans_rdma *rdma,
 	    struct p9_rdma_context *c, enum ib_wc_status status, u32 byte_len)
 {
-	ib_dma_unmap_single(rdma->cm_id->device,
-			    c->busa, c->req->tc->size,
-			    DMA_TO_DEVICE);
+	rdma_put_slot(rdma, c);
 }
 
 static void qp_event_handler(struct ib_event *event, void *context)
@@ -324,45 +725,346 @@ static void qp_event_handler(struct ib_event *event, void *context)
 								context);
 }
 
-static void cq_comp_handler(struct ib_cq *cq, void *cq_context)
+static void rdma_handle_wc(struct p9_client *client, struct p9_trans_rdma *rdma,
+							struct ib_wc *wc)
 {
-	struct p9_client *client = cq_context;
-	struct p9_trans_rdma *rdma = client->trans;
-	int ret;
-	struct ib_wc wc;
+	struct p9_rdma_context *c = (void *) (unsigned long) wc->wr_id;
 
-	ib_req_notify_cq(rdma->cq, IB_CQ_NEXT_COMP);
-	while ((ret = ib_poll_cq(cq, 1, &wc)) > 0) {
-		struct p9_rdma_context *c = (void *) (unsigned long) wc.wr_id;
+	/*
+	 * Registrations and invalidations are unsignaled, so they only
+	 * complete when they failed and the QP is in error.
+	 */
+	if (!c) {
+		P9_DPRINTK(P9_DEBUG_ERROR, "chunk wr status %d\n", wc->status);
+		rdma->state = P9_RDMA_FLUSHING;
+		client->status = Disconnected;
+		rdma_wake_senders(rdma);
+		return;
+	}
 
-		switch (c->wc_op) {
-		case IB_WC_RECV:
-			atomic_dec(&rdma->rq_count);
-			handle_recv(client, rdma, c, wc.status, wc.byte_len);
-			break;
+	switch (c->wc_op) {
+	case IB_WC_RECV:
+		handle_recv(client, rdma, c, wc->status, wc->byte_len);
+		break;
 
-		case IB_WC_SEND:
-			handle_send(client, rdma, c, wc.status, wc.byte_len);
-			up(&rdma->sq_sem);
-			break;
+	case IB_WC_SEND:
+		handle_send(client, rdma, c, wc->status, wc->byte_len);
+		break;
 
-		default:
-			printk(KERN_ERR "9prdma: unexpected completion type, "
-			       "c->wc_op=%d, wc.opcode=%d, status=%d\n",
-			       c->wc_op, wc.opcode, wc.status);
-			break;
-		}
-		kfree(c);
+	default:
+		printk(KERN_ERR "9prdma: unexpected completion type, "
+		       "c->wc_op=%d, wc.opcode=%d, status=%d\n",
+		       c->wc_op, wc->opcode, wc->status);
+		break;
 	}
 }
 
+/**
+ * rdma_poll_cq - reap completions
+ * @client: client instance
+ *
+ * Polls the CQ in batches until it is empty and re-armed without a
+ * completion slipping in, or until the budget is spent.  The rest is
+ * then left to the tasklet, with the CQ still disarmed so the interrupt
+ * handler and the tasklet never poll at the same time.
+ */
+static void rdma_poll_cq(struct p9_client *client)
+{
+	struct p9_trans_rdma *rdma = client->trans;
+	int budget = P9_RDMA_CQ_BUDGET;
+	int i, n, want;
+
+	do {
+		while (budget > 0) {
+			want = min(budget, P9_RDMA_CQ_BATCH);
+			n = ib_poll_cq(rdma->cq, want, rdma->wc);
+			if (n <= 0)
+				break;
+
+			for (i = 0; i < n; i++)
+				rdma_handle_wc(client, rdma, &rdma->wc[i]);
+			budget -= n;
+			if (n < want)
+				break;
+		}
+
+		if (budget <= 0) {
+			tasklet_schedule(&rdma->cq_tasklet);
+			return;
+		}
+	} while (ib_req_notify_cq(rdma->cq, IB_CQ_NEXT_COMP |
+					IB_CQ_REPORT_MISSED_EVENTS) > 0);
+}
+
+static void cq_comp_handler(struct ib_cq *cq, void *cq_context)
+{
+	rdma_poll_cq(cq_context);
+}
+
+static void cq_tasklet(unsigned long data)
+{
+	rdma_poll_cq((struct p9_client *) data);
+}
+
 static void cq_event_handler(struct ib_event *e, void *v)
 {
 	P9_DPRINTK(P9_DEBUG_ERROR, "CQ event %d context %p\n", e->event, v);
 }
 
-static void rdma_destroy_trans(struct p9_trans_rdma *rdma)
+static void srq_event_handler(struct ib_event *e, void *v)
+{
+	P9_DPRINTK(P9_DEBUG_ERROR, "SRQ event %d context %p\n", e->event, v);
+}
+
+/**
+ * rdma_alloc_pool - allocate and map a pool of contexts
+ * @dev: device the buffers are mapped for
+ * @bufsize: size of each buffer
+ * @n: number of contexts
+ * @dir: DMA direction of the buffers
+ *
+ */
+static struct p9_rdma_context *
+rdma_alloc_pool(struct ib_device *dev, int bufsize, int n,
+					enum dma_data_direction dir)
+{
+	struct p9_rdma_context *pool, *c;
+	int i;
+
+	pool = kcalloc(n, sizeof(struct p9_rdma_context), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < n; i++) {
+		c = &pool[i];
+		c->buf = kmalloc(bufsize, GFP_KERNEL);
+		if (!c->buf)
+			return pool;
+
+		c->busa = ib_dma_map_single(dev, c->buf, bufsize, dir);
+		if (ib_dma_mapping_error(dev, c->busa)) {
+			kfree(c->buf);
+			c->buf = NULL;
+			return pool;
+		}
+	}
+
+	return pool;
+}
+
+static void rdma_free_pool(struct ib_device *dev, int bufsize,
+	struct p9_rdma_context *pool, int n, enum dma_data_direction dir)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	for (i = 0; i < n && pool[i].buf; i++) {
+		ib_dma_unmap_single(dev, pool[i].busa, bufsize, dir);
+		kfree(pool[i].buf);
+	}
+	kfree(pool);
+}
+
+/**
+ * rdma_alloc_mrs - allocate the chunk regions
+ * @rdma: transport
+ * @n: number of regions
+ *
+ */
+static int rdma_alloc_mrs(struct p9_trans_rdma *rdma, int n)
+{
+	struct ib_device *dev = rdma->cm_id->device;
+	struct p9_rdma_mr *m;
+	int i;
+
+	rdma->mrs = kcalloc(n, sizeof(*rdma->mrs), GFP_KERNEL);
+	rdma->mr_map = kcalloc(BITS_TO_LONGS(n), sizeof(unsigned long),
+								GFP_KERNEL);
+	if (!rdma->mrs || !rdma->mr_map)
+		return -ENOMEM;
+
+	rdma->nr_mrs = n;
+	for (i = 0; i < n; i++) {
+		m = &rdma->mrs[i];
+		m->mr = ib_alloc_fast_reg_mr(rdma->pd, P9_RDMA_DDP_MAXPAGES);
+		if (IS_ERR(m->mr)) {
+			m->mr = NULL;
+			return -ENOMEM;
+		}
+		m->pl = ib_alloc_fast_reg_page_list(dev, P9_RDMA_DDP_MAXPAGES);
+		if (IS_ERR(m->pl)) {
+			m->pl = NULL;
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/* deregistering a region also invalidates it */
+static void rdma_free_mrs(struct p9_trans_rdma *rdma)
+{
+	int i;
+
+	for (i = 0; i < rdma->nr_mrs; i++) {
+		if (rdma->mrs[i].pl)
+			ib_free_fast_reg_page_list(rdma->mrs[i].pl);
+		if (rdma->mrs[i].mr)
+			ib_dereg_mr(rdma->mrs[i].mr);
+	}
+	kfree(rdma->mrs);
+	kfree(rdma->mr_map);
+	rdma->mrs = NULL;
+	rdma->nr_mrs = 0;
+}
+
+/* a pool is complete if its last buffer was allocated and mapped */
+static int rdma_pool_ok(struct p9_rdma_context *pool, int n)
+{
+	return pool && n > 0 && pool[n - 1].buf;
+}
+
+static int rdma_srq_post(struct p9_rdma_srq *srq, struct p9_rdma_context *c)
+{
+	struct ib_recv_wr wr, *bad_wr;
+	struct ib_sge sge;
+
+	sge.addr = c->busa;
+	sge.length = srq->bufsize;
+	sge.lkey = srq->lkey;
+
+	wr.next = NULL;
+	c->wc_op = IB_WC_RECV;
+	wr.wr_id = (unsigned long) c;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	return ib_post_srq_recv(srq->srq, &wr, &bad_wr);
+}
+
+/* called with p9_rdma_srq_lock held */
+static void rdma_srq_release(struct kref *ref)
+{
+	struct p9_rdma_srq *srq = container_of(ref, struct p9_rdma_srq, ref);
+
+	list_del(&srq->list);
+	if (srq->srq && !IS_ERR(srq->srq))
+		ib_destroy_srq(srq->srq);
+
+	rdma_free_pool(srq->device, srq->bufsize, srq->ctx, srq->depth,
+							DMA_FROM_DEVICE);
+
+	if (srq->dma_mr && !IS_ERR(srq->dma_mr))
+		ib_dereg_mr(srq->dma_mr);
+
+	if (srq->pd && !IS_ERR(srq->pd))
+		ib_dealloc_pd(srq->pd);
+
+	kfree(srq);
+}
+
+static void rdma_put_srq(struct p9_rdma_srq *srq)
+{
+	mutex_lock(&p9_rdma_srq_lock);
+	kref_put(&srq->ref, rdma_srq_release);
+	mutex_unlock(&p9_rdma_srq_lock);
+}
+
+/**
+ * rdma_get_srq - find or create the shared receive queue for a device
+ * @dev: device
+ * @devattr: its attributes
+ * @bufsize: size of the receive buffers wanted
+ *
+ * Mounts share a queue if they use the same device and buffer size.
+ * Returns NULL if a new one can't be set up.
+ */
+static struct p9_rdma_srq *
+rdma_get_srq(struct ib_device *dev, struct ib_device_attr *devattr, int bufsize)
+{
+	struct p9_rdma_srq *srq;
+	struct ib_srq_init_attr attr;
+	int i;
+
+	mutex_lock(&p9_rdma_srq_lock);
+	list_for_each_entry(srq, &p9_rdma_srqs, list) {
+		if (srq->device == dev && srq->bufsize == bufsize) {
+			kref_get(&srq->ref);
+			goto out;
+		}
+	}
+
+	srq = kzalloc(sizeof(struct p9_rdma_srq), GFP_KERNEL);
+	if (!srq)
+		goto out;
+
+	INIT_LIST_HEAD(&srq->list);
+	kref_init(&srq->ref);
+	srq->device = dev;
+	srq->bufsize = bufsize;
+	srq->depth = min_t(int, P9_RDMA_SRQ_DEPTH, devattr->max_srq_wr);
+
+	srq->pd = ib_alloc_pd(dev);
+	if (IS_ERR(srq->pd))
+		goto error;
+
+	if (devattr->device_cap_flags & IB_DEVICE_LOCAL_DMA_LKEY)
+		srq->lkey = dev->local_dma_lkey;
+	else {
+		srq->dma_mr = ib_get_dma_mr(srq->pd, IB_ACCESS_LOCAL_WRITE);
+		if (IS_ERR(srq->dma_mr))
+			goto error;
+		srq->lkey = srq->dma_mr->lkey;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.event_handler = srq_event_handler;
+	attr.srq_context = srq;
+	attr.attr.max_wr = srq->depth;
+	attr.attr.max_sge = 1;
+	srq->srq = ib_create_srq(srq->pd, &attr);
+	if (IS_ERR(srq->srq))
+		goto error;
+
+	srq->ctx = rdma_alloc_pool(dev, bufsize, srq->depth, DMA_FROM_DEVICE);
+	if (!rdma_pool_ok(srq->ctx, srq->depth))
+		goto error;
+
+	for (i = 0; i < srq->depth; i++)
+		if (rdma_srq_post(srq, &srq->ctx[i]))
+			goto error;
+
+	list_add(&srq->list, &p9_rdma_srqs);
+ out:
+	mutex_unlock(&p9_rdma_srq_lock);
+	return srq;
+
+ error:
+	kref_put(&srq->ref, rdma_srq_release);
+	mutex_unlock(&p9_rdma_srq_lock);
+	return NULL;
+}
+
+/* drop the chunks of requests that will never complete */
+static void rdma_release_ddp(struct p9_client *client,
+					struct p9_trans_rdma *rdma)
 {
+	struct p9_req_t *req;
+	int tag;
+
+	for (tag = 0; tag + 1 < client->max_tag; tag++) {
+		req = p9_tag_lookup(client, tag);
+		if (req->aux)
+			rdma_unmap_ddp(rdma, req);
+	}
+}
+
+static void rdma_destroy_trans(struct p9_client *client,
+					struct p9_trans_rdma *rdma)
+{
+	struct ib_device *dev;
+
 	if (!rdma)
 		return;
 
@@ -371,8 +1073,28 @@ static void rdma_destroy_trans(struct p9_trans_rdma *rdma)
 
 	if (rdma->qp && !IS_ERR(rdma->qp))
 		ib_destroy_qp(rdma->qp);
+	rdma->qp = NULL;
+
+	/* nothing completes from here on */
+	tasklet_kill(&rdma->cq_tasklet);
+	if (rdma->mrs) {
+		rdma_release_ddp(client, rdma);
+		rdma_free_mrs(rdma);
+	}
 
-	if (rdma->pd && !IS_ERR(rdma->pd))
+	if (rdma->cm_id && !IS_ERR(rdma->cm_id)) {
+		dev = rdma->cm_id->device;
+		rdma_free_pool(dev, rdma->bufsize, rdma->recv_ctx,
+					rdma->rq_depth, DMA_FROM_DEVICE);
+		rdma_free_pool(dev, rdma->bufsize, rdma->send_ctx,
+					rdma->sq_depth, DMA_TO_DEVICE);
+	}
+	kfree(rdma->send_map);
+
+	/* the PD of a shared receive queue goes with the queue */
+	if (rdma->srq)
+		rdma_put_srq(rdma->srq);
+	else if (rdma->pd && !IS_ERR(rdma->pd))
 		ib_dealloc_pd(rdma->pd);
 
 	if (rdma->cq && !IS_ERR(rdma->cq))
@@ -391,14 +1113,11 @@ post_recv(struct p9_client *client, struct p9_rdma_context *c)
 	struct ib_recv_wr wr, *bad_wr;
 	struct ib_sge sge;
 
-	c->busa = ib_dma_map_single(rdma->cm_id->device,
-				    c->rc->sdata, client->msize,
-				    DMA_FROM_DEVICE);
-	if (ib_dma_mapping_error(rdma->cm_id->device, c->busa))
-		goto error;
+	if (rdma->srq)
+		return rdma_srq_post(rdma->srq, c);
 
 	sge.addr = c->busa;
-	sge.length = client->msize;
+	sge.length = rdma->bufsize;
 	sge.lkey = rdma->lkey;
 
 	wr.next = NULL;
@@ -407,81 +1126,217 @@ post_recv(struct p9_client *client, struct p9_rdma_context *c)
 	wr.sg_list = &sge;
 	wr.num_sge = 1;
 	return ib_post_recv(rdma->qp, &wr, &bad_wr);
+}
+
+/**
+ * rdma_reg_chunk - register a mapped buffer for the server
+ * @rdma: transport
+ * @ddp: chunks of the request
+ * @busa: bus address of the buffer
+ * @len: length of the buffer
+ * @access: what the server may do with the buffer
+ * @chunk: where to describe the region to the server
+ *
+ * Builds the fast registration, under a fresh key, that goes on the SQ
+ * ahead of the send handing the key to the server.  Returns the region,
+ * or NULL if there is none free.
+ */
+static struct p9_rdma_mr *rdma_reg_chunk(struct p9_trans_rdma *rdma,
+		struct p9_rdma_ddp *ddp, u64 busa, u32 len, int access,
+		struct p9_rdma_chunk *chunk)
+{
+	struct ib_send_wr *wr = &ddp->reg_wr[ddp->nr_reg];
+	u64 page = busa & ~((u64) PAGE_SIZE - 1);
+	struct p9_rdma_mr *m;
+	int i, n;
+	u8 key;
+
+	m = rdma_get_mr(rdma);
+	if (!m)
+		return NULL;
+
+	n = DIV_ROUND_UP(busa + len - page, PAGE_SIZE);
+	for (i = 0; i < n; i++)
+		m->pl->page_list[i] = page + i * PAGE_SIZE;
+
+	key = (u8) (m->mr->rkey & 0xff);
+	ib_update_fast_reg_key(m->mr, ++key);
+
+	memset(wr, 0, sizeof(*wr));
+	wr->opcode = IB_WR_FAST_REG_MR;
+	wr->wr.fast_reg.iova_start = busa;
+	wr->wr.fast_reg.page_list = m->pl;
+	wr->wr.fast_reg.page_list_len = n;
+	wr->wr.fast_reg.page_shift = PAGE_SHIFT;
+	wr->wr.fast_reg.length = len;
+	wr->wr.fast_reg.access_flags = access;
+	wr->wr.fast_reg.rkey = m->mr->rkey;
+	if (ddp->nr_reg)
+		ddp->reg_wr[ddp->nr_reg - 1].next = wr;
+	ddp->nr_reg++;
+
+	chunk->addr = cpu_to_be64(busa);
+	chunk->rkey = cpu_to_be32(m->mr->rkey);
+	chunk->len = cpu_to_be32(len);
+	return m;
+}
+
+/**
+ * rdma_build_ddp - build the send for a request with ddp
+ * @client: client instance
+ * @rdma: transport
+ * @req: request
+ * @buf: send buffer
+ *
+ * Moves the T-message to a call chunk if it doesn't fit the server's
+ * receive buffers, and offers req->rc as a reply chunk to reads that may
+ * not come back inline.  The registrations of the chunks are left in
+ * req->aux for rdma_request to post.  Returns the length to send or
+ * -ERRNO.
+ */
+static int rdma_build_ddp(struct p9_client *client, struct p9_trans_rdma *rdma,
+				struct p9_req_t *req, char *buf)
+{
+	struct ib_device *dev = rdma->cm_id->device;
+	struct p9_rdma_hdr *hdr = (struct p9_rdma_hdr *) buf;
+	int inline_max = rdma->bufsize - sizeof(*hdr);
+	struct p9_rdma_ddp *ddp = NULL;
+	u16 flags = 0;
+	int len;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->tag = cpu_to_be16(req->tc->tag);
+	len = sizeof(*hdr);
+
+	if (req->tc->size > inline_max ||
+	    (req->tc->id == P9_TREAD && client->msize > inline_max)) {
+		ddp = kzalloc(sizeof(*ddp), GFP_NOFS);
+		if (!ddp)
+			return -ENOMEM;
+		req->aux = ddp;
+	}
+
+	if (req->tc->size > inline_max) {
+		ddp->call_busa = ib_dma_map_single(dev, req->tc->sdata,
+					req->tc->size, DMA_TO_DEVICE);
+		if (ib_dma_mapping_error(dev, ddp->call_busa))
+			goto error;
+		ddp->call_len = req->tc->size;
+		ddp->call_mr = rdma_reg_chunk(rdma, ddp, ddp->call_busa,
+			ddp->call_len, IB_ACCESS_REMOTE_READ, &hdr->call);
+		if (!ddp->call_mr)
+			goto error;
+		flags |= P9_RDMA_CALL_CHUNK;
+	} else {
+		memcpy(buf + len, req->tc->sdata, req->tc->size);
+		len += req->tc->size;
+	}
+
+	if (req->tc->id == P9_TREAD && client->msize > inline_max) {
+		ddp->reply_busa = ib_dma_map_single(dev, req->rc->sdata,
+					client->msize, DMA_FROM_DEVICE);
+		if (ib_dma_mapping_error(dev, ddp->reply_busa))
+			goto error;
+		ddp->reply_len = client->msize;
+		ddp->reply_mr = rdma_reg_chunk(rdma, ddp, ddp->reply_busa,
+			ddp->reply_len, IB_ACCESS_LOCAL_WRITE |
+			IB_ACCESS_REMOTE_WRITE, &hdr->reply);
+		if (!ddp->reply_mr)
+			goto error;
+		flags |= P9_RDMA_REPLY_CHUNK;
+	}
+
+	hdr->flags = cpu_to_be16(flags);
+	return len;
 
  error:
-	P9_DPRINTK(P9_DEBUG_ERROR, "EIO\n");
+	rdma_unmap_ddp(rdma, req);
 	return -EIO;
 }
 
+/**
+ * rdma_take - take a credit or an SQ slot
+ * @rdma: transport
+ * @count: the credits or the free SQ slots
+ *
+ * Waits for one to be given back if there is none.  Returns 0,
+ * -ERESTARTSYS if interrupted, or -EIO if the connection went away.
+ */
+static int rdma_take(struct p9_trans_rdma *rdma, atomic_t *count)
+{
+	int taken = 0;
+	int err;
+
+	if (likely(atomic_add_unless(count, -1, 0)))
+		return 0;
+
+	err = wait_event_interruptible(rdma->send_wait,
+			(taken = atomic_add_unless(count, -1, 0)) ||
+			rdma->state > P9_RDMA_CONNECTED);
+	if (err)
+		return err;
+
+	return taken ? 0 : -EIO;
+}
+
+/**
+ * rdma_request - post a request
+ * @client: client instance
+ * @req: request to send
+ *
+ * A request takes a credit, standing for the receive buffer its reply
+ * will land in, and a send context, which is free whenever the SQ has
+ * room.  Both are counted with atomics and given back from the CQ
+ * handler, so concurrent requests don't serialise on a lock.  The
+ * request is copied into the context's pre-mapped buffer.
+ */
 static int rdma_request(struct p9_client *client, struct p9_req_t *req)
 {
 	struct p9_trans_rdma *rdma = client->trans;
-	struct ib_send_wr wr, *bad_wr;
+	struct ib_device *dev = rdma->cm_id->device;
+	struct ib_send_wr wr, *first, *bad_wr;
 	struct ib_sge sge;
 	int err = 0;
 	unsigned long flags;
 	struct p9_rdma_context *c = NULL;
-	struct p9_rdma_context *rpl_context = NULL;
+	struct p9_rdma_ddp *ddp;
+	int slot;
+	u32 len;
 
-	/* Allocate an fcall for the reply */
-	rpl_context = kmalloc(sizeof *rpl_context, GFP_KERNEL);
-	if (!rpl_context)
-		goto err_close;
+	err = rdma_take(rdma, &rdma->credits);
+	if (err)
+		return err;
 
-	/*
-	 * If the request has a buffer, steal it, otherwise
-	 * allocate a new one.  Typically, requests should already
-	 * have receive buffers allocated and just swap them around
-	 */
-	if (!req->rc) {
-		req->rc = kmalloc(sizeof(struct p9_fcall)+client->msize,
-								GFP_KERNEL);
-		if (req->rc) {
-			req->rc->sdata = (char *) req->rc +
-						sizeof(struct p9_fcall);
-			req->rc->capacity = client->msize;
-		}
-	}
-	rpl_context->rc = req->rc;
-	if (!rpl_context->rc) {
-		kfree(rpl_context);
-		goto err_close;
+	err = rdma_take(rdma, &rdma->sq_slots);
+	if (err) {
+		rdma_put_credit(rdma);
+		return err;
 	}
 
-	/*
-	 * Post a receive buffer for this request. We need to ensure
-	 * there is a reply buffer available for every outstanding
-	 * request. A flushed request can result in no reply for an
-	 * outstanding request, so we must keep a count to avoid
-	 * overflowing the RQ.
-	 */
-	if (atomic_inc_return(&rdma->rq_count) <= rdma->rq_depth) {
-		err = post_recv(client, rpl_context);
-		if (err) {
-			kfree(rpl_context->rc);
-			kfree(rpl_context);
-			goto err_close;
-		}
-	} else
-		atomic_dec(&rdma->rq_count);
-
-	/* remove posted receive buffer from request structure */
-	req->rc = NULL;
+	/* holding a slot, there is a context whose bit is clear */
+	for (;;) {
+		slot = find_first_zero_bit(rdma->send_map, rdma->sq_depth);
+		if (slot < rdma->sq_depth &&
+		    !test_and_set_bit(slot, rdma->send_map))
+			break;
+	}
+	c = &rdma->send_ctx[slot];
 
-	/* Post the request */
-	c = kmalloc(sizeof *c, GFP_KERNEL);
-	if (!c)
-		goto err_close;
 	c->req = req;
-
-	c->busa = ib_dma_map_single(rdma->cm_id->device,
-				    c->req->tc->sdata, c->req->tc->size,
-				    DMA_TO_DEVICE);
-	if (ib_dma_mapping_error(rdma->cm_id->device, c->busa))
-		goto error;
+	ib_dma_sync_single_for_cpu(dev, c->busa, rdma->bufsize, DMA_TO_DEVICE);
+	if (rdma->ddp) {
+		err = rdma_build_ddp(client, rdma, req, c->buf);
+		if (err < 0)
+			goto err_put;
+		len = err;
+	} else {
+		memcpy(c->buf, req->tc->sdata, req->tc->size);
+		len = req->tc->size;
+	}
+	ib_dma_sync_single_for_device(dev, c->busa, len, DMA_TO_DEVICE);
 
 	sge.addr = c->busa;
-	sge.length = c->req->tc->size;
+	sge.length = len;
 	sge.lkey = rdma->lkey;
 
 	wr.next = NULL;
@@ -492,16 +1347,31 @@ static int rdma_request(struct p9_client *client, struct p9_req_t *req)
 	wr.sg_list = &sge;
 	wr.num_sge = 1;
 
-	if (down_interruptible(&rdma->sq_sem))
-		goto error;
+	/* chunk registrations go first, the reply may come before we return */
+	first = &wr;
+	ddp = req->aux;
+	if (ddp && ddp->nr_reg) {
+		ddp->reg_wr[ddp->nr_reg - 1].next = &wr;
+		first = ddp->reg_wr;
+		ddp->posted = 1;
+	}
 
-	return ib_post_send(rdma->qp, &wr, &bad_wr);
+	req->status = REQ_STATUS_SENT;
+	err = ib_post_send(rdma->qp, first, &bad_wr);
+	if (err) {
+		if (ddp && bad_wr == first)
+			ddp->posted = 0;
+		goto err_put;
+	}
 
- error:
-	P9_DPRINTK(P9_DEBUG_ERROR, "EIO\n");
-	return -EIO;
+	return 0;
+
+ err_put:
+	rdma_unmap_ddp(rdma, req);
+	rdma_put_slot(rdma, c);
+	rdma_put_credit(rdma);
 
- err_close:
+	P9_DPRINTK(P9_DEBUG_ERROR, "post_send failed %d\n", err);
 	spin_lock_irqsave(&rdma->req_lock, flags);
 	if (rdma->state < P9_RDMA_CLOSING) {
 		rdma->state = P9_RDMA_CLOSING;
@@ -525,7 +1395,7 @@ static void rdma_close(struct p9_client *client)
 
 	client->status = Disconnected;
 	rdma_disconnect(rdma->cm_id);
-	rdma_destroy_trans(rdma);
+	rdma_destroy_trans(client, rdma);
 }
 
 /**
@@ -545,15 +1415,24 @@ static struct p9_trans_rdma *alloc_rdma(struct p9_rdma_opts *opts)
 	rdma->timeout = opts->timeout;
 	spin_lock_init(&rdma->req_lock);
 	init_completion(&rdma->cm_done);
-	sema_init(&rdma->sq_sem, rdma->sq_depth);
-	atomic_set(&rdma->rq_count, 0);
+	atomic_set(&rdma->sq_slots, rdma->sq_depth);
+	atomic_set(&rdma->credits, rdma->rq_depth);
+	init_waitqueue_head(&rdma->send_wait);
 
 	return rdma;
 }
 
-/* its not clear to me we can do anything after send has been posted */
+/**
+ * rdma_cancel - cancel a request
+ * @client: client instance
+ * @req: request to cancel
+ *
+ * Once posted a request can't be taken back, so it is always flushed:
+ * marking it lets the Rflush return its credit if no reply came first.
+ */
 static int rdma_cancel(struct p9_client *client, struct p9_req_t *req)
 {
+	cmpxchg(&req->status, REQ_STATUS_SENT, REQ_STATUS_FLSH);
 	return 1;
 }
 
@@ -572,6 +1451,8 @@ rdma_create_trans(struct p9_client *client, const char *addr, char *args)
 	struct rdma_conn_param conn_param;
 	struct ib_qp_init_attr qp_attr;
 	struct ib_device_attr devattr;
+	struct p9_rdma_connect cp;
+	int i, send_wrs;
 
 	/* Parse the transport specific mount options */
 	err = parse_opts(args, &opts);
@@ -582,6 +1463,7 @@ rdma_create_trans(struct p9_client *client, const char *addr, char *args)
 	rdma = alloc_rdma(&opts);
 	if (!rdma)
 		return -ENOMEM;
+	tasklet_init(&rdma->cq_tasklet, cq_tasklet, (unsigned long) client);
 
 	/* Create the RDMA CM ID */
 	rdma->cm_id = rdma_create_id(p9_cm_event_handler, client, RDMA_PS_TCP);
@@ -617,16 +1499,51 @@ rdma_create_trans(struct p9_client *client, const char *addr, char *args)
 	if (err)
 		goto error;
 
+	/* chunks are registered per request, which takes fast registration */
+	if (opts.ddp &&
+	    (!(devattr.device_cap_flags & IB_DEVICE_MEM_MGT_EXTENSIONS) ||
+	     devattr.max_fast_reg_page_list_len < P9_RDMA_DDP_MAXPAGES)) {
+		P9_DPRINTK(P9_DEBUG_ERROR, "no fast registration, no ddp\n");
+		opts.ddp = 0;
+	}
+
+	/*
+	 * With ddp a send may follow the registrations of two chunks, and
+	 * each chunk region may have an invalidation on the SQ.
+	 */
+	send_wrs = opts.sq_depth;
+	if (opts.ddp)
+		send_wrs += 2 * opts.sq_depth + 2 * opts.rq_depth;
+
+	/*
+	 * Pre-map a buffer for every SQ and RQ entry.  Without ddp every
+	 * message has to fit one; with it larger messages go in chunks.
+	 */
+	rdma->bufsize = min_t(int, client->msize + P9_IOHDRSZ,
+							P9_RDMA_MAXSIZE);
+	if (opts.ddp)
+		rdma->bufsize += sizeof(struct p9_rdma_hdr);
+
 	/* Create the Completion Queue */
 	rdma->cq = ib_create_cq(rdma->cm_id->device, cq_comp_handler,
 				cq_event_handler, client,
-				opts.sq_depth + opts.rq_depth + 1, 0);
+				send_wrs + opts.rq_depth + 1, 0);
 	if (IS_ERR(rdma->cq))
 		goto error;
 	ib_req_notify_cq(rdma->cq, IB_CQ_NEXT_COMP);
 
-	/* Create the Protection Domain */
-	rdma->pd = ib_alloc_pd(rdma->cm_id->device);
+	/*
+	 * Create the Protection Domain, or share the one of the receive
+	 * queue shared by the mounts on this device
+	 */
+	if (opts.srq && devattr.max_srq) {
+		rdma->srq = rdma_get_srq(rdma->cm_id->device, &devattr,
+								rdma->bufsize);
+		if (!rdma->srq)
+			goto error;
+		rdma->pd = rdma->srq->pd;
+	} else
+		rdma->pd = ib_alloc_pd(rdma->cm_id->device);
 	if (IS_ERR(rdma->pd))
 		goto error;
 
@@ -641,14 +1558,22 @@ rdma_create_trans(struct p9_client *client, const char *addr, char *args)
 		rdma->lkey = rdma->dma_mr->lkey;
 	}
 
+	/* Two chunk regions for every request that may be in flight */
+	if (opts.ddp && rdma_alloc_mrs(rdma, 2 * opts.rq_depth))
+		goto error;
+
 	/* Create the Queue Pair */
 	memset(&qp_attr, 0, sizeof qp_attr);
 	qp_attr.event_handler = qp_event_handler;
 	qp_attr.qp_context = client;
-	qp_attr.cap.max_send_wr = opts.sq_depth;
-	qp_attr.cap.max_recv_wr = opts.rq_depth;
+	qp_attr.cap.max_send_wr = send_wrs;
 	qp_attr.cap.max_send_sge = P9_RDMA_SEND_SGE;
-	qp_attr.cap.max_recv_sge = P9_RDMA_RECV_SGE;
+	if (rdma->srq)
+		qp_attr.srq = rdma->srq->srq;
+	else {
+		qp_attr.cap.max_recv_wr = opts.rq_depth;
+		qp_attr.cap.max_recv_sge = P9_RDMA_RECV_SGE;
+	}
 	qp_attr.sq_sig_type = IB_SIGNAL_REQ_WR;
 	qp_attr.qp_type = IB_QPT_RC;
 	qp_attr.send_cq = rdma->cq;
@@ -658,12 +1583,45 @@ rdma_create_trans(struct p9_client *client, const char *addr, char *args)
 		goto error;
 	rdma->qp = rdma->cm_id->qp;
 
+	rdma->send_map = kcalloc(BITS_TO_LONGS(opts.sq_depth),
+					sizeof(unsigned long), GFP_KERNEL);
+	rdma->send_ctx = rdma_alloc_pool(rdma->cm_id->device, rdma->bufsize,
+					opts.sq_depth, DMA_TO_DEVICE);
+	if (!rdma->send_map || !rdma_pool_ok(rdma->send_ctx, opts.sq_depth))
+		goto error;
+
+	/* Fill the RQ before the server can send us anything */
+	if (!rdma->srq) {
+		rdma->recv_ctx = rdma_alloc_pool(rdma->cm_id->device,
+			rdma->bufsize, opts.rq_depth, DMA_FROM_DEVICE);
+		if (!rdma_pool_ok(rdma->recv_ctx, opts.rq_depth))
+			goto error;
+
+		for (i = 0; i < opts.rq_depth; i++) {
+			err = post_recv(client, &rdma->recv_ctx[i]);
+			if (err)
+				goto error;
+		}
+	}
+
 	/* Request a connection */
 	memset(&conn_param, 0, sizeof(conn_param));
 	conn_param.private_data = NULL;
 	conn_param.private_data_len = 0;
+	if (opts.ddp) {
+		memset(&cp, 0, sizeof(cp));
+		cp.magic = cpu_to_be32(P9_RDMA_MAGIC);
+		cp.version = P9_RDMA_VERSION;
+		cp.flags = P9_RDMA_F_DDP;
+		cp.max_msize = cpu_to_be32(client->msize);
+		conn_param.private_data = &cp;
+		conn_param.private_data_len = sizeof(cp);
+	}
 	conn_param.responder_resources = P9_RDMA_IRD;
 	conn_param.initiator_depth = P9_RDMA_ORD;
+	/* the shared queue may run dry for a moment: retry, don't fail */
+	if (rdma->srq)
+		conn_param.rnr_retry_count = 7;
 	err = rdma_connect(rdma->cm_id, &conn_param);
 	if (err)
 		goto error;
@@ -671,18 +1629,25 @@ rdma_create_trans(struct p9_client *client, const char *addr, char *args)
 	if (err || (rdma->state != P9_RDMA_CONNECTED))
 		goto error;
 
+	/* The client only lowers msize from here on */
+	if (!rdma->ddp) {
+		if ((client->msize + P9_IOHDRSZ) > P9_RDMA_MAXSIZE)
+			client->msize = P9_RDMA_MAXSIZE - P9_IOHDRSZ;
+	} else if (rdma->max_msize && client->msize > rdma->max_msize)
+		client->msize = rdma->max_msize;
+
 	client->status = Connected;
 
 	return 0;
 
 error:
-	rdma_destroy_trans(rdma);
+	rdma_destroy_trans(client, rdma);
 	return -ENOTCONN;
 }
 
 static struct p9_trans_module p9_rdma_trans = {
 	.name = "rdma",
-	.maxsize = P9_RDMA_MAXSIZE,
+	.maxsize = P9_RDMA_DDP_MAXSIZE,
 	.def = 0,
 	.owner = THIS_MODULE,
 	.create = rdma_create_trans,
@@ -0,0 +1,742 @@
+/*
+ * linux/fs/9p/trans_shm.c
+ *
+ * Shared memory ring transport for co-located 9P servers
+ *
+ * A userspace server opens /dev/9pshm, sizes a ring with P9SHM_IOC_SETUP
+ * and maps it.  The mount then names that descriptor with shmfd=.  Each
+ * message is copied once into the shared slot owned by its tag and once
+ * out of it; nothing goes through socket buffers or the fd mux.  The ring
+ * layout and doorbell protocol are described in include/net/9p/shm.h.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to:
+ *  Free Software Foundation
+ *  51 Franklin Street, Fifth Floor
+ *  Boston, MA  02111-1301  USA
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/kref.h>
+#include <linux/log2.h>
+#include <linux/miscdevice.h>
+#include <linux/uaccess.h>
+#include <linux/parser.h>
+#include "9p.h"
+#include "client.h"
+#include "transport.h"
+#include "shm.h"
+
+#define P9_SHM_MAXSLOTS		256
+#define P9_SHM_MINSLOT		4096
+#define P9_SHM_MAXSLOT		(128*1024)
+
+/**
+ * struct p9_shm_chan - one shared ring and the mount bound to it
+ * @ref: held by the device file and by the mount using the ring
+ * @lock: protects the request ring producer, @slot_req, @client and @dead
+ * @rlock: serializes consumers of the reply ring
+ * @ring: shared area, vmalloc_user() memory mapped by the server
+ * @size: length of @ring
+ * @nslots: number of slots, not counting the flush slot, and ring length
+ * @slot_size: size of the request and reply area of a slot
+ * @req_ring: request ring inside @ring
+ * @rep_ring: reply ring inside @ring
+ * @data: slot 0 inside @ring
+ * @req_prod: kernel copy of the request producer index
+ * @rep_cons: kernel copy of the reply consumer index
+ * @dead: set once the server or the mount has gone away
+ * @client: client bound to the ring, if any
+ * @slot_req: request occupying each slot
+ * @busy: bitmap of slots owned by a request
+ * @slot_wait: requests waiting for their slot to be released, or for room
+ *	on the request ring
+ * @server_wait: the server sleeping in poll()
+ *
+ * The geometry is kept outside the shared header, which the server can
+ * scribble on: everything read back from the ring is checked against it.
+ */
+
+struct p9_shm_chan {
+	struct kref ref;
+	spinlock_t lock;
+	spinlock_t rlock;
+
+	struct p9_shm_ring *ring;
+	unsigned long size;
+	u32 nslots;
+	u32 slot_size;
+	u32 *req_ring;
+	u32 *rep_ring;
+	char *data;
+	u32 req_prod;
+	u32 rep_cons;
+
+	int dead;
+	struct p9_client *client;
+	struct p9_req_t **slot_req;
+	unsigned long *busy;
+	wait_queue_head_t slot_wait;
+	wait_queue_head_t server_wait;
+};
+
+enum {
+	/* Options that take integer arguments */
+	Opt_shmfd,
+	Opt_err,
+};
+
+static const match_table_t tokens = {
+	{Opt_shmfd, "shmfd=%u"},
+	{Opt_err, NULL},
+};
+
+static const struct file_operations p9_shm_fops;
+
+static inline char *p9_shm_tmsg(struct p9_shm_chan *chan, u32 slot)
+{
+	return chan->data + (size_t)slot * 2 * chan->slot_size;
+}
+
+static inline char *p9_shm_rmsg(struct p9_shm_chan *chan, u32 slot)
+{
+	return p9_shm_tmsg(chan, slot) + chan->slot_size;
+}
+
+static void p9_shm_free(struct kref *ref)
+{
+	struct p9_shm_chan *chan = container_of(ref, struct p9_shm_chan, ref);
+
+	vfree(chan->ring);
+	kfree(chan->slot_req);
+	kfree(chan->busy);
+	kfree(chan);
+}
+
+/**
+ * p9_shm_release_slot - give a slot back after its request has finished
+ * @chan: channel
+ * @slot: slot to release
+ *
+ * Called with @rlock or @lock held.
+ */
+
+static void p9_shm_release_slot(struct p9_shm_chan *chan, u32 slot)
+{
+	chan->slot_req[slot] = NULL;
+	clear_bit(slot, chan->busy);
+	smp_mb__after_clear_bit();
+	if (waitqueue_active(&chan->slot_wait))
+		wake_up(&chan->slot_wait);
+}
+
+/**
+ * p9_shm_shutdown - fail everything outstanding on a channel
+ * @chan: channel
+ *
+ */
+
+static void p9_shm_shutdown(struct p9_shm_chan *chan)
+{
+	struct p9_req_t *req;
+	u32 slot;
+
+	spin_lock(&chan->rlock);
+	spin_lock(&chan->lock);
+	chan->dead = 1;
+	if (chan->client)
+		chan->client->status = Disconnected;
+
+	for (slot = 0; slot <= chan->nslots; slot++) {
+		req = chan->slot_req[slot];
+		if (!req)
+			continue;
+
+		P9_DPRINTK(P9_DEBUG_ERROR, "call back req %p\n", req);
+		req->status = REQ_STATUS_ERROR;
+		if (!req->t_err)
+			req->t_err = -EIO;
+		chan->slot_req[slot] = NULL;
+		p9_client_cb(chan->client, req);
+	}
+	spin_unlock(&chan->lock);
+	spin_unlock(&chan->rlock);
+
+	wake_up_all(&chan->slot_wait);
+	wake_up_interruptible_all(&chan->server_wait);
+}
+
+/**
+ * p9_shm_flushed - retire the request a Rflush answers
+ * @chan: channel
+ * @freq: the flush request
+ *
+ * A server may answer a Tflush without ever replying to the old request,
+ * in which case the old request's slot is released here.
+ */
+
+static void p9_shm_flushed(struct p9_shm_chan *chan, struct p9_req_t *freq)
+{
+	struct p9_req_t *oldreq;
+	u16 oldtag;
+	u32 slot;
+
+	oldtag = le16_to_cpu(*(__le16 *) (freq->tc->sdata + 7));
+	slot = P9_SHM_SLOT(oldtag, chan->nslots);
+	oldreq = chan->slot_req[slot];
+	if (oldreq && oldreq->tc->tag == oldtag &&
+	    oldreq->status == REQ_STATUS_FLSH) {
+		P9_DPRINTK(P9_DEBUG_TRANS, "chan %p flushed tag %d\n", chan,
+								oldtag);
+		oldreq->status = REQ_STATUS_FLSHD;
+		p9_shm_release_slot(chan, slot);
+	}
+}
+
+/**
+ * p9_shm_complete - consume the reply ring
+ * @chan: channel
+ *
+ * Runs in the context of the server's P9SHM_IOC_KICK.  Each reply is
+ * checked against the geometry and the tag of the request in its slot
+ * before being copied out.
+ *
+ * Returns the number of replies completed or a negative error, in which
+ * case the channel has been shut down.
+ */
+
+static int p9_shm_complete(struct p9_shm_chan *chan)
+{
+	struct p9_req_t *req;
+	u32 prod, slot, len;
+	char *rmsg;
+	int n, err;
+
+	n = 0;
+	err = 0;
+	spin_lock(&chan->rlock);
+	if (chan->dead || !chan->client) {
+		err = -ENOTCONN;
+		goto unlock;
+	}
+
+	prod = ACCESS_ONCE(chan->ring->rep_prod);
+	if (prod - chan->rep_cons > chan->nslots) {
+		P9_DPRINTK(P9_DEBUG_ERROR, "bogus reply index %u\n", prod);
+		err = -EIO;
+		goto unlock;
+	}
+	smp_rmb();
+
+	while (chan->rep_cons != prod) {
+		slot = ACCESS_ONCE(chan->rep_ring[chan->rep_cons &
+							(chan->nslots - 1)]);
+		chan->rep_cons++;
+		if (slot > P9_SHM_FLUSH_SLOT(chan->nslots)) {
+			P9_DPRINTK(P9_DEBUG_ERROR, "bogus slot %u\n", slot);
+			err = -EIO;
+			break;
+		}
+
+		req = chan->slot_req[slot];
+		if (!req) {
+			P9_DPRINTK(P9_DEBUG_TRANS, "stale reply slot %u\n",
+									slot);
+			continue;
+		}
+
+		rmsg = p9_shm_rmsg(chan, slot);
+		len = le32_to_cpu(*(__le32 *) rmsg);
+		if (len < 7 || len > chan->client->msize ||
+		    le16_to_cpu(*(__le16 *) (rmsg + 5)) != req->tc->tag) {
+			P9_DPRINTK(P9_DEBUG_ERROR,
+				"bad reply slot %u size %u\n", slot, len);
+			err = -EIO;
+			break;
+		}
+
+		memcpy(req->rc->sdata, rmsg, len);
+		if (req->tc->id == P9_TFLUSH)
+			p9_shm_flushed(chan, req);
+		if (req->status != REQ_STATUS_ERROR)
+			req->status = REQ_STATUS_RCVD;
+		p9_shm_release_slot(chan, slot);
+		p9_client_cb(chan->client, req);
+		n++;
+	}
+	chan->ring->rep_cons = chan->rep_cons;
+	/* the server consumed the requests it replied to */
+	if (n && waitqueue_active(&chan->slot_wait))
+		wake_up(&chan->slot_wait);
+
+unlock:
+	spin_unlock(&chan->rlock);
+	if (err == -EIO)
+		p9_shm_shutdown(chan);
+
+	return err ? err : n;
+}
+
+/**
+ * p9_shm_claim - try to take the slot of a tag
+ * @chan: channel
+ * @slot: slot to take
+ *
+ * Returns true if the slot is now ours.
+ */
+
+static int p9_shm_claim(struct p9_shm_chan *chan, u32 slot)
+{
+	return !test_and_set_bit(slot, chan->busy);
+}
+
+/* is there room on the request ring, or is the channel dead */
+static int p9_shm_room(struct p9_shm_chan *chan)
+{
+	return chan->dead ||
+		chan->req_prod - ACCESS_ONCE(chan->ring->req_cons) <
+								chan->nslots;
+}
+
+/**
+ * p9_shm_request - issue a request
+ * @client: client instance issuing the request
+ * @req: request to be issued
+ *
+ * Copies the T-message into the slot of its tag and publishes the slot
+ * on the request ring.  The server is only woken if it said it was about
+ * to sleep.  A slot is busy only when more than nslots requests are
+ * outstanding, or while the server still holds a flushed request; the
+ * ring is full only when the flush slot is in use as well.  Both waits
+ * can be interrupted.
+ */
+
+static int p9_shm_request(struct p9_client *client, struct p9_req_t *req)
+{
+	struct p9_shm_chan *chan = client->trans;
+	u32 slot;
+	int err, owned;
+
+	if (req->tc->id == P9_TFLUSH)
+		slot = P9_SHM_FLUSH_SLOT(chan->nslots);
+	else
+		slot = P9_SHM_SLOT(req->tc->tag, chan->nslots);
+	P9_DPRINTK(P9_DEBUG_TRANS, "chan %p tag %d slot %u\n", chan,
+							req->tc->tag, slot);
+
+	owned = 0;
+	err = wait_event_interruptible(chan->slot_wait,
+			(owned = p9_shm_claim(chan, slot)) || chan->dead);
+	if (err)
+		return err;
+
+	if (owned && !chan->dead)
+		memcpy(p9_shm_tmsg(chan, slot), req->tc->sdata,
+							req->tc->size);
+
+	spin_lock(&chan->lock);
+	while (owned && !p9_shm_room(chan)) {
+		spin_unlock(&chan->lock);
+		err = wait_event_interruptible(chan->slot_wait,
+							p9_shm_room(chan));
+		spin_lock(&chan->lock);
+		if (err) {
+			p9_shm_release_slot(chan, slot);
+			spin_unlock(&chan->lock);
+			return err;
+		}
+	}
+
+	if (chan->dead) {
+		if (owned)
+			p9_shm_release_slot(chan, slot);
+		spin_unlock(&chan->lock);
+		return -EIO;
+	}
+
+	chan->slot_req[slot] = req;
+	req->status = REQ_STATUS_SENT;
+	chan->req_ring[chan->req_prod & (chan->nslots - 1)] = slot;
+	smp_wmb();
+	chan->ring->req_prod = ++chan->req_prod;
+	spin_unlock(&chan->lock);
+
+	/* pairs with the barrier the server issues after setting idle */
+	smp_mb();
+	if (ACCESS_ONCE(chan->ring->server_idle))
+		wake_up_interruptible(&chan->server_wait);
+
+	return 0;
+}
+
+/*
+ * Requests are on the ring as soon as they are issued; flush them.  The
+ * slot is released when the Rflush arrives (see p9_shm_flushed), unless
+ * the reply came first.
+ */
+static int p9_shm_cancel(struct p9_client *client, struct p9_req_t *req)
+{
+	cmpxchg(&req->status, REQ_STATUS_SENT, REQ_STATUS_FLSH);
+	return 1;
+}
+
+/**
+ * parse_opts - parse mount options into the shm descriptor number
+ * @params: options string passed from mount
+ * @fd: where to store the descriptor
+ *
+ * Returns 0 upon success, -ERRNO upon failure
+ */
+
+static int parse_opts(char *params, int *fd)
+{
+	char *p;
+	substring_t args[MAX_OPT_ARGS];
+	int option;
+	char *options, *tmp;
+	int r;
+
+	*fd = ~0;
+
+	if (!params)
+		return 0;
+
+	tmp = options = kstrdup(params, GFP_KERNEL);
+	if (!options) {
+		P9_DPRINTK(P9_DEBUG_ERROR,
+				"failed to allocate copy of option string\n");
+		return -ENOMEM;
+	}
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		int token;
+		if (!*p)
+			continue;
+		token = match_token(p, tokens, args);
+		if (token != Opt_shmfd)
+			continue;
+		r = match_int(&args[0], &option);
+		if (r < 0) {
+			P9_DPRINTK(P9_DEBUG_ERROR,
+				"integer field, but no integer?\n");
+			continue;
+		}
+		*fd = option;
+	}
+	kfree(tmp);
+	return 0;
+}
+
+/**
+ * p9_shm_create - bind a mount to a server's ring
+ * @client: client instance invoking this transport
+ * @addr: unused
+ * @args: args passed from sys_mount() for per-transport options
+ *
+ * The shmfd= descriptor must be an open /dev/9pshm that already has a
+ * ring set up and no mount bound to it.
+ */
+
+static int
+p9_shm_create(struct p9_client *client, const char *addr, char *args)
+{
+	struct p9_shm_chan *chan;
+	struct file *file;
+	int err, fd;
+
+	err = parse_opts(args, &fd);
+	if (err < 0)
+		return err;
+
+	if (fd == ~0) {
+		printk(KERN_ERR "v9fs: Insufficient options for proto=shm\n");
+		return -ENOPROTOOPT;
+	}
+
+	file = fget(fd);
+	if (!file)
+		return -EBADF;
+
+	err = -EINVAL;
+	if (file->f_op != &p9_shm_fops)
+		goto out;
+
+	chan = file->private_data;
+	spin_lock(&chan->lock);
+	if (!chan->ring || chan->dead)
+		err = -ENODEV;
+	else if (chan->client)
+		err = -EBUSY;
+	else {
+		chan->client = client;
+		kref_get(&chan->ref);
+		err = 0;
+	}
+	spin_unlock(&chan->lock);
+	if (err)
+		goto out;
+
+	if (client->msize > chan->slot_size)
+		client->msize = chan->slot_size;
+
+	client->trans = chan;
+	client->status = Connected;
+	P9_DPRINTK(P9_DEBUG_TRANS, "client %p chan %p msize %d\n", client,
+							chan, client->msize);
+
+out:
+	fput(file);
+	return err;
+}
+
+/**
+ * p9_shm_close - unbind a mount from its ring
+ * @client: client instance
+ *
+ */
+
+static void p9_shm_close(struct p9_client *client)
+{
+	struct p9_shm_chan *chan = client->trans;
+
+	if (!chan)
+		return;
+
+	client->trans = NULL;
+	p9_shm_shutdown(chan);
+	spin_lock(&chan->lock);
+	chan->client = NULL;
+	spin_unlock(&chan->lock);
+	kref_put(&chan->ref, p9_shm_free);
+}
+
+/**
+ * p9_shm_setup - allocate the ring of a channel
+ * @chan: channel
+ * @arg: user copy of the requested geometry
+ *
+ */
+
+static long p9_shm_setup(struct p9_shm_chan *chan,
+					struct p9_shm_setup __user *arg)
+{
+	struct p9_shm_setup setup;
+	struct p9_shm_ring *ring;
+	u32 nslots, slot_size, req_off, rep_off, data_off;
+	unsigned long size;
+	struct p9_req_t **slot_req;
+	unsigned long *busy;
+	int err;
+
+	if (copy_from_user(&setup, arg, sizeof(setup)))
+		return -EFAULT;
+
+	nslots = clamp_t(u32, setup.nslots, 1, P9_SHM_MAXSLOTS);
+	nslots = roundup_pow_of_two(nslots);
+	slot_size = clamp_t(u32, setup.slot_size, P9_SHM_MINSLOT,
+							P9_SHM_MAXSLOT);
+	slot_size = ALIGN(slot_size, P9_SHM_ALIGN);
+
+	req_off = ALIGN(sizeof(struct p9_shm_ring), P9_SHM_ALIGN);
+	rep_off = req_off + ALIGN(nslots * sizeof(u32), P9_SHM_ALIGN);
+	data_off = PAGE_ALIGN(rep_off + nslots * sizeof(u32));
+	/* one more slot for flushes */
+	size = PAGE_ALIGN(data_off +
+			(unsigned long)(nslots + 1) * 2 * slot_size);
+
+	ring = vmalloc_user(size);
+	slot_req = kcalloc(nslots + 1, sizeof(*slot_req), GFP_KERNEL);
+	busy = kcalloc(BITS_TO_LONGS(nslots + 1), sizeof(long), GFP_KERNEL);
+	err = -ENOMEM;
+	if (!ring || !slot_req || !busy)
+		goto error;
+
+	ring->magic = P9_SHM_MAGIC;
+	ring->version = P9_SHM_VERSION;
+	ring->nslots = nslots;
+	ring->slot_size = slot_size;
+	ring->req_off = req_off;
+	ring->rep_off = rep_off;
+	ring->data_off = data_off;
+
+	spin_lock(&chan->lock);
+	err = -EBUSY;
+	if (chan->ring) {
+		spin_unlock(&chan->lock);
+		goto error;
+	}
+	chan->size = size;
+	chan->nslots = nslots;
+	chan->slot_size = slot_size;
+	chan->req_ring = (u32 *)((char *)ring + req_off);
+	chan->rep_ring = (u32 *)((char *)ring + rep_off);
+	chan->data = (char *)ring + data_off;
+	chan->slot_req = slot_req;
+	chan->busy = busy;
+	smp_wmb();
+	chan->ring = ring;
+	spin_unlock(&chan->lock);
+
+	setup.nslots = nslots;
+	setup.slot_size = slot_size;
+	setup.size = size;
+	if (copy_to_user(arg, &setup, sizeof(setup)))
+		return -EFAULT;
+
+	return 0;
+
+error:
+	vfree(ring);
+	kfree(slot_req);
+	kfree(busy);
+	return err;
+}
+
+static long p9_shm_ioctl(struct file *filp, unsigned int cmd,
+							unsigned long arg)
+{
+	struct p9_shm_chan *chan = filp->private_data;
+
+	switch (cmd) {
+	case P9SHM_IOC_SETUP:
+		return p9_shm_setup(chan, (struct p9_shm_setup __user *)arg);
+	case P9SHM_IOC_KICK:
+		if (!chan->ring)
+			return -ENODEV;
+		return p9_shm_complete(chan);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static int p9_shm_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct p9_shm_chan *chan = filp->private_data;
+
+	if (!chan->ring)
+		return -ENODEV;
+
+	return remap_vmalloc_range(vma, chan->ring, vma->vm_pgoff);
+}
+
+/*
+ * Readable while the request ring has entries the server hasn't consumed,
+ * hung up once the mount has gone away.
+ */
+
+static unsigned int p9_shm_poll(struct file *filp, poll_table *wait)
+{
+	struct p9_shm_chan *chan = filp->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &chan->server_wait, wait);
+	if (!chan->ring)
+		return POLLERR;
+
+	if (ACCESS_ONCE(chan->ring->req_cons) != chan->req_prod)
+		mask |= POLLIN | POLLRDNORM;
+	if (chan->dead)
+		mask |= POLLHUP;
+
+	return mask;
+}
+
+static int p9_shm_open(struct inode *inode, struct file *filp)
+{
+	struct p9_shm_chan *chan;
+
+	chan = kzalloc(sizeof(struct p9_shm_chan), GFP_KERNEL);
+	if (!chan)
+		return -ENOMEM;
+
+	kref_init(&chan->ref);
+	spin_lock_init(&chan->lock);
+	spin_lock_init(&chan->rlock);
+	init_waitqueue_head(&chan->slot_wait);
+	init_waitqueue_head(&chan->server_wait);
+	filp->private_data = chan;
+	return 0;
+}
+
+/*
+ * The last reference to the device is gone, including the server's
+ * mapping, so the server has exited or given up on the ring.
+ */
+
+static int p9_shm_file_release(struct inode *inode, struct file *filp)
+{
+	struct p9_shm_chan *chan = filp->private_data;
+
+	if (chan->ring)
+		p9_shm_shutdown(chan);
+	kref_put(&chan->ref, p9_shm_free);
+	return 0;
+}
+
+static const struct file_operations p9_shm_fops = {
+	.owner = THIS_MODULE,
+	.open = p9_shm_open,
+	.release = p9_shm_file_release,
+	.unlocked_ioctl = p9_shm_ioctl,
+	.mmap = p9_shm_mmap,
+	.poll = p9_shm_poll,
+};
+
+static struct miscdevice p9_shm_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "9pshm",
+	.fops = &p9_shm_fops,
+};
+
+static struct p9_trans_module p9_shm_trans = {
+	.name = "shm",
+	.create = p9_shm_create,
+	.close = p9_shm_close,
+	.request = p9_shm_request,
+	.cancel = p9_shm_cancel,
+	.maxsize = P9_SHM_MAXSLOT,
+	.def = 0,
+	.owner = THIS_MODULE,
+};
+
+static int __init p9_shm_init(void)
+{
+	int err;
+
+	err = misc_register(&p9_shm_dev);
+	if (err)
+		return err;
+
+	v9fs_register_trans(&p9_shm_trans);
+	return 0;
+}
+
+static void __exit p9_shm_cleanup(void)
+{
+	v9fs_unregister_trans(&p9_shm_trans);
+	misc_deregister(&p9_shm_dev);
+}
+
+module_init(p9_shm_init);
+module_exit(p9_shm_cleanup);
+
+MODULE_DESCRIPTION("Shared memory 9p Transport");
+MODULE_LICENSE("GPL");
@@ -44,23 +44,106 @@
 #include <linux/scatterlist.h>
 #include <linux/virtio.h>
 #include <linux/virtio_9p.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
 
-#define VIRTQUEUE_NUM	128
+/*
+ * Largest message we map.  With indirect descriptors a request takes one
+ * ring slot however many pages it spans; without them the ring has to
+ * hold every page, so msize stays at P9_VIRTIO_DIRECT_MAX.
+ */
+#define P9_VIRTIO_MAXSIZE	(512*1024)
+#define P9_VIRTIO_DIRECT_MAX	(PAGE_SIZE*16)
+
+/* sg entries for a request and its reply, each possibly unaligned */
+#define VIRTQUEUE_NUM	(2 * (P9_VIRTIO_MAXSIZE / PAGE_SIZE + 2))
+
+/*
+ * Multiple request queues are not part of the virtio 9p device spec, so
+ * they use a private feature bit (the last device-specific one) that only
+ * a device model implementing this extension offers.  The queue count is
+ * a private __u16 config field right after the mount tag, so a device
+ * offering it must offer VIRTIO_9P_F_MOUNT_TAG as well.
+ */
+#ifndef VIRTIO_9P_F_MOUNT_TAG
+#define VIRTIO_9P_F_MOUNT_TAG	0
+#endif
+#define VIRTIO_9P_F_PRIV_MQ	23
+#define VIRTIO_9P_MAX_QUEUES	16
+
+/* one bit per tag, including P9_NOTAG */
+#define P9_VIRTIO_NTAGS		(1 << 16)
 
 /* a single mutex to manage channel initialization and attachment */
 static DEFINE_MUTEX(virtio_9p_lock);
 /* global which tracks highest initialized channel */
 static int chan_index;
 
+/* notification accounting, exported through debugfs */
+static atomic_t p9_virtio_requests;
+static atomic_t p9_virtio_kicks;
+static atomic_t p9_virtio_interrupts;
+static atomic_t p9_virtio_poll_hits;
+static atomic_t p9_virtio_poll_misses;
+static struct dentry *p9_virtio_debugfs;
+
+enum {
+	/* Options that take integer arguments */
+	Opt_busypoll,
+	Opt_err,
+};
+
+static const match_table_t tokens = {
+	{Opt_busypoll, "busypoll=%u"},
+	{Opt_err, NULL},
+};
+
+struct virtio_chan;
+
+/**
+ * struct virtio_9p_queue - one request queue of a channel
+ * @lock: protects @sg, @pending and the virtqueue itself
+ * @vq: virtio queue
+ * @chan: channel the queue belongs to
+ * @pending: requests waiting for room in the ring
+ * @queued: requests whose buffers are in the ring
+ * @submitters: tasks in p9_virtio_request for this queue; the last one
+ *	out kicks the host for all of them
+ * @need_kick: buffers were added since the last kick
+ * @pollers: waiters polling the used ring, callbacks stay disabled while
+ *	there are any
+ * @sg: scatter gather list which is used to pack a request
+ *
+ */
+
+struct virtio_9p_queue {
+	spinlock_t lock;
+	struct virtqueue *vq;
+	struct virtio_chan *chan;
+	struct list_head pending;
+	int queued;
+	atomic_t submitters;
+	bool need_kick;
+	int pollers;
+
+	/* Scatterlist: can be too big for stack. */
+	struct scatterlist sg[VIRTQUEUE_NUM];
+} ____cacheline_aligned_in_smp;
+
 /**
  * struct virtio_chan - per-instance transport information
  * @initialized: whether the channel is initialized
  * @inuse: whether the channel is in use
- * @lock: protects multiple elements within this structure
+ * @indirect: whether the ring takes indirect descriptor tables
+ * @busypoll: microseconds a waiter polls the used ring before sleeping
+ * @inflight: tags whose buffers the host still holds
+ * @inflight_wq: requests waiting for the host to give their tag's
+ *	buffers back
  * @client: client instance
  * @vdev: virtio dev associated with this channel
- * @vq: virtio queue associated with this channel
- * @sg: scatter gather list which is used to pack a request (protected?)
+ * @nqueues: number of request queues
+ * @queues: request queues, submissions pick one by cpu
  *
  * We keep all per-channel information in a structure.
  * This structure is allocated within the devices dev->mem space.
@@ -71,15 +154,16 @@ static int chan_index;
 static struct virtio_chan {
 	bool initialized;
 	bool inuse;
-
-	spinlock_t lock;
+	bool indirect;
+	unsigned int busypoll;
+	DECLARE_BITMAP(inflight, P9_VIRTIO_NTAGS);
+	wait_queue_head_t inflight_wq;
 
 	struct p9_client *client;
 	struct virtio_device *vdev;
-	struct virtqueue *vq;
 
-	/* Scatterlist: can be too big for stack. */
-	struct scatterlist sg[VIRTQUEUE_NUM];
+	int nqueues;
+	struct virtio_9p_queue *queues;
 } channels[MAX_9P_CHAN];
 
 /* How many bytes left in this page. */
@@ -106,37 +190,6 @@ static void p9_virtio_close(struct p9_client *client)
 	mutex_unlock(&virtio_9p_lock);
 }
 
-/**
- * req_done - callback which signals activity from the server
- * @vq: virtio queue activity was received on
- *
- * This notifies us that the server has triggered some activity
- * on the virtio channel - most likely a response to request we
- * sent.  Figure out which requests now have responses and wake up
- * those threads.
- *
- * Bugs: could do with some additional sanity checking, but appears to work.
- *
- */
-
-static void req_done(struct virtqueue *vq)
-{
-	struct virtio_chan *chan = vq->vdev->priv;
-	struct p9_fcall *rc;
-	unsigned int len;
-	struct p9_req_t *req;
-
-	P9_DPRINTK(P9_DEBUG_TRANS, ": request done\n");
-
-	while ((rc = chan->vq->vq_ops->get_buf(chan->vq, &len)) != NULL) {
-		P9_DPRINTK(P9_DEBUG_TRANS, ": rc %p\n", rc);
-		P9_DPRINTK(P9_DEBUG_TRANS, ": lookup tag %d\n", rc->tag);
-		req = p9_tag_lookup(chan->client, rc->tag);
-		req->status = REQ_STATUS_RCVD;
-		p9_client_cb(chan->client, req);
-	}
-}
-
 /**
  * pack_sg_list - pack a scatter gather list from a linear buffer
  * @sg: scatter/gather list to pack into
@@ -171,10 +224,281 @@ pack_sg_list(struct scatterlist *sg, int start, int limit, char *data,
 	return index-start;
 }
 
-/* We don't currently allow canceling of virtio requests */
+/**
+ * p9_virtio_reply_size - largest reply a request can get
+ * @client: client instance
+ * @tc: request
+ *
+ * Only this much of the reply buffer is mapped for the host.  Any reply
+ * but Rflush may turn out to be an Rerror, whose error string is bounded
+ * only by msize, so everything else gets the whole buffer.
+ */
+
+static int p9_virtio_reply_size(struct p9_client *client, struct p9_fcall *tc)
+{
+	/* size[4] Rflush tag[2] */
+	if (tc->id == P9_TFLUSH)
+		return 7;
+
+	return client->msize;
+}
+
+/**
+ * virtio_9p_add - put a request on a queue's ring
+ * @q: request queue, locked
+ * @client: client instance
+ * @req: request to add
+ *
+ * The request itself is the token add_buf hands back on completion.
+ * Returns the add_buf error, -ENOSPC if the ring is full.  If the ring
+ * is empty and the request still doesn't go in (it takes more slots than
+ * the ring has, as when no indirect table could be allocated for it),
+ * no completion will ever make room: that is -ENOMEM.
+ */
+
+static int virtio_9p_add(struct virtio_9p_queue *q, struct p9_client *client,
+						struct p9_req_t *req)
+{
+	int in, out, err;
+	char *rdata = (char *)req->rc+sizeof(struct p9_fcall);
+
+	out = pack_sg_list(q->sg, 0, VIRTQUEUE_NUM, req->tc->sdata,
+								req->tc->size);
+	in = pack_sg_list(q->sg, out, VIRTQUEUE_NUM-out, rdata,
+				p9_virtio_reply_size(client, req->tc));
+
+	req->status = REQ_STATUS_SENT;
+	err = q->vq->vq_ops->add_buf(q->vq, q->sg, out, in, req);
+	if (err < 0) {
+		req->status = REQ_STATUS_UNSENT;
+		return q->queued ? err : -ENOMEM;
+	}
+
+	q->queued++;
+	set_bit(req->tc->tag, q->chan->inflight);
+	return 0;
+}
+
+/**
+ * virtio_9p_refill - move pending requests onto the ring
+ * @q: request queue, locked
+ * @client: client instance
+ *
+ * A request that can never fit the ring is failed with -ENOMEM.
+ */
+
+static void virtio_9p_refill(struct virtio_9p_queue *q,
+					struct p9_client *client)
+{
+	struct p9_req_t *req;
+	int added = 0;
+	int err;
+
+	while (!list_empty(&q->pending)) {
+		req = list_first_entry(&q->pending, struct p9_req_t, req_list);
+		err = virtio_9p_add(q, client, req);
+		if (err == -ENOMEM) {
+			list_del(&req->req_list);
+			req->status = REQ_STATUS_ERROR;
+			req->t_err = err;
+			p9_client_cb(client, req);
+			continue;
+		}
+		if (err < 0)
+			break;
+		list_del(&req->req_list);
+		added++;
+	}
+
+	if (added)
+		q->need_kick = true;
+}
+
+/**
+ * virtio_9p_kick - notify the host of added buffers
+ * @q: request queue, locked
+ *
+ * The ring itself skips the notification while the host has said it is
+ * still processing the queue.
+ */
+
+static void virtio_9p_kick(struct virtio_9p_queue *q)
+{
+	if (!q->need_kick)
+		return;
+
+	q->need_kick = false;
+	atomic_inc(&p9_virtio_kicks);
+	q->vq->vq_ops->kick(q->vq);
+}
+
+/**
+ * virtio_9p_flushed - retire the request a Rflush answers
+ * @chan: channel
+ * @freq: the flush request
+ *
+ * If the old request hasn't been answered by now it never will be, but
+ * its buffers may still be in the ring; marking it flushed lets its
+ * completion be recognised as stale, and its tag is not reused until
+ * then (see p9_virtio_request).
+ */
+
+static void virtio_9p_flushed(struct virtio_chan *chan, struct p9_req_t *freq)
+{
+	struct p9_req_t *oldreq;
+	u16 oldtag;
+
+	oldtag = le16_to_cpu(*(__le16 *) (freq->tc->sdata + 7));
+	oldreq = p9_tag_lookup(chan->client, oldtag);
+	if (cmpxchg(&oldreq->status, REQ_STATUS_FLSH,
+				REQ_STATUS_FLSHD) == REQ_STATUS_FLSH)
+		P9_DPRINTK(P9_DEBUG_TRANS, "chan %p flushed tag %d\n", chan,
+								oldtag);
+}
+
+/**
+ * virtio_9p_drain - complete the replies a queue has received
+ * @q: request queue, locked
+ *
+ * Returns the number of replies completed.
+ */
+
+static int virtio_9p_drain(struct virtio_9p_queue *q)
+{
+	struct virtio_chan *chan = q->chan;
+	unsigned int len;
+	struct p9_req_t *req;
+	int n = 0;
+	int freed = 0;
+
+	while ((req = q->vq->vq_ops->get_buf(q->vq, &len)) != NULL) {
+		P9_DPRINTK(P9_DEBUG_TRANS, ": req %p tag %d\n", req,
+								req->tc->tag);
+		q->queued--;
+		freed++;
+		clear_bit(req->tc->tag, chan->inflight);
+		smp_mb__after_clear_bit();
+		if (waitqueue_active(&chan->inflight_wq))
+			wake_up(&chan->inflight_wq);
+
+		/*
+		 * A buffer coming back for a request that was flushed and
+		 * retired has nobody waiting for it any more.
+		 */
+		if (cmpxchg(&req->status, REQ_STATUS_SENT,
+				REQ_STATUS_RCVD) != REQ_STATUS_SENT &&
+		    cmpxchg(&req->status, REQ_STATUS_FLSH,
+				REQ_STATUS_RCVD) != REQ_STATUS_FLSH) {
+			P9_DPRINTK(P9_DEBUG_TRANS, ": stale tag %d status %d\n",
+						req->tc->tag, req->status);
+			continue;
+		}
+
+		if (req->tc->id == P9_TFLUSH)
+			virtio_9p_flushed(chan, req);
+		p9_client_cb(chan->client, req);
+		n++;
+	}
+
+	/* returned buffers made room for requests that found the ring full */
+	if (freed) {
+		virtio_9p_refill(q, chan->client);
+		virtio_9p_kick(q);
+	}
+
+	return n;
+}
+
+/**
+ * virtio_9p_find_queue - find the request queue of a virtqueue
+ * @chan: channel
+ * @vq: virtqueue
+ *
+ * vq->priv belongs to the virtio transport, so compare pointers instead.
+ */
+
+static struct virtio_9p_queue *
+virtio_9p_find_queue(struct virtio_chan *chan, struct virtqueue *vq)
+{
+	int i;
+
+	for (i = 0; i < chan->nqueues; i++)
+		if (chan->queues[i].vq == vq)
+			return &chan->queues[i];
+
+	return NULL;
+}
+
+/**
+ * req_done - callback which signals activity from the server
+ * @vq: virtio queue activity was received on
+ *
+ * This notifies us that the server has triggered some activity
+ * on the virtio channel - most likely a response to request we
+ * sent.  Figure out which requests now have responses and wake up
+ * those threads.
+ *
+ * Bugs: could do with some additional sanity checking, but appears to work.
+ *
+ */
+
+static void req_done(struct virtqueue *vq)
+{
+	struct virtio_chan *chan = vq->vdev->priv;
+	struct virtio_9p_queue *q;
+	unsigned long flags;
+
+	P9_DPRINTK(P9_DEBUG_TRANS, ": request done\n");
+
+	q = virtio_9p_find_queue(chan, vq);
+	if (!q)
+		return;
+
+	atomic_inc(&p9_virtio_interrupts);
+
+	/*
+	 * Keep callbacks off while draining so replies that land meanwhile
+	 * don't raise another interrupt; pollers turn them back on when they
+	 * are done.
+	 */
+	spin_lock_irqsave(&q->lock, flags);
+	do {
+		vq->vq_ops->disable_cb(vq);
+		virtio_9p_drain(q);
+	} while (!q->pollers && !vq->vq_ops->enable_cb(vq));
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+
+/**
+ * p9_virtio_cancel - cancel a request
+ * @client: client instance
+ * @req: request to cancel
+ *
+ * A request still waiting for room in the ring is simply dropped.  Once
+ * the host has it, it has to be flushed: returns 1 to have the client
+ * send a Tflush.
+ */
+
 static int p9_virtio_cancel(struct p9_client *client, struct p9_req_t *req)
 {
-	return 1;
+	struct virtio_9p_queue *q = req->aux;
+	unsigned long flags;
+	int ret = 1;
+
+	if (!q)
+		return 1;
+
+	spin_lock_irqsave(&q->lock, flags);
+	if (req->status == REQ_STATUS_UNSENT) {
+		list_del(&req->req_list);
+		req->status = REQ_STATUS_FLSHD;
+		ret = 0;
+	} else
+		cmpxchg(&req->status, REQ_STATUS_SENT, REQ_STATUS_FLSH);
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	P9_DPRINTK(P9_DEBUG_TRANS, "tag %d cancel %d\n", req->tc->tag, ret);
+	return ret;
 }
 
 /**
@@ -182,33 +506,172 @@ static int p9_virtio_cancel(struct p9_client *client, struct p9_req_t *req)
  * @client: client instance issuing the request
  * @req: request to be issued
  *
+ * Requests go to the queue of the submitting cpu, so that with one queue
+ * per cpu submissions don't contend and completions come back where the
+ * request was issued.  A tag is only reused once the host has returned
+ * the buffers of the tag's previous request.
  */
 
 static int
 p9_virtio_request(struct p9_client *client, struct p9_req_t *req)
 {
-	int in, out;
 	struct virtio_chan *chan = client->trans;
-	char *rdata = (char *)req->rc+sizeof(struct p9_fcall);
+	struct virtio_9p_queue *q;
+	unsigned long flags;
+	int err;
 
 	P9_DPRINTK(P9_DEBUG_TRANS, "9p debug: virtio request\n");
 
-	out = pack_sg_list(chan->sg, 0, VIRTQUEUE_NUM, req->tc->sdata,
-								req->tc->size);
-	in = pack_sg_list(chan->sg, out, VIRTQUEUE_NUM-out, rdata,
-								client->msize);
+	/* the host may still hold the buffers of a flushed request */
+	err = wait_event_killable(chan->inflight_wq,
+				!test_bit(req->tc->tag, chan->inflight));
+	if (err)
+		return err;
+
+	q = &chan->queues[raw_smp_processor_id() % chan->nqueues];
+	req->aux = q;
+	atomic_inc(&p9_virtio_requests);
+
+	atomic_inc(&q->submitters);
+	spin_lock_irqsave(&q->lock, flags);
+	err = list_empty(&q->pending) ? virtio_9p_add(q, client, req) : -ENOSPC;
+	if (err == -ENOMEM)
+		P9_DPRINTK(P9_DEBUG_ERROR, "request too big for the ring\n");
+	else if (err < 0) {
+		/* the ring is full: req_done submits it once there's room */
+		P9_DPRINTK(P9_DEBUG_TRANS, "9p debug: virtio ring full\n");
+		req->status = REQ_STATUS_UNSENT;
+		list_add_tail(&req->req_list, &q->pending);
+		err = 0;
+	} else
+		q->need_kick = true;
+
+	/* a submitter still queued on the lock will kick for us */
+	if (atomic_dec_and_test(&q->submitters))
+		virtio_9p_kick(q);
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	if (err)
+		return err;
+
+	P9_DPRINTK(P9_DEBUG_TRANS, "9p debug: virtio request queued\n");
+	return 0;
+}
 
-	req->status = REQ_STATUS_SENT;
+/**
+ * p9_virtio_poll - poll the used ring for a reply
+ * @q: queue the request was issued on
+ * @req: request to wait for
+ * @usecs: how long to poll
+ *
+ * Callbacks stay disabled on the queue while anyone polls it, so replies
+ * that arrive during the poll cost neither an interrupt nor a wakeup.
+ * Returns nonzero if the reply arrived.
+ */
 
-	if (chan->vq->vq_ops->add_buf(chan->vq, chan->sg, out, in, req->tc)) {
-		P9_DPRINTK(P9_DEBUG_TRANS,
-			"9p debug: virtio rpc add_buf returned failure");
-		return -EIO;
+static int p9_virtio_poll(struct virtio_9p_queue *q, struct p9_req_t *req,
+							unsigned int usecs)
+{
+	unsigned long flags;
+	u64 end;
+
+	end = ktime_to_ns(ktime_get()) + (u64)usecs * NSEC_PER_USEC;
+
+	spin_lock_irqsave(&q->lock, flags);
+	if (!q->pollers++)
+		q->vq->vq_ops->disable_cb(q->vq);
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	while (req->status < REQ_STATUS_RCVD) {
+		spin_lock_irqsave(&q->lock, flags);
+		virtio_9p_drain(q);
+		spin_unlock_irqrestore(&q->lock, flags);
+
+		if (req->status >= REQ_STATUS_RCVD ||
+		    need_resched() || signal_pending(current) ||
+		    ktime_to_ns(ktime_get()) >= end)
+			break;
+
+		cpu_relax();
 	}
 
-	chan->vq->vq_ops->kick(chan->vq);
+	spin_lock_irqsave(&q->lock, flags);
+	if (!--q->pollers && !q->vq->vq_ops->enable_cb(q->vq))
+		virtio_9p_drain(q);
+	spin_unlock_irqrestore(&q->lock, flags);
 
-	P9_DPRINTK(P9_DEBUG_TRANS, "9p debug: virtio request kicked\n");
+	if (req->status >= REQ_STATUS_RCVD) {
+		atomic_inc(&p9_virtio_poll_hits);
+		return 1;
+	}
+
+	atomic_inc(&p9_virtio_poll_misses);
+	return 0;
+}
+
+/**
+ * p9_virtio_wait - wait for the reply to a request
+ * @client: client instance
+ * @req: request to wait for
+ *
+ */
+
+static int p9_virtio_wait(struct p9_client *client, struct p9_req_t *req)
+{
+	struct virtio_chan *chan = client->trans;
+
+	if (chan->busypoll && req->aux &&
+	    p9_virtio_poll(req->aux, req, chan->busypoll))
+		return 0;
+
+	return wait_event_interruptible(*req->wq,
+					req->status >= REQ_STATUS_RCVD);
+}
+
+/**
+ * parse_opts - parse mount options into the channel
+ * @params: options string passed from mount
+ * @chan: channel to set options on
+ *
+ * Returns 0 upon success, -ERRNO upon failure
+ */
+
+static int parse_opts(char *params, struct virtio_chan *chan)
+{
+	char *p;
+	substring_t args[MAX_OPT_ARGS];
+	int option;
+	char *options, *tmp;
+	int r;
+
+	chan->busypoll = 0;
+
+	if (!params)
+		return 0;
+
+	tmp = options = kstrdup(params, GFP_KERNEL);
+	if (!options) {
+		P9_DPRINTK(P9_DEBUG_ERROR,
+				"failed to allocate copy of option string\n");
+		return -ENOMEM;
+	}
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		int token;
+		if (!*p)
+			continue;
+		token = match_token(p, tokens, args);
+		if (token != Opt_busypoll)
+			continue;
+		r = match_int(&args[0], &option);
+		if (r < 0) {
+			P9_DPRINTK(P9_DEBUG_ERROR,
+				"integer field, but no integer?\n");
+			continue;
+		}
+		chan->busypoll = option;
+	}
+	kfree(tmp);
 	return 0;
 }
 
@@ -227,6 +690,11 @@ static int p9_virtio_probe(struct virtio_device *vdev)
 	int err;
 	struct virtio_chan *chan;
 	int index;
+	int i, nqueues;
+	u16 tag_len, nr;
+	struct virtqueue **vqs = NULL;
+	vq_callback_t **callbacks = NULL;
+	const char **names = NULL;
 
 	mutex_lock(&virtio_9p_lock);
 	index = chan_index++;
@@ -241,24 +709,71 @@ static int p9_virtio_probe(struct virtio_device *vdev)
 	}
 
 	chan->vdev = vdev;
+	vdev->priv = chan;
+	bitmap_zero(chan->inflight, P9_VIRTIO_NTAGS);
+	init_waitqueue_head(&chan->inflight_wq);
+
+	nqueues = 1;
+	if (virtio_has_feature(vdev, VIRTIO_9P_F_PRIV_MQ) &&
+	    virtio_config_val(vdev, VIRTIO_9P_F_MOUNT_TAG, 0, &tag_len) == 0 &&
+	    virtio_config_val(vdev, VIRTIO_9P_F_PRIV_MQ,
+			      sizeof(tag_len) + tag_len, &nr) == 0 && nr > 1)
+		nqueues = min_t(int, nr, min_t(int, num_possible_cpus(),
+							VIRTIO_9P_MAX_QUEUES));
+
+	err = -ENOMEM;
+	chan->queues = kcalloc(nqueues, sizeof(struct virtio_9p_queue),
+								GFP_KERNEL);
+	vqs = kcalloc(nqueues, sizeof(*vqs), GFP_KERNEL);
+	callbacks = kcalloc(nqueues, sizeof(*callbacks), GFP_KERNEL);
+	names = kcalloc(nqueues, sizeof(*names), GFP_KERNEL);
+	if (!chan->queues || !vqs || !callbacks || !names)
+		goto out_free;
+
+	for (i = 0; i < nqueues; i++) {
+		callbacks[i] = req_done;
+		names[i] = "requests";
+	}
+
+	/* We expect one virtqueue per request queue the device offers. */
+	err = vdev->config->find_vqs(vdev, nqueues, vqs, callbacks, names);
+	if (err)
+		goto out_free;
+
+	for (i = 0; i < nqueues; i++) {
+		struct virtio_9p_queue *q = &chan->queues[i];
 
-	/* We expect one virtqueue, for requests. */
-	chan->vq = virtio_find_single_vq(vdev, req_done, "requests");
-	if (IS_ERR(chan->vq)) {
-		err = PTR_ERR(chan->vq);
-		goto out_free_vq;
+		spin_lock_init(&q->lock);
+		q->vq = vqs[i];
+		q->chan = chan;
+		INIT_LIST_HEAD(&q->pending);
+		atomic_set(&q->submitters, 0);
+		sg_init_table(q->sg, VIRTQUEUE_NUM);
 	}
-	chan->vq->vdev->priv = chan;
-	spin_lock_init(&chan->lock);
+	chan->nqueues = nqueues;
 
-	sg_init_table(chan->sg, VIRTQUEUE_NUM);
+#ifdef VIRTIO_RING_F_INDIRECT_DESC
+	chan->indirect = virtio_has_feature(vdev, VIRTIO_RING_F_INDIRECT_DESC);
+#else
+	chan->indirect = false;
+#endif
+
+	kfree(vqs);
+	kfree(callbacks);
+	kfree(names);
+
+	P9_DPRINTK(P9_DEBUG_TRANS, "9p debug: virtio %d queues\n", nqueues);
 
 	chan->inuse = false;
 	chan->initialized = true;
 	return 0;
 
-out_free_vq:
-	vdev->config->del_vqs(vdev);
+out_free:
+	kfree(chan->queues);
+	chan->queues = NULL;
+	kfree(vqs);
+	kfree(callbacks);
+	kfree(names);
 fail:
 	mutex_lock(&virtio_9p_lock);
 	chan_index--;
@@ -271,7 +786,7 @@ fail:
  * p9_virtio_create - allocate a new virtio channel
  * @client: client instance invoking this transport
  * @devname: string identifying the channel to connect to (unused)
- * @args: args passed from sys_mount() for per-transport options (unused)
+ * @args: args passed from sys_mount() for per-transport options
  *
  * This sets up a transport channel for 9p communication.  Right now
  * we only match the first available channel, but eventually we couldlook up
@@ -292,6 +807,7 @@ p9_virtio_create(struct p9_client *client, const char *devname, char *args)
 {
 	struct virtio_chan *chan = channels;
 	int index = 0;
+	int err;
 
 	mutex_lock(&virtio_9p_lock);
 	while (index < MAX_9P_CHAN) {
@@ -310,9 +826,22 @@ p9_virtio_create(struct p9_client *client, const char *devname, char *args)
 		return -ENODEV;
 	}
 
+	err = parse_opts(args, chan);
+	if (err < 0) {
+		mutex_lock(&virtio_9p_lock);
+		chan->inuse = false;
+		mutex_unlock(&virtio_9p_lock);
+		return err;
+	}
+
 	client->trans = (void *)chan;
 	chan->client = client;
 
+	/* without indirect descriptors every page of a message takes a slot */
+	if (!chan->indirect &&
+	    client->msize + P9_IOHDRSZ > P9_VIRTIO_DIRECT_MAX)
+		client->msize = P9_VIRTIO_DIRECT_MAX - P9_IOHDRSZ;
+
 	return 0;
 }
 
@@ -330,6 +859,9 @@ static void p9_virtio_remove(struct virtio_device *vdev)
 
 	if (chan->initialized) {
 		vdev->config->del_vqs(vdev);
+		kfree(chan->queues);
+		chan->queues = NULL;
+		chan->nqueues = 0;
 		chan->initialized = false;
 	}
 }
@@ -341,8 +873,15 @@ static struct virtio_device_id id_table[] = {
 	{ 0 },
 };
 
+static unsigned int features[] = {
+	VIRTIO_9P_F_MOUNT_TAG,
+	VIRTIO_9P_F_PRIV_MQ,
+};
+
 /* The standard "struct lguest_driver": */
 static struct virtio_driver p9_virtio_drv = {
+	.feature_table = features,
+	.feature_table_size = ARRAY_SIZE(features),
 	.driver.name = 	KBUILD_MODNAME,
 	.driver.owner = THIS_MODULE,
 	.id_table =	id_table,
@@ -356,11 +895,36 @@ static struct p9_trans_module p9_virtio_trans = {
 	.close = p9_virtio_close,
 	.request = p9_virtio_request,
 	.cancel = p9_virtio_cancel,
-	.maxsize = PAGE_SIZE*16,
+	.wait = p9_virtio_wait,
+	.maxsize = P9_VIRTIO_MAXSIZE,
 	.def = 0,
 	.owner = THIS_MODULE,
 };
 
+static int p9_virtio_stats_show(struct seq_file *s, void *unused)
+{
+	seq_printf(s, "requests: %d\nkicks: %d\ninterrupts: %d\n"
+		"poll hits: %d\npoll misses: %d\n",
+		atomic_read(&p9_virtio_requests), atomic_read(&p9_virtio_kicks),
+		atomic_read(&p9_virtio_interrupts),
+		atomic_read(&p9_virtio_poll_hits),
+		atomic_read(&p9_virtio_poll_misses));
+	return 0;
+}
+
+static int p9_virtio_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, p9_virtio_stats_show, NULL);
+}
+
+static const struct file_operations p9_virtio_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = p9_virtio_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 /* The standard init function */
 static int __init p9_virtio_init(void)
 {
@@ -370,12 +934,19 @@ static int __init p9_virtio_init(void)
 		channels[count].initialized = false;
 
 	v9fs_register_trans(&p9_virtio_trans);
+
+	if (p9_debugfs_root)
+		p9_virtio_debugfs = debugfs_create_file("virtio_stats",
+				S_IRUGO, p9_debugfs_root, NULL,
+				&p9_virtio_stats_fops);
+
 	return register_virtio_driver(&p9_virtio_drv);
 }
 
 static void __exit p9_virtio_cleanup(void)
 {
 	unregister_virtio_driver(&p9_virtio_drv);
+	debugfs_remove(p9_virtio_debugfs);
 	v9fs_unregister_trans(&p9_virtio_trans);
 }
 
@@ -520,4 +520,6 @@ int p9_error_init(void);
 int p9_errstr2errno(char *, int);
 int p9_trans_fd_init(void);
 void p9_trans_fd_exit(void);
+
+extern struct dentry *p9_debugfs_root;
 #endif /* NET_9P_H */
@@ -83,6 +83,9 @@ enum p9_req_status_t {
  * @rc: the response fcall structure
  * @aux: transport specific data (provided for trans_fd migration)
  * @req_list: link for higher level objects to chain requests
+ * @cb: completion callback for requests issued without waiting
+ * @cb_arg: argument passed to @cb
+ * @work: runs @cb in process context
  *
  * Transport use an array to track outstanding requests
  * instead of a list.  While this may incurr overhead during initial
@@ -95,6 +98,9 @@ enum p9_req_status_t {
  *
  */
 
+struct p9_req_t;
+typedef void (*p9_req_cb_t)(struct p9_req_t *req, void *arg);
+
 struct p9_req_t {
 	int status;
 	int t_err;
@@ -105,6 +111,10 @@ struct p9_req_t {
 	void *aux;
 
 	struct list_head req_list;
+
+	p9_req_cb_t cb;
+	void *cb_arg;
+	struct work_struct work;
 };
 
 /**
@@ -162,8 +172,9 @@ struct p9_client {
  * @uid: the numeric uid of the local user who owns this handle
  * @aux: transport specific information (unused?)
  * @rdir_fpos: tracks offset of file position when reading directory contents
+ * @rdir: directory data read ahead of @rdir_fpos, owned by the file system
+ * @ref: references held with p9_fid_get, the last p9_fid_put clunks
  * @flist: per-client-instance fid tracking
- * @dlist: per-dentry fid tracking
  *
  * TODO: This needs lots of explanation.
  */
@@ -178,8 +189,9 @@ struct p9_fid {
 	void *aux;
 
 	int rdir_fpos;
+	void *rdir;
+	atomic_t ref;
 	struct list_head flist;
-	struct list_head dlist;	/* list of all fids attached to a dentry */
 };
 
 int p9_client_version(struct p9_client *);
@@ -196,11 +208,27 @@ int p9_client_open(struct p9_fid *fid, int mode);
 int p9_client_fcreate(struct p9_fid *fid, char *name, u32 perm, int mode,
 							char *extension);
 int p9_client_clunk(struct p9_fid *fid);
+struct p9_fid *p9_fid_get(struct p9_fid *fid);
+int p9_fid_put(struct p9_fid *fid);
 int p9_client_remove(struct p9_fid *fid);
 int p9_client_read(struct p9_fid *fid, char *data, char __user *udata,
 							u64 offset, u32 count);
 int p9_client_write(struct p9_fid *fid, char *data, const char __user *udata,
 							u64 offset, u32 count);
+int p9_client_read_async(struct p9_fid *fid, u64 offset, u32 count,
+					p9_req_cb_t cb, void *arg);
+struct p9_req_t *p9_client_read_post(struct p9_fid *fid, u64 offset,
+								u32 count);
+int p9_client_read_wait(struct p9_client *clnt, struct p9_req_t *req,
+			char *data, char __user *udata, u32 count);
+int p9_client_read_collect(struct p9_client *clnt, struct p9_req_t *req,
+								char **data);
+int p9_client_read_reply(struct p9_client *clnt, struct p9_req_t *req,
+								char **data);
+void p9_client_put_req(struct p9_client *clnt, struct p9_req_t *req);
+struct p9_req_t *p9_client_write_post(struct p9_fid *fid, char *data,
+			const char __user *udata, u64 offset, u32 count);
+int p9_client_write_wait(struct p9_client *clnt, struct p9_req_t *req);
 struct p9_wstat *p9_client_stat(struct p9_fid *fid);
 int p9_client_wstat(struct p9_fid *fid, struct p9_wstat *wst);
 
@@ -0,0 +1,125 @@
+/*
+ * include/net/9p/shm.h
+ *
+ * Shared memory ring layout for the 9P shm transport
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to:
+ *  Free Software Foundation
+ *  51 Franklin Street, Fifth Floor
+ *  Boston, MA  02111-1301  USA
+ *
+ */
+
+#ifndef NET_9P_SHM_H
+#define NET_9P_SHM_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * The ring is allocated by the kernel when the server issues
+ * P9SHM_IOC_SETUP on an open /dev/9pshm, and mapped by the server with
+ * mmap() at offset 0.  It consists of this header, two rings of nslots
+ * slot numbers and nslots + 1 slots, each slot_size bytes of T-message
+ * followed by slot_size bytes of R-message.
+ *
+ * A request with tag t always lives in slot P9_SHM_SLOT(t, nslots), so the
+ * server finds where to put a reply from the reply's tag alone.  The
+ * client produces slot numbers into the request ring and the server
+ * consumes them; the server produces slot numbers into the reply ring once
+ * the reply has been written into the slot.  Indices are free running and
+ * wrap at 2^32.
+ *
+ * Tflush is the exception: it and its Rflush always use the extra slot
+ * P9_SHM_FLUSH_SLOT(nslots), after the nslots others, so that a flush
+ * never waits for the slot of the request it is flushing.  A server puts
+ * every Rflush there.  The client never has more than nslots requests on
+ * the request ring that the server has not consumed, and the server must
+ * not have more than nslots replies on the reply ring before it kicks.
+ *
+ * Doorbells: before sleeping in poll() on the device the server sets
+ * server_idle, issues a full barrier and checks req_prod once more; the
+ * client only wakes the server if it sees server_idle set after
+ * publishing a request.  The server tells the client about new replies
+ * with P9SHM_IOC_KICK, once per batch of replies.
+ */
+
+#define P9_SHM_MAGIC		0x39736d68	/* "9shm" */
+#define P9_SHM_VERSION		2
+
+#define P9_SHM_ALIGN		64
+
+#define P9_SHM_SLOT(tag, nslots)	(((tag) + 1) & ((nslots) - 1))
+#define P9_SHM_FLUSH_SLOT(nslots)	(nslots)
+
+/**
+ * struct p9_shm_ring - header at the start of the shared area
+ * @magic: P9_SHM_MAGIC
+ * @version: P9_SHM_VERSION
+ * @nslots: number of slots, a power of two
+ * @slot_size: size of each request and reply area (the largest msize)
+ * @req_off: offset of the request ring from the start of the area
+ * @rep_off: offset of the reply ring
+ * @data_off: offset of slot 0
+ * @req_prod: request ring producer index, written by the client
+ * @req_cons: request ring consumer index, written by the server
+ * @rep_prod: reply ring producer index, written by the server
+ * @rep_cons: reply ring consumer index, written by the client
+ * @server_idle: set by the server when it is about to sleep
+ *
+ * The indices each sit on their own cache line so the two sides don't
+ * bounce a line between them on every message.
+ */
+
+struct p9_shm_ring {
+	__u32 magic;
+	__u32 version;
+	__u32 nslots;
+	__u32 slot_size;
+	__u32 req_off;
+	__u32 rep_off;
+	__u32 data_off;
+
+	__u32 req_prod __attribute__((aligned(P9_SHM_ALIGN)));
+	__u32 req_cons __attribute__((aligned(P9_SHM_ALIGN)));
+	__u32 rep_prod __attribute__((aligned(P9_SHM_ALIGN)));
+	__u32 rep_cons __attribute__((aligned(P9_SHM_ALIGN)));
+	__u32 server_idle __attribute__((aligned(P9_SHM_ALIGN)));
+} __attribute__((aligned(P9_SHM_ALIGN)));
+
+#define P9_SHM_REQ_RING(r) \
+	((__u32 *)((char *)(r) + (r)->req_off))
+#define P9_SHM_REP_RING(r) \
+	((__u32 *)((char *)(r) + (r)->rep_off))
+#define P9_SHM_TMSG(r, slot) \
+	((char *)(r) + (r)->data_off + (size_t)(slot) * 2 * (r)->slot_size)
+#define P9_SHM_RMSG(r, slot) \
+	(P9_SHM_TMSG(r, slot) + (r)->slot_size)
+
+/**
+ * struct p9_shm_setup - argument of P9SHM_IOC_SETUP
+ * @nslots: number of slots wanted, rounded up to a power of two
+ * @slot_size: largest message the server accepts
+ * @size: returned length of the area to mmap()
+ */
+
+struct p9_shm_setup {
+	__u32 nslots;
+	__u32 slot_size;
+	__u32 size;
+};
+
+#define P9SHM_IOC_SETUP		_IOWR('9', 1, struct p9_shm_setup)
+#define P9SHM_IOC_KICK		_IO('9', 2)
+
+#endif /* NET_9P_SHM_H */
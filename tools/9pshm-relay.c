@@ -0,0 +1,295 @@
+/*
+ * 9pshm-relay - reference peer for the 9P shared memory transport
+ *
+ * Sets up a ring on /dev/9pshm, mounts it with trans=shm and relays the
+ * ring to a 9P server listening on a unix or tcp socket.  It is meant for
+ * testing the transport against an existing server; a fileserver that
+ * wants the full benefit should serve the ring directly.
+ *
+ *	9pshm-relay [-n slots] [-m msize] [-o options] unix!/path mountpoint
+ *	9pshm-relay [-n slots] [-m msize] [-o options] tcp!host!port mountpoint
+ *
+ * Build with:
+ *	cc -O2 -Wall -I../include/net/9p -o 9pshm-relay 9pshm-relay.c
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "shm.h"
+
+static struct p9_shm_ring *ring;
+static int shmfd, sock;
+
+static void fatal(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+static unsigned int get32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+static unsigned int get16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static void readn(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			fprintf(stderr, "9pshm-relay: server hung up\n");
+			exit(n < 0);
+		}
+		buf = (char *)buf + n;
+		len -= n;
+	}
+}
+
+static void writen(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			fatal("write");
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+}
+
+static int dial(char *addr)
+{
+	struct sockaddr_un sun;
+	struct addrinfo hints, *ai, *a;
+	char *host, *port;
+	int fd;
+
+	if (!strncmp(addr, "unix!", 5)) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, addr + 5, sizeof(sun.sun_path) - 1);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			fatal("socket");
+		if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+			fatal(addr);
+		return fd;
+	}
+
+	if (strncmp(addr, "tcp!", 4)) {
+		fprintf(stderr, "9pshm-relay: bad address %s\n", addr);
+		exit(1);
+	}
+	host = strdup(addr + 4);
+	port = strchr(host, '!');
+	if (port)
+		*port++ = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port ? port : "564", &hints, &ai)) {
+		fprintf(stderr, "9pshm-relay: can't resolve %s\n", host);
+		exit(1);
+	}
+	for (a = ai; a; a = a->ai_next) {
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+			break;
+		close(fd);
+	}
+	if (!a)
+		fatal(addr);
+	freeaddrinfo(ai);
+	free(host);
+	return fd;
+}
+
+/* pass every request the kernel has queued on to the server */
+static void forward_requests(void)
+{
+	unsigned int cons, slot, size;
+	unsigned char *msg;
+
+	cons = ring->req_cons;
+	while (cons != *(volatile __u32 *)&ring->req_prod) {
+		__sync_synchronize();
+		slot = P9_SHM_REQ_RING(ring)[cons & (ring->nslots - 1)];
+		if (slot > P9_SHM_FLUSH_SLOT(ring->nslots))
+			break;
+		msg = (unsigned char *)P9_SHM_TMSG(ring, slot);
+		size = get32(msg);
+		if (size < 7 || size > ring->slot_size) {
+			fprintf(stderr, "9pshm-relay: bad request\n");
+			exit(1);
+		}
+		writen(sock, msg, size);
+		ring->req_cons = ++cons;
+	}
+}
+
+/* read the replies that are ready straight into their slots */
+static void forward_replies(void)
+{
+	struct pollfd pfd = { .fd = sock, .events = POLLIN };
+	unsigned char hdr[7], *msg;
+	unsigned int size, slot;
+	int n = 0;
+
+	do {
+		readn(sock, hdr, sizeof(hdr));
+		size = get32(hdr);
+		if (hdr[4] == 109)	/* Rflush */
+			slot = P9_SHM_FLUSH_SLOT(ring->nslots);
+		else
+			slot = P9_SHM_SLOT(get16(hdr + 5), ring->nslots);
+		if (size < 7 || size > ring->slot_size) {
+			fprintf(stderr, "9pshm-relay: bad reply size %u\n",
+									size);
+			exit(1);
+		}
+
+		msg = (unsigned char *)P9_SHM_RMSG(ring, slot);
+		memcpy(msg, hdr, sizeof(hdr));
+		readn(sock, msg + sizeof(hdr), size - sizeof(hdr));
+
+		P9_SHM_REP_RING(ring)[ring->rep_prod & (ring->nslots - 1)] =
+									slot;
+		__sync_synchronize();
+		ring->rep_prod++;
+		n++;
+	} while (n < (int)ring->nslots && poll(&pfd, 1, 0) > 0);
+
+	/* one doorbell for the whole batch */
+	if (ioctl(shmfd, P9SHM_IOC_KICK) < 0)
+		fatal("P9SHM_IOC_KICK");
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: 9pshm-relay [-n slots] [-m msize] "
+			"[-o options] server-address mountpoint\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct p9_shm_setup setup;
+	struct pollfd pfd[2];
+	char opts[512], *extra = NULL;
+	pid_t child;
+	int c, status, timeout;
+
+	setup.nslots = 32;
+	setup.slot_size = 65536;
+	while ((c = getopt(argc, argv, "n:m:o:")) != -1) {
+		switch (c) {
+		case 'n':
+			setup.nslots = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			setup.slot_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			extra = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 2)
+		usage();
+
+	shmfd = open("/dev/9pshm", O_RDWR);
+	if (shmfd < 0)
+		fatal("/dev/9pshm");
+	if (ioctl(shmfd, P9SHM_IOC_SETUP, &setup) < 0)
+		fatal("P9SHM_IOC_SETUP");
+	ring = mmap(NULL, setup.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+								shmfd, 0);
+	if (ring == MAP_FAILED)
+		fatal("mmap");
+	if (ring->magic != P9_SHM_MAGIC || ring->version != P9_SHM_VERSION) {
+		fprintf(stderr, "9pshm-relay: unknown ring version\n");
+		exit(1);
+	}
+
+	sock = dial(argv[optind]);
+
+	/* the mount only returns once Tversion and Tattach went through us */
+	snprintf(opts, sizeof(opts), "trans=shm,shmfd=%d,msize=%u%s%s",
+			shmfd, setup.slot_size, extra ? "," : "",
+			extra ? extra : "");
+	child = fork();
+	if (child < 0)
+		fatal("fork");
+	if (child == 0) {
+		if (mount(argv[optind], argv[optind + 1], "9p", 0, opts) < 0)
+			fatal("mount");
+		_exit(0);
+	}
+
+	pfd[0].fd = shmfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = sock;
+	pfd[1].events = POLLIN;
+	for (;;) {
+		forward_requests();
+
+		timeout = child ? 100 : -1;
+		ring->server_idle = 1;
+		__sync_synchronize();
+		if (ring->req_cons != *(volatile __u32 *)&ring->req_prod)
+			timeout = 0;
+		if (poll(pfd, 2, timeout) < 0 && errno != EINTR)
+			fatal("poll");
+		ring->server_idle = 0;
+
+		if (pfd[1].revents)
+			forward_replies();
+		if (pfd[0].revents & (POLLHUP | POLLERR))
+			break;
+
+		if (child && waitpid(child, &status, WNOHANG) == child) {
+			if (!WIFEXITED(status) || WEXITSTATUS(status))
+				exit(1);
+			child = 0;
+		}
+	}
+
+	return 0;
+}
@@ -34,86 +34,332 @@
 #include "fid.h"
 
 /**
- * v9fs_fid_add - add a fid to a dentry
- * @dentry: dentry that the fid is being added to
- * @fid: fid to add
+ * v9fs_dentry_data - get the 9P private data of a dentry
+ * @dentry: dentry
  *
+ * Allocates it on first use; returns NULL if that fails.
  */
 
-int v9fs_fid_add(struct dentry *dentry, struct p9_fid *fid)
+struct v9fs_dentry *v9fs_dentry_data(struct dentry *dentry)
 {
 	struct v9fs_dentry *dent;
 
-	P9_DPRINTK(P9_DEBUG_VFS, "fid %d dentry %s\n",
-					fid->fid, dentry->d_name.name);
-
 	dent = dentry->d_fsdata;
 	if (!dent) {
 		dent = kmalloc(sizeof(struct v9fs_dentry), GFP_KERNEL);
 		if (!dent)
-			return -ENOMEM;
+			return NULL;
 
 		spin_lock_init(&dent->lock);
-		INIT_LIST_HEAD(&dent->fidlist);
+		dent->fids = NULL;
+		dent->cached = 0;
+		dent->dir_version = 0;
+		dent->dir_gen = 0;
+		dent->plus_time = 0;
 		dentry->d_fsdata = dent;
 	}
 
+	return dent;
+}
+
+static void v9fs_fidtab_free(struct rcu_head *head)
+{
+	kfree(container_of(head, struct v9fs_fidtab, rcu));
+}
+
+/**
+ * v9fs_fid_add - add a fid to a dentry
+ * @dentry: dentry that the fid is being added to
+ * @fid: fid to add
+ *
+ * The dentry takes over the caller's reference to @fid, unless this
+ * fails.
+ */
+
+int v9fs_fid_add(struct dentry *dentry, struct p9_fid *fid)
+{
+	struct v9fs_dentry *dent;
+	struct v9fs_fidtab *old, *tab;
+	int i, nr;
+
+	P9_DPRINTK(P9_DEBUG_VFS, "fid %d dentry %s\n",
+					fid->fid, dentry->d_name.name);
+
+	dent = v9fs_dentry_data(dentry);
+	if (!dent)
+		return -ENOMEM;
+
+again:
+	old = dent->fids;
+	nr = old ? old->nr : 0;
+	tab = kmalloc(sizeof(struct v9fs_fidtab) +
+			(nr + 1) * sizeof(struct p9_fid *), GFP_KERNEL);
+	if (!tab)
+		return -ENOMEM;
+
 	spin_lock(&dent->lock);
-	list_add(&fid->dlist, &dent->fidlist);
+	if (dent->fids != old) {
+		spin_unlock(&dent->lock);
+		kfree(tab);
+		goto again;
+	}
+
+	for (i = 0; i < nr && old->fids[i]->uid <= fid->uid; i++)
+		tab->fids[i] = old->fids[i];
+	tab->fids[i] = fid;
+	for (; i < nr; i++)
+		tab->fids[i + 1] = old->fids[i];
+	tab->nr = nr + 1;
+	rcu_assign_pointer(dent->fids, tab);
 	spin_unlock(&dent->lock);
 
+	if (old)
+		call_rcu(&old->rcu, v9fs_fidtab_free);
+
 	return 0;
 }
 
+/**
+ * v9fs_fid_drop_all - drop the fids of a dentry that is going away
+ * @dentry: the dentry
+ *
+ */
+
+void v9fs_fid_drop_all(struct dentry *dentry)
+{
+	struct v9fs_session_info *v9ses = dentry->d_sb->s_fs_info;
+	struct v9fs_dentry *dent = dentry->d_fsdata;
+	struct v9fs_fidtab *tab = dent->fids;
+	int i;
+
+	if (!tab)
+		return;
+
+	atomic_sub(dent->cached, &v9ses->fidcache_used);
+
+	/* nobody can be looking: they would hold a reference to the dentry */
+	for (i = 0; i < tab->nr; i++)
+		p9_fid_put(tab->fids[i]);
+	kfree(tab);
+	dent->fids = NULL;
+}
+
+static void v9fs_fidtab_put(struct work_struct *work)
+{
+	struct v9fs_fidtab *tab = container_of(work, struct v9fs_fidtab, work);
+	int i;
+
+	for (i = 0; i < tab->nr; i++)
+		p9_fid_put(tab->fids[i]);
+	kfree(tab);
+}
+
+/* lookups that were reading the table have taken references of their own */
+static void v9fs_fidtab_unused(struct rcu_head *head)
+{
+	struct v9fs_fidtab *tab = container_of(head, struct v9fs_fidtab, rcu);
+
+	/* the clunks sleep, which an RCU callback can't */
+	INIT_WORK(&tab->work, v9fs_fidtab_put);
+	schedule_work(&tab->work);
+}
+
+/**
+ * v9fs_fid_drop_unused - drop the fids of a dentry nobody uses
+ * @dentry: the dentry, whose count just dropped to zero
+ *
+ * The dentry stays cached, but its fids don't: the next walk to it
+ * starts from the closest ancestor that still has one.  This runs from
+ * d_delete under dcache_lock, so the clunks are left to a work item,
+ * queued once the grace period of the table is over.
+ */
+
+void v9fs_fid_drop_unused(struct dentry *dentry)
+{
+	struct v9fs_session_info *v9ses = dentry->d_sb->s_fs_info;
+	struct v9fs_dentry *dent = dentry->d_fsdata;
+	struct v9fs_fidtab *tab;
+
+	if (!dent || !dent->fids)
+		return;
+
+	spin_lock(&dent->lock);
+	tab = dent->fids;
+	rcu_assign_pointer(dent->fids, NULL);
+	atomic_sub(dent->cached, &v9ses->fidcache_used);
+	dent->cached = 0;
+	spin_unlock(&dent->lock);
+
+	if (tab)
+		call_rcu(&tab->rcu, v9fs_fidtab_unused);
+}
+
 /**
  * v9fs_fid_find - retrieve a fid that belongs to the specified uid
  * @dentry: dentry to look for fid in
  * @uid: return fid that belongs to the specified user
  * @any: if non-zero, return any fid associated with the dentry
  *
+ * Returns a reference to the fid, or NULL.  Lock free: the table is
+ * read under RCU.  A table that v9fs_fid_drop_unused takes off the
+ * dentry keeps its references until a grace period has passed, so the
+ * fid found can still be got before it is clunked.
  */
 
 static struct p9_fid *v9fs_fid_find(struct dentry *dentry, u32 uid, int any)
 {
 	struct v9fs_dentry *dent;
+	struct v9fs_fidtab *tab;
 	struct p9_fid *fid, *ret;
+	int lo, hi, mid;
 
 	P9_DPRINTK(P9_DEBUG_VFS, " dentry: %s (%p) uid %d any %d\n",
 		dentry->d_name.name, dentry, uid, any);
 	dent = (struct v9fs_dentry *) dentry->d_fsdata;
 	ret = NULL;
-	if (dent) {
-		spin_lock(&dent->lock);
-		list_for_each_entry(fid, &dent->fidlist, dlist) {
-			if (any || fid->uid == uid) {
+	if (!dent)
+		return NULL;
+
+	rcu_read_lock();
+	tab = rcu_dereference(dent->fids);
+	if (tab && tab->nr && any)
+		ret = tab->fids[0];
+	else if (tab) {
+		lo = 0;
+		hi = tab->nr;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			fid = tab->fids[mid];
+			if (fid->uid == uid) {
 				ret = fid;
 				break;
 			}
+			if (fid->uid < uid)
+				lo = mid + 1;
+			else
+				hi = mid;
 		}
-		spin_unlock(&dent->lock);
 	}
+	if (ret)
+		p9_fid_get(ret);
+	rcu_read_unlock();
 
 	return ret;
 }
 
+/**
+ * v9fs_fid_cache - leave a fid a walk went through on its dentry
+ * @dentry: dentry the fid is for
+ * @fid: the fid
+ *
+ * Only while the session has fidcache= budget left.  Returns 1 if the
+ * dentry took a reference to @fid.
+ */
+
+static int v9fs_fid_cache(struct dentry *dentry, struct p9_fid *fid)
+{
+	struct v9fs_session_info *v9ses = dentry->d_sb->s_fs_info;
+	struct v9fs_dentry *dent;
+
+	if (!atomic_add_unless(&v9ses->fidcache_used, 1, v9ses->fidcache))
+		return 0;
+
+	if (v9fs_fid_add(dentry, p9_fid_get(fid)) < 0) {
+		p9_fid_put(fid);
+		atomic_dec(&v9ses->fidcache_used);
+		return 0;
+	}
+
+	dent = dentry->d_fsdata;
+	spin_lock(&dent->lock);
+	dent->cached++;
+	spin_unlock(&dent->lock);
+	return 1;
+}
+
+/**
+ * v9fs_fid_walk - walk from the fid of an ancestor down to a dentry
+ * @fid: reference to the fid of the ancestor, dropped
+ * @dentry: dentry to walk to
+ * @n: how many levels below the ancestor @dentry is
+ *
+ * The names are walked P9_MAXWELEM at a time.  While there is fidcache=
+ * budget, the fid each Twalk ends at is left on its dentry, and the last
+ * name gets a Twalk of its own so that the parent of @dentry has a fid:
+ * lookups of its other entries then walk a single name.
+ */
+
+static struct p9_fid *v9fs_fid_walk(struct p9_fid *fid, struct dentry *dentry,
+									int n)
+{
+	struct v9fs_session_info *v9ses = dentry->d_sb->s_fs_info;
+	struct dentry **dents;
+	struct p9_fid *wfid;
+	char **wnames;
+	int i, l, clone;
+
+	dents = kmalloc((sizeof(struct dentry *) + sizeof(char *)) * n,
+								GFP_KERNEL);
+	if (!dents) {
+		p9_fid_put(fid);
+		return ERR_PTR(-ENOMEM);
+	}
+	wnames = (char **) (dents + n);
+
+	dents[n - 1] = dentry;
+	for (i = n - 1; i > 0; i--)
+		dents[i - 1] = dents[i]->d_parent;
+	for (i = 0; i < n; i++)
+		wnames[i] = (char *) dents[i]->d_name.name;
+
+	clone = 1;
+	i = 0;
+	while (i < n) {
+		l = min(n - i, P9_MAXWELEM);
+		if (i + l == n && l > 1 &&
+		    atomic_read(&v9ses->fidcache_used) < v9ses->fidcache)
+			l--;
+
+		wfid = p9_client_walk(fid, l, &wnames[i], clone);
+		if (clone)
+			p9_fid_put(fid);
+		if (IS_ERR(wfid)) {
+			kfree(dents);
+			return wfid;
+		}
+
+		fid = wfid;
+		i += l;
+		/* a fid left on a dentry must not be walked on in place */
+		clone = i < n && v9fs_fid_cache(dents[i - 1], fid);
+	}
+
+	kfree(dents);
+	if (v9fs_fid_add(dentry, p9_fid_get(fid)) < 0)
+		p9_fid_put(fid);
+	return fid;
+}
+
 /**
  * v9fs_fid_lookup - lookup for a fid, try to walk if not found
  * @dentry: dentry to look for fid in
  *
  * Look for a fid in the specified dentry for the current user.
- * If no fid is found, try to create one walking from a fid from the parent
- * dentry (if it has one), or the root dentry. If the user haven't accessed
- * the fs yet, attach now and walk from the root.
+ * If no fid is found, try to create one walking from the closest
+ * ancestor dentry that has one, or from the root. If the user haven't
+ * accessed the fs yet, attach now and walk from the root.
+ *
+ * The caller gets a reference to the fid, which it drops with p9_fid_put.
  */
 
 struct p9_fid *v9fs_fid_lookup(struct dentry *dentry)
 {
-	int i, n, l, clone, any, access;
+	int n, any, access;
 	u32 uid;
 	struct p9_fid *fid;
-	struct dentry *d, *ds;
+	struct dentry *ds;
 	struct v9fs_session_info *v9ses;
-	char **wnames, *uname;
+	char *uname;
 
 	v9ses = v9fs_inode2v9ses(dentry->d_inode);
 	access = v9ses->flags & V9FS_ACCESS_MASK;
@@ -139,61 +385,37 @@ struct p9_fid *v9fs_fid_lookup(struct dentry *dentry)
 	if (fid)
 		return fid;
 
-	ds = dentry->d_parent;
-	fid = v9fs_fid_find(ds, uid, any);
-	if (!fid) { /* walk from the root */
-		n = 0;
-		for (ds = dentry; !IS_ROOT(ds); ds = ds->d_parent)
-			n++;
-
+	n = 0;
+	ds = dentry;
+	while (!fid && !IS_ROOT(ds)) {
+		ds = ds->d_parent;
+		n++;
 		fid = v9fs_fid_find(ds, uid, any);
-		if (!fid) { /* the user is not attached to the fs yet */
-			if (access == V9FS_ACCESS_SINGLE)
-				return ERR_PTR(-EPERM);
-
-			if (v9fs_extended(v9ses))
-				uname = NULL;
-			else
-				uname = v9ses->uname;
-
-			fid = p9_client_attach(v9ses->clnt, NULL, uname, uid,
-				v9ses->aname);
+	}
 
-			if (IS_ERR(fid))
-				return fid;
+	if (!fid) { /* the user is not attached to the fs yet */
+		if (access == V9FS_ACCESS_SINGLE)
+			return ERR_PTR(-EPERM);
 
-			v9fs_fid_add(ds, fid);
-		}
-	} else /* walk from the parent */
-		n = 1;
+		if (v9fs_extended(v9ses))
+			uname = NULL;
+		else
+			uname = v9ses->uname;
 
-	if (ds == dentry)
-		return fid;
+		fid = p9_client_attach(v9ses->clnt, NULL, uname, uid,
+			v9ses->aname);
 
-	wnames = kmalloc(sizeof(char *) * n, GFP_KERNEL);
-	if (!wnames)
-		return ERR_PTR(-ENOMEM);
-
-	for (d = dentry, i = (n-1); i >= 0; i--, d = d->d_parent)
-		wnames[i] = (char *) d->d_name.name;
-
-	clone = 1;
-	i = 0;
-	while (i < n) {
-		l = min(n - i, P9_MAXWELEM);
-		fid = p9_client_walk(fid, l, &wnames[i], clone);
-		if (IS_ERR(fid)) {
-			kfree(wnames);
+		if (IS_ERR(fid))
 			return fid;
-		}
 
-		i += l;
-		clone = 0;
+		if (v9fs_fid_add(ds, p9_fid_get(fid)) < 0)
+			p9_fid_put(fid);
 	}
 
-	kfree(wnames);
-	v9fs_fid_add(dentry, fid);
-	return fid;
+	if (ds == dentry)
+		return fid;
+
+	return v9fs_fid_walk(fid, dentry, n);
 }
 
 struct p9_fid *v9fs_fid_clone(struct dentry *dentry)
@@ -205,5 +427,43 @@ struct p9_fid *v9fs_fid_clone(struct dentry *dentry)
 		return fid;
 
 	ret = p9_client_walk(fid, 0, NULL, 1);
+	p9_fid_put(fid);
 	return ret;
 }
+
+/**
+ * v9fs_writeback_fid - get the fid dirty pages of a file are written with
+ * @dentry: dentry of the file
+ *
+ * The fid belongs to the inode rather than to an open file, since pages
+ * may be written back after the file that dirtied them is closed.  It is
+ * opened for reading too, so partially written pages can be filled in.
+ */
+
+struct p9_fid *v9fs_writeback_fid(struct dentry *dentry)
+{
+	int err;
+	struct p9_fid *fid;
+	struct v9fs_inode *v9inode = V9FS_I(dentry->d_inode);
+
+	mutex_lock(&v9inode->writeback_mutex);
+	fid = v9inode->writeback_fid;
+	if (fid)
+		goto out;
+
+	fid = v9fs_fid_clone(dentry);
+	if (IS_ERR(fid))
+		goto out;
+
+	err = p9_client_open(fid, P9_ORDWR);
+	if (err < 0) {
+		p9_client_clunk(fid);
+		fid = ERR_PTR(err);
+		goto out;
+	}
+
+	v9inode->writeback_fid = fid;
+out:
+	mutex_unlock(&v9inode->writeback_mutex);
+	return fid;
+}
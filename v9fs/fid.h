@@ -21,11 +21,40 @@
  */
 
 #include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
+
+/**
+ * struct v9fs_fidtab - fids of a dentry, sorted by uid
+ * @rcu: for freeing the table once it has been replaced, or dropping it
+ *	once a dentry went unused
+ * @work: for putting the fids of a dropped table, after its @rcu is done
+ * @nr: number of fids
+ * @fids: the fids; the table holds a reference to each
+ *
+ * A table is never changed once published: adding a fid replaces it.
+ */
+
+struct v9fs_fidtab {
+	union {
+		struct rcu_head rcu;
+		struct work_struct work;
+	};
+	int nr;
+	struct p9_fid *fids[0];
+};
 
 /**
  * struct v9fs_dentry - 9p private data stored in dentry d_fsdata
- * @lock: protects the fidlist
- * @fidlist: list of FIDs currently associated with this dentry
+ * @lock: serialises replacing @fids and changing @cached
+ * @fids: FIDs currently associated with this dentry, read under RCU
+ * @cached: how many of @fids were left by walks to dentries below, and
+ *	count against the fidcache= budget
+ * @dir_version: qid version of the parent directory when the dentry was
+ *	last known to be valid
+ * @dir_gen: generation of the parent directory when a negative dentry was
+ *	looked up (see &v9fs_inode)
+ * @plus_time: when a directory read last returned the entry, in jiffies
  *
  * This structure defines the 9p private data associated with
  * a particular dentry.  In particular, this private data is used
@@ -38,10 +67,18 @@
  * Design and Implementation of the Linux 9P File System documentation
  */
 struct v9fs_dentry {
-	spinlock_t lock; /* protect fidlist */
-	struct list_head fidlist;
+	spinlock_t lock; /* serialise updates of fids */
+	struct v9fs_fidtab *fids;
+	int cached;
+	u32 dir_version;
+	unsigned long dir_gen;
+	unsigned long plus_time;
 };
 
 struct p9_fid *v9fs_fid_lookup(struct dentry *dentry);
 struct p9_fid *v9fs_fid_clone(struct dentry *dentry);
 int v9fs_fid_add(struct dentry *dentry, struct p9_fid *fid);
+void v9fs_fid_drop_all(struct dentry *dentry);
+void v9fs_fid_drop_unused(struct dentry *dentry);
+struct v9fs_dentry *v9fs_dentry_data(struct dentry *dentry);
+struct p9_fid *v9fs_writeback_fid(struct dentry *dentry);
@@ -29,6 +29,8 @@
 #include <linux/sched.h>
 #include <linux/parser.h>
 #include <linux/idr.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
 #include "9p.h"
 #include "client.h"
 #include "transport.h"
@@ -42,13 +44,15 @@
 
 enum {
 	/* Options that take integer arguments */
-	Opt_debug, Opt_dfltuid, Opt_dfltgid, Opt_afid,
+	Opt_debug, Opt_dfltuid, Opt_dfltgid, Opt_afid, Opt_pipeline,
+	Opt_acregmin, Opt_acregmax, Opt_acdirmin, Opt_acdirmax, Opt_negtimeout,
+	Opt_dircache, Opt_fidcache,
 	/* String options */
 	Opt_uname, Opt_remotename, Opt_trans,
 	/* Options that take no arguments */
-	Opt_nodevmap,
+	Opt_nodevmap, Opt_wcombine, Opt_readdirplus,
 	/* Cache options */
-	Opt_cache_loose,
+	Opt_cache_loose, Opt_cache_writeback,
 	/* Access options */
 	Opt_access,
 	/* Error token */
@@ -60,15 +64,42 @@ static const match_table_t tokens = {
 	{Opt_dfltuid, "dfltuid=%u"},
 	{Opt_dfltgid, "dfltgid=%u"},
 	{Opt_afid, "afid=%u"},
+	{Opt_pipeline, "pipeline=%u"},
+	{Opt_acregmin, "acregmin=%u"},
+	{Opt_acregmax, "acregmax=%u"},
+	{Opt_acdirmin, "acdirmin=%u"},
+	{Opt_acdirmax, "acdirmax=%u"},
+	{Opt_negtimeout, "negtimeout=%u"},
+	{Opt_dircache, "dircache=%u"},
+	{Opt_fidcache, "fidcache=%u"},
 	{Opt_uname, "uname=%s"},
 	{Opt_remotename, "aname=%s"},
 	{Opt_nodevmap, "nodevmap"},
+	{Opt_wcombine, "wcombine"},
+	{Opt_readdirplus, "readdirplus"},
 	{Opt_cache_loose, "cache=loose"},
 	{Opt_cache_loose, "loose"},
+	{Opt_cache_writeback, "cache=writeback"},
 	{Opt_access, "access=%s"},
 	{Opt_err, NULL}
 };
 
+/**
+ * v9fs_timeo - convert a timeout option from seconds to jiffies
+ * @secs: the value given
+ *
+ * Negative values mean no timeout, and values too large to compare
+ * jiffies against are clamped rather than left to overflow.
+ */
+
+static unsigned long v9fs_timeo(int secs)
+{
+	if (secs <= 0)
+		return 0;
+
+	return min_t(unsigned long, secs, MAX_JIFFY_OFFSET / HZ) * HZ;
+}
+
 /**
  * v9fs_parse_options - parse mount options into session structure
  * @v9ses: existing v9fs session information
@@ -89,6 +120,12 @@ static int v9fs_parse_options(struct v9fs_session_info *v9ses, char *opts)
 	v9ses->afid = ~0;
 	v9ses->debug = 0;
 	v9ses->cache = 0;
+	v9ses->pipeline = V9FS_DEFAULT_PIPELINE;
+	v9ses->acregmin = v9ses->acregmax = 0;
+	v9ses->acdirmin = v9ses->acdirmax = 0;
+	v9ses->negtimeout = 0;
+	v9ses->dircache_timeo = 0;
+	v9ses->fidcache = 0;
 
 	if (!opts)
 		return 0;
@@ -131,6 +168,31 @@ static int v9fs_parse_options(struct v9fs_session_info *v9ses, char *opts)
 		case Opt_afid:
 			v9ses->afid = option;
 			break;
+		case Opt_pipeline:
+			v9ses->pipeline = clamp(option, 1, V9FS_MAX_PIPELINE);
+			break;
+		case Opt_acregmin:
+			v9ses->acregmin = v9fs_timeo(option);
+			break;
+		case Opt_acregmax:
+			v9ses->acregmax = v9fs_timeo(option);
+			break;
+		case Opt_acdirmin:
+			v9ses->acdirmin = v9fs_timeo(option);
+			break;
+		case Opt_acdirmax:
+			v9ses->acdirmax = v9fs_timeo(option);
+			break;
+		case Opt_negtimeout:
+			v9ses->negtimeout = v9fs_timeo(option);
+			break;
+		case Opt_dircache:
+			v9ses->flags |= V9FS_DIRCACHE;
+			v9ses->dircache_timeo = v9fs_timeo(option);
+			break;
+		case Opt_fidcache:
+			v9ses->fidcache = option;
+			break;
 		case Opt_uname:
 			match_strlcpy(v9ses->uname, &args[0], PATH_MAX);
 			break;
@@ -140,9 +202,18 @@ static int v9fs_parse_options(struct v9fs_session_info *v9ses, char *opts)
 		case Opt_nodevmap:
 			v9ses->nodev = 1;
 			break;
+		case Opt_wcombine:
+			v9ses->flags |= V9FS_WCOMBINE;
+			break;
+		case Opt_readdirplus:
+			v9ses->flags |= V9FS_RDPLUS;
+			break;
 		case Opt_cache_loose:
 			v9ses->cache = CACHE_LOOSE;
 			break;
+		case Opt_cache_writeback:
+			v9ses->cache = CACHE_WRITEBACK;
+			break;
 
 		case Opt_access:
 			s = match_strdup(&args[0]);
@@ -172,6 +243,9 @@ static int v9fs_parse_options(struct v9fs_session_info *v9ses, char *opts)
 		}
 	}
 	kfree(options);
+
+	v9ses->acregmax = max(v9ses->acregmax, v9ses->acregmin);
+	v9ses->acdirmax = max(v9ses->acdirmax, v9ses->acdirmin);
 	return ret;
 }
 
@@ -201,6 +275,7 @@ struct p9_fid *v9fs_session_init(struct v9fs_session_info *v9ses,
 	}
 
 	v9ses->flags = V9FS_EXTENDED | V9FS_ACCESS_USER;
+	atomic_set(&v9ses->fidcache_used, 0);
 	strcpy(v9ses->uname, V9FS_DEFUSER);
 	strcpy(v9ses->aname, V9FS_DEFANAME);
 	v9ses->uid = ~0;
@@ -286,6 +361,20 @@ void v9fs_session_cancel(struct v9fs_session_info *v9ses) {
 
 extern int v9fs_error_init(void);
 
+struct kmem_cache *v9fs_inode_cache;
+/* flushes write-combining buffers; they block on the server */
+struct workqueue_struct *v9fs_wcombine_wq;
+
+static void v9fs_inode_init_once(void *foo)
+{
+	struct v9fs_inode *v9inode = foo;
+
+	mutex_init(&v9inode->writeback_mutex);
+	mutex_init(&v9inode->wcombine_lock);
+	init_waitqueue_head(&v9inode->readahead_wq);
+	inode_init_once(&v9inode->vfs_inode);
+}
+
 /**
  * v9fs_init - Initialize module
  *
@@ -293,9 +382,34 @@ extern int v9fs_error_init(void);
 
 static int __init init_v9fs(void)
 {
+	int err;
+
 	printk(KERN_INFO "Installing v9fs 9p2000 file system support\n");
+	v9fs_inode_cache = kmem_cache_create("v9fs_inode_cache",
+					sizeof(struct v9fs_inode), 0,
+					SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD,
+					v9fs_inode_init_once);
+	if (!v9fs_inode_cache)
+		return -ENOMEM;
+
+	v9fs_wcombine_wq = create_workqueue("v9fs_wcombine");
+	if (!v9fs_wcombine_wq) {
+		err = -ENOMEM;
+		goto error;
+	}
+
 	/* TODO: Setup list of registered trasnport modules */
-	return register_filesystem(&v9fs_fs_type);
+	err = register_filesystem(&v9fs_fs_type);
+	if (err)
+		goto error;
+
+	return 0;
+
+error:
+	if (v9fs_wcombine_wq)
+		destroy_workqueue(v9fs_wcombine_wq);
+	kmem_cache_destroy(v9fs_inode_cache);
+	return err;
 }
 
 /**
@@ -306,6 +420,8 @@ static int __init init_v9fs(void)
 static void __exit exit_v9fs(void)
 {
 	unregister_filesystem(&v9fs_fs_type);
+	destroy_workqueue(v9fs_wcombine_wq);
+	kmem_cache_destroy(v9fs_inode_cache);
 }
 
 module_init(init_v9fs)
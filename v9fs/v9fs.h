@@ -28,6 +28,9 @@
  * @V9FS_ACCESS_USER: a new attach will be issued for every user (default)
  * @V9FS_ACCESS_ANY: use a single attach for all users
  * @V9FS_ACCESS_MASK: bit mask of different ACCESS options
+ * @V9FS_WCOMBINE: combine small sequential writes on uncached files
+ * @V9FS_DIRCACHE: keep the contents of directories that were read
+ * @V9FS_RDPLUS: instantiate dentries and inodes from directory reads
  *
  * Session flags reflect options selected by users at mount time
  */
@@ -37,6 +40,9 @@ enum p9_session_flags {
 	V9FS_ACCESS_USER	= 0x04,
 	V9FS_ACCESS_ANY		= 0x06,
 	V9FS_ACCESS_MASK	= 0x06,
+	V9FS_WCOMBINE		= 0x08,
+	V9FS_DIRCACHE		= 0x10,
+	V9FS_RDPLUS		= 0x20,
 };
 
 /* possible values of ->cache */
@@ -44,6 +50,7 @@ enum p9_session_flags {
  * enum p9_cache_modes - user specified cache preferences
  * @CACHE_NONE: do not cache data, dentries, or directory contents (default)
  * @CACHE_LOOSE: cache data, dentries, and directory contents w/no consistency
+ * @CACHE_WRITEBACK: like @CACHE_LOOSE, but also delay writes in the page cache
  *
  * eventually support loose, tight, time, session, default always none
  */
@@ -51,6 +58,7 @@ enum p9_session_flags {
 enum p9_cache_modes {
 	CACHE_NONE,
 	CACHE_LOOSE,
+	CACHE_WRITEBACK,
 };
 
 /**
@@ -60,6 +68,16 @@ enum p9_cache_modes {
  * @debug: debug level
  * @afid: authentication handle
  * @cache: cache mode of type &p9_cache_modes
+ * @pipeline: requests a large uncached read may keep in flight
+ * @acregmin: shortest time attributes of a file are cached for (jiffies)
+ * @acregmax: longest time attributes of a file are cached for
+ * @acdirmin: shortest time attributes of a directory are cached for
+ * @acdirmax: longest time attributes of a directory are cached for
+ * @negtimeout: how long a failed lookup is remembered for (jiffies)
+ * @dircache_timeo: how long directory contents are trusted for when the
+ *	server does not version directories (jiffies)
+ * @fidcache: how many fids path walks may leave on intermediate dentries
+ * @fidcache_used: fids currently left there
  * @options: copy of options string given by user
  * @uname: string user name to mount hierarchy as
  * @aname: mount specifier for remote hierarchy
@@ -84,6 +102,15 @@ struct v9fs_session_info {
 	unsigned short debug;
 	unsigned int afid;
 	unsigned int cache;
+	unsigned int pipeline;
+	unsigned long acregmin;
+	unsigned long acregmax;
+	unsigned long acdirmin;
+	unsigned long acdirmax;
+	unsigned long negtimeout;
+	unsigned long dircache_timeo;
+	unsigned int fidcache;
+	atomic_t fidcache_used;
 
 	char *uname;		/* user name to mount as */
 	char *aname;		/* name of remote hierarchy being mounted */
@@ -95,7 +122,58 @@ struct v9fs_session_info {
 	struct dentry *debugfs_dir;
 };
 
+struct v9fs_dircache;
+
+/**
+ * struct v9fs_inode - per-inode 9P private data
+ * @writeback_fid: fid opened for reading and writing that dirty pages are
+ *	written back with, in %CACHE_WRITEBACK mode
+ * @writeback_mutex: serialises setting up @writeback_fid
+ * @readahead: asynchronous readahead Treads in flight
+ * @readahead_wq: woken when @readahead drops to zero
+ * @qid_version: qid version the attributes were last seen with
+ * @attr_valid: the cached attributes may be used until they expire
+ * @attr_time: when the attributes were last fetched, in jiffies
+ * @attr_timeo: how long they are trusted for, adapting between the ac*min
+ *	and ac*max mount options
+ * @wcombine: write-combining buffers of the files open on this inode
+ * @wcombine_lock: guards @wcombine
+ * @dir_gen: bumped when names in the directory change from this client
+ * @dircache: contents of the directory, with %V9FS_DIRCACHE
+ * @rdplus_off: reading the directory with stats did not pay last time
+ * @rdplus_used: attributes of an entry were asked for since the directory
+ *	was last read from the start
+ * @rdplus_count: dentries the current read of the directory instantiated
+ * @vfs_inode: the VFS inode
+ */
+
+struct v9fs_inode {
+	struct p9_fid *writeback_fid;
+	struct mutex writeback_mutex;
+	atomic_t readahead;
+	wait_queue_head_t readahead_wq;
+	u32 qid_version;
+	int attr_valid;
+	unsigned long attr_time;
+	unsigned long attr_timeo;
+	struct list_head wcombine;
+	struct mutex wcombine_lock;
+	unsigned long dir_gen;
+	struct v9fs_dircache *dircache;
+	int rdplus_off;
+	int rdplus_used;
+	unsigned int rdplus_count;
+	struct inode vfs_inode;
+};
+
+static inline struct v9fs_inode *V9FS_I(const struct inode *inode)
+{
+	return container_of(inode, struct v9fs_inode, vfs_inode);
+}
+
 extern struct dentry *v9fs_debugfs_root;
+extern struct kmem_cache *v9fs_inode_cache;
+extern struct workqueue_struct *v9fs_wcombine_wq;
 
 struct p9_fid *v9fs_session_init(struct v9fs_session_info *, const char *,
 									char *);
@@ -110,12 +188,27 @@ void v9fs_session_cancel(struct v9fs_session_info *v9ses);
 #define V9FS_DEFANAME	""
 #define V9FS_DEFUID	(-2)
 #define V9FS_DEFGID	(-2)
+#define V9FS_DEFAULT_PIPELINE	4
+#define V9FS_MAX_PIPELINE	32
+/* how long entries returned by a readdirplus are used for at least */
+#define V9FS_RDPLUS_TIMEO	HZ
 
 static inline struct v9fs_session_info *v9fs_inode2v9ses(struct inode *inode)
 {
 	return (inode->i_sb->s_fs_info);
 }
 
+/* the most data a single Tread or Twrite on @fid can move */
+static inline u32 v9fs_iosize(struct p9_fid *fid)
+{
+	u32 size = fid->clnt->msize - P9_IOHDRSZ;
+
+	if (fid->iounit && fid->iounit < size)
+		size = fid->iounit;
+
+	return size;
+}
+
 static inline int v9fs_extended(struct v9fs_session_info *v9ses)
 {
 	return v9ses->flags & V9FS_EXTENDED;
@@ -45,12 +45,24 @@ extern const struct dentry_operations v9fs_dentry_operations;
 extern const struct dentry_operations v9fs_cached_dentry_operations;
 
 struct inode *v9fs_get_inode(struct super_block *sb, int mode);
+struct inode *v9fs_inode_from_stat(struct v9fs_session_info *v9ses,
+			struct p9_wstat *st, struct super_block *sb);
 ino_t v9fs_qid2ino(struct p9_qid *qid);
 void v9fs_stat2inode(struct p9_wstat *, struct inode *, struct super_block *);
+int v9fs_attr_valid(struct inode *inode);
+void v9fs_invalidate_attr(struct inode *inode);
+void v9fs_check_qid(struct inode *inode, struct p9_qid *qid);
 int v9fs_dir_release(struct inode *inode, struct file *filp);
+void v9fs_dircache_drop(struct inode *inode);
 int v9fs_file_open(struct inode *inode, struct file *file);
+void v9fs_wcombine_release(struct p9_fid *fid);
+int v9fs_wcombine_sync_inode(struct inode *inode);
 void v9fs_inode2stat(struct inode *inode, struct p9_wstat *stat);
+void v9fs_blank_wstat(struct p9_wstat *wstat);
 void v9fs_dentry_release(struct dentry *);
 int v9fs_uflags2omode(int uflags, int extended);
 
 ssize_t v9fs_file_readn(struct file *, char *, char __user *, u32, u64);
+ssize_t v9fs_fid_readn(struct p9_fid *, char *, char __user *, u32, u64, int);
+ssize_t v9fs_fid_writen(struct p9_fid *, char *, const char __user *, u32,
+								u64, int);
@@ -31,6 +31,7 @@
 #include <linux/string.h>
 #include <linux/inet.h>
 #include <linux/pagemap.h>
+#include <linux/writeback.h>
 #include <linux/idr.h>
 #include <linux/sched.h>
 #include "9p.h"
@@ -40,24 +41,23 @@
 #include "v9fs_vfs.h"
 
 /**
- * v9fs_vfs_readpage - read an entire page in from 9P
+ * v9fs_fid_readpage - read an entire page in from 9P
  *
- * @filp: file being read
- * @page: structure to page
+ * @fid: fid to read with
+ * @page: locked page to fill
  *
  */
 
-static int v9fs_vfs_readpage(struct file *filp, struct page *page)
+static int v9fs_fid_readpage(struct p9_fid *fid, struct page *page)
 {
 	int retval;
 	loff_t offset;
 	char *buffer;
 
-	P9_DPRINTK(P9_DEBUG_VFS, "\n");
 	buffer = kmap(page);
 	offset = page_offset(page);
 
-	retval = v9fs_file_readn(filp, buffer, NULL, PAGE_CACHE_SIZE, offset);
+	retval = v9fs_fid_readn(fid, buffer, NULL, PAGE_CACHE_SIZE, offset, 1);
 	if (retval < 0)
 		goto done;
 
@@ -68,10 +68,508 @@ static int v9fs_vfs_readpage(struct file *filp, struct page *page)
 
 done:
 	kunmap(page);
+	return retval;
+}
+
+/**
+ * v9fs_vfs_readpage - read an entire page in from 9P
+ *
+ * @filp: file being read
+ * @page: structure to page
+ *
+ */
+
+static int v9fs_vfs_readpage(struct file *filp, struct page *page)
+{
+	int retval;
+
+	P9_DPRINTK(P9_DEBUG_VFS, "\n");
+	retval = v9fs_fid_readpage(filp->private_data, page);
+	unlock_page(page);
+	return retval;
+}
+
+/**
+ * struct v9fs_readahead - a run of pages read with one asynchronous Tread
+ * @clnt: client the Tread was issued on
+ * @inode: inode the pages belong to
+ * @index: index of the first page
+ * @nr_pages: number of pages in @pages
+ * @pages: locked pages, contiguous from @index
+ */
+
+struct v9fs_readahead {
+	struct p9_client *clnt;
+	struct inode *inode;
+	pgoff_t index;
+	int nr_pages;
+	struct page *pages[0];
+};
+
+/* copy the Rread data into the pages, which stay locked */
+static void v9fs_readahead_fill(struct v9fs_readahead *ra, char *data,
+								int count)
+{
+	loff_t offset = (loff_t) ra->index << PAGE_CACHE_SHIFT;
+	int len = ra->nr_pages << PAGE_CACHE_SHIFT;
+	struct page *page;
+	char *buffer;
+	int i, n, eof;
+
+	if (count > len)
+		count = -EIO;
+
+	/* a short read only means the rest is a hole if it ended at EOF */
+	eof = count < len && offset + count >= i_size_read(ra->inode);
+	for (i = 0; i < ra->nr_pages; i++) {
+		page = ra->pages[i];
+		if (count < 0) {
+			SetPageError(page);
+			continue;
+		}
+
+		n = clamp_t(int, count - (i << PAGE_CACHE_SHIFT), 0,
+							PAGE_CACHE_SIZE);
+		if (n < PAGE_CACHE_SIZE && !eof)
+			continue;	/* left for v9fs_vfs_readpage */
+
+		buffer = kmap_atomic(page, KM_USER0);
+		memcpy(buffer, data + (i << PAGE_CACHE_SHIFT), n);
+		memset(buffer + n, 0, PAGE_CACHE_SIZE - n);
+		kunmap_atomic(buffer, KM_USER0);
+		flush_dcache_page(page);
+		SetPageUptodate(page);
+	}
+}
+
+static void v9fs_readahead_end(struct v9fs_readahead *ra)
+{
+	struct v9fs_inode *v9inode = V9FS_I(ra->inode);
+	int i;
+
+	/* the locked pages keep the inode around until they are unlocked */
+	if (atomic_dec_and_test(&v9inode->readahead))
+		wake_up(&v9inode->readahead_wq);
+
+	for (i = 0; i < ra->nr_pages; i++) {
+		unlock_page(ra->pages[i]);
+		page_cache_release(ra->pages[i]);
+	}
+	kfree(ra);
+}
+
+static void v9fs_readahead_done(struct p9_req_t *req, void *arg)
+{
+	struct v9fs_readahead *ra = arg;
+	char *data = NULL;
+	int count;
+
+	count = p9_client_read_reply(ra->clnt, req, &data);
+	P9_DPRINTK(P9_DEBUG_VFS, "index %lu pages %d read %d\n", ra->index,
+							ra->nr_pages, count);
+	v9fs_readahead_fill(ra, data, count);
+	p9_client_put_req(ra->clnt, req);
+	v9fs_readahead_end(ra);
+}
+
+static void v9fs_readahead_submit(struct p9_fid *fid,
+						struct v9fs_readahead *ra)
+{
+	int err;
+
+	atomic_inc(&V9FS_I(ra->inode)->readahead);
+	err = p9_client_read_async(fid, (u64) ra->index << PAGE_CACHE_SHIFT,
+			ra->nr_pages << PAGE_CACHE_SHIFT, v9fs_readahead_done,
+			ra);
+	if (err < 0) {
+		v9fs_readahead_fill(ra, NULL, err);
+		v9fs_readahead_end(ra);
+	}
+}
+
+/**
+ * v9fs_vfs_readpages - read a readahead window
+ * @filp: file being read
+ * @mapping: address space of the file
+ * @pages: pages to read, not yet in the page cache
+ * @nr_pages: number of pages on @pages
+ *
+ * Contiguous pages are read with as few Treads as the iounit allows, all
+ * issued without waiting.  The pages are unlocked as the Rreads come in.
+ */
+
+static int v9fs_vfs_readpages(struct file *filp, struct address_space *mapping,
+				struct list_head *pages, unsigned nr_pages)
+{
+	struct p9_fid *fid = filp->private_data;
+	struct p9_client *clnt = fid->clnt;
+	struct v9fs_readahead *ra = NULL;
+	struct page *page;
+	int max;
+
+	P9_DPRINTK(P9_DEBUG_VFS, "%u pages\n", nr_pages);
+	max = v9fs_iosize(fid) >> PAGE_CACHE_SHIFT;
+	if (!max)
+		return read_cache_pages(mapping, pages,
+				(filler_t *) v9fs_vfs_readpage, filp);
+
+	/* the list is in reverse order */
+	while (!list_empty(pages)) {
+		page = list_entry(pages->prev, struct page, lru);
+		list_del(&page->lru);
+		if (add_to_page_cache_lru(page, mapping, page->index,
+								GFP_KERNEL)) {
+			/* already cached, which ends the run */
+			page_cache_release(page);
+			if (ra)
+				v9fs_readahead_submit(fid, ra);
+			ra = NULL;
+			continue;
+		}
+
+		if (ra && (ra->nr_pages == max ||
+			   page->index != ra->index + ra->nr_pages)) {
+			v9fs_readahead_submit(fid, ra);
+			ra = NULL;
+		}
+
+		if (!ra) {
+			ra = kmalloc(sizeof(*ra) + max * sizeof(struct page *),
+								GFP_KERNEL);
+			if (!ra) {
+				/* left for v9fs_vfs_readpage */
+				unlock_page(page);
+				page_cache_release(page);
+				continue;
+			}
+			ra->clnt = clnt;
+			ra->inode = mapping->host;
+			ra->index = page->index;
+			ra->nr_pages = 0;
+		}
+		ra->pages[ra->nr_pages++] = page;
+	}
+
+	if (ra)
+		v9fs_readahead_submit(fid, ra);
+
+	return 0;
+}
+
+/**
+ * v9fs_write_full - write a kernel buffer out
+ * @fid: fid to write with
+ * @data: data to write
+ * @offset: file offset to write at
+ * @count: number of bytes
+ *
+ * Returns 0 once all of it is written, or -ERRNO.
+ */
+
+static int v9fs_write_full(struct p9_fid *fid, char *data, u64 offset,
+								u32 count)
+{
+	int n;
+
+	while (count > 0) {
+		n = p9_client_write(fid, data, NULL, offset, count);
+		if (n < 0)
+			return n;
+		if (n == 0)
+			return -EIO;
+
+		data += n;
+		offset += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+/* bytes of a page that lie inside the file, 0 if it was truncated away */
+static unsigned int v9fs_page_len(struct inode *inode, struct page *page)
+{
+	loff_t size = i_size_read(inode);
+	loff_t offset = page_offset(page);
+
+	if (offset >= size)
+		return 0;
+
+	return min_t(loff_t, size - offset, PAGE_CACHE_SIZE);
+}
+
+/**
+ * v9fs_vfs_writepage - write a dirty page back
+ * @page: locked page
+ * @wbc: writeback control
+ *
+ */
+
+static int v9fs_vfs_writepage(struct page *page, struct writeback_control *wbc)
+{
+	struct inode *inode = page->mapping->host;
+	struct p9_fid *fid = V9FS_I(inode)->writeback_fid;
+	unsigned int len;
+	char *buffer;
+	int retval;
+
+	P9_DPRINTK(P9_DEBUG_VFS, "page %p index %lu\n", page, page->index);
+	len = v9fs_page_len(inode, page);
+	if (!len) {
+		unlock_page(page);
+		return 0;
+	}
+
+	set_page_writeback(page);
+	retval = -EIO;
+	if (fid) {
+		buffer = kmap(page);
+		retval = v9fs_write_full(fid, buffer, page_offset(page), len);
+		kunmap(page);
+	}
+	/* a write that failed because of a signal is tried again later */
+	if (retval == -ERESTARTSYS)
+		redirty_page_for_writepage(wbc, page);
+	else if (retval < 0) {
+		SetPageError(page);
+		mapping_set_error(page->mapping, retval);
+	}
+
+	end_page_writeback(page);
+	unlock_page(page);
+	return retval == -ERESTARTSYS ? 0 : retval;
+}
+
+/**
+ * struct v9fs_writeback - contiguous dirty pages gathered for one write
+ * @mapping: address space being written back
+ * @fid: fid to write with
+ * @buf: bounce buffer the pages are copied into
+ * @size: size of @buf, a whole number of pages up to the iounit
+ * @offset: file offset of @buf
+ * @len: bytes gathered in @buf
+ * @pages: pages under writeback whose data is in @buf
+ * @nr_pages: number of @pages
+ * @err: first error met
+ *
+ * The pages are unlocked once copied, so a write to the server doesn't
+ * hold up readers and writers of the file; the copy is what gets written.
+ */
+
+struct v9fs_writeback {
+	struct address_space *mapping;
+	struct p9_fid *fid;
+	char *buf;
+	u32 size;
+	u64 offset;
+	u32 len;
+	struct page **pages;
+	int nr_pages;
+	int err;
+};
+
+static void v9fs_writeback_flush(struct v9fs_writeback *wb)
+{
+	int i, err;
+
+	if (!wb->nr_pages)
+		return;
+
+	err = v9fs_write_full(wb->fid, wb->buf, wb->offset, wb->len);
+	if (err < 0 && err != -ERESTARTSYS) {
+		mapping_set_error(wb->mapping, err);
+		if (!wb->err)
+			wb->err = err;
+	}
+
+	for (i = 0; i < wb->nr_pages; i++) {
+		if (err < 0 && err != -ERESTARTSYS)
+			SetPageError(wb->pages[i]);
+		end_page_writeback(wb->pages[i]);
+		/* a write that failed because of a signal is tried again */
+		if (err == -ERESTARTSYS)
+			set_page_dirty_lock(wb->pages[i]);
+		page_cache_release(wb->pages[i]);
+	}
+
+	wb->nr_pages = 0;
+	wb->len = 0;
+}
+
+static int v9fs_writepages_fill(struct page *page,
+			struct writeback_control *wbc, void *data)
+{
+	struct v9fs_writeback *wb = data;
+	unsigned int len;
+	char *buffer;
+
+	len = v9fs_page_len(page->mapping->host, page);
+	if (!len) {
+		unlock_page(page);
+		return 0;
+	}
+
+	/* only pages that follow on from the last one share a write */
+	if (wb->nr_pages && page_offset(page) != wb->offset + wb->len)
+		v9fs_writeback_flush(wb);
+
+	if (!wb->nr_pages)
+		wb->offset = page_offset(page);
+
+	buffer = kmap_atomic(page, KM_USER0);
+	memcpy(wb->buf + wb->len, buffer, len);
+	kunmap_atomic(buffer, KM_USER0);
+
+	set_page_writeback(page);
+	page_cache_get(page);
 	unlock_page(page);
+	wb->pages[wb->nr_pages++] = page;
+	wb->len += len;
+
+	if (len < PAGE_CACHE_SIZE || wb->len == wb->size)
+		v9fs_writeback_flush(wb);
+
+	return 0;
+}
+
+/**
+ * v9fs_vfs_writepages - write dirty pages back
+ * @mapping: address space of the file
+ * @wbc: writeback control
+ *
+ * Runs of contiguous dirty pages are written with as few Twrites as the
+ * iounit allows rather than one per page.
+ */
+
+static int v9fs_vfs_writepages(struct address_space *mapping,
+				struct writeback_control *wbc)
+{
+	struct v9fs_writeback wb;
+	struct p9_fid *fid;
+	int retval;
+
+	fid = V9FS_I(mapping->host)->writeback_fid;
+	if (!fid)
+		return generic_writepages(mapping, wbc);
+
+	wb.size = v9fs_iosize(fid) & PAGE_CACHE_MASK;
+	if (wb.size <= PAGE_CACHE_SIZE)
+		return generic_writepages(mapping, wbc);
+
+	wb.mapping = mapping;
+	wb.fid = fid;
+	wb.buf = kmalloc(wb.size, GFP_NOFS);
+	wb.pages = kmalloc(sizeof(struct page *) *
+			(wb.size >> PAGE_CACHE_SHIFT), GFP_NOFS);
+	if (!wb.buf || !wb.pages) {
+		kfree(wb.buf);
+		kfree(wb.pages);
+		return generic_writepages(mapping, wbc);
+	}
+	wb.len = 0;
+	wb.nr_pages = 0;
+	wb.err = 0;
+
+	retval = write_cache_pages(mapping, wbc, v9fs_writepages_fill, &wb);
+	v9fs_writeback_flush(&wb);
+	if (!retval)
+		retval = wb.err;
+
+	kfree(wb.buf);
+	kfree(wb.pages);
 	return retval;
 }
 
+/**
+ * v9fs_write_begin - prepare a page for a buffered write
+ * @filp: file being written
+ * @mapping: its address space
+ * @pos: file offset of the write
+ * @len: bytes to write in this page
+ * @flags: AOP_FLAG_xxx
+ * @pagep: returns the locked page
+ * @fsdata: unused
+ *
+ * A page the write doesn't cover completely is read in first, using the
+ * writeback fid since the file may be open for writing only.
+ */
+
+static int v9fs_write_begin(struct file *filp, struct address_space *mapping,
+			loff_t pos, unsigned len, unsigned flags,
+			struct page **pagep, void **fsdata)
+{
+	struct inode *inode = mapping->host;
+	struct page *page;
+	int retval;
+
+	P9_DPRINTK(P9_DEBUG_VFS, "filp %p pos %lld len %u\n", filp, pos, len);
+	page = grab_cache_page_write_begin(mapping, pos >> PAGE_CACHE_SHIFT,
+								flags);
+	if (!page)
+		return -ENOMEM;
+
+	if (!PageUptodate(page) && len != PAGE_CACHE_SIZE) {
+		retval = -EIO;
+		if (V9FS_I(inode)->writeback_fid)
+			retval = v9fs_fid_readpage(V9FS_I(inode)->writeback_fid,
+									page);
+		if (retval < 0) {
+			unlock_page(page);
+			page_cache_release(page);
+			return retval;
+		}
+	}
+
+	*pagep = page;
+	return 0;
+}
+
+/**
+ * v9fs_write_end - finish a buffered write
+ * @filp: file being written
+ * @mapping: its address space
+ * @pos: file offset of the write
+ * @len: bytes that were to be written
+ * @copied: bytes actually copied from user space
+ * @page: the page, locked
+ * @fsdata: unused
+ *
+ */
+
+static int v9fs_write_end(struct file *filp, struct address_space *mapping,
+			loff_t pos, unsigned len, unsigned copied,
+			struct page *page, void *fsdata)
+{
+	struct inode *inode = mapping->host;
+	loff_t last_pos = pos + copied;
+
+	if (unlikely(copied < len)) {
+		/* a short copy into a page that isn't up to date is retried */
+		if (!PageUptodate(page)) {
+			copied = 0;
+			goto out;
+		}
+	} else if (len == PAGE_CACHE_SIZE)
+		SetPageUptodate(page);
+
+	if (last_pos > inode->i_size) {
+		i_size_write(inode, last_pos);
+		inode->i_blocks = (last_pos + 512 - 1) >> 9;
+	}
+	set_page_dirty(page);
+
+out:
+	unlock_page(page);
+	page_cache_release(page);
+	return copied;
+}
+
 const struct address_space_operations v9fs_addr_operations = {
       .readpage = v9fs_vfs_readpage,
+      .readpages = v9fs_vfs_readpages,
+      .writepage = v9fs_vfs_writepage,
+      .writepages = v9fs_vfs_writepages,
+      .write_begin = v9fs_write_begin,
+      .write_end = v9fs_write_end,
+      .set_page_dirty = __set_page_dirty_nobuffers,
 };
@@ -45,17 +45,110 @@
  * v9fs_dentry_delete - called when dentry refcount equals 0
  * @dentry:  dentry in question
  *
- * By returning 1 here we should remove cacheing of unused
- * dentry components.
+ * Dentries are kept, v9fs_dentry_revalidate checks them before they are
+ * used again.  Negative ones are dropped unless negtimeout is set.  The
+ * fids of a kept dentry are dropped, so unused dentries don't hold the
+ * server's fids open.
  *
  */
 
 static int v9fs_dentry_delete(struct dentry *dentry)
 {
+	struct v9fs_session_info *v9ses = dentry->d_sb->s_fs_info;
+
+	P9_DPRINTK(P9_DEBUG_VFS, " dentry: %s (%p)\n", dentry->d_name.name,
+									dentry);
+
+	if (!dentry->d_inode)
+		return !v9ses->negtimeout;
+
+	v9fs_fid_drop_unused(dentry);
+	return 0;
+}
+
+/**
+ * v9fs_dentry_revalidate - check that a cached dentry still names its file
+ * @dentry: dentry to check
+ * @nd: lookup data
+ *
+ * A dentry is trusted without asking the server while the attributes of
+ * its directory are cached (see acdirmin) and show the same qid version
+ * as when the dentry was last checked.  Otherwise the name is walked
+ * again from the directory and has to lead to the same qid path; the
+ * fid of that walk is kept on a dentry that has none.
+ *
+ * With readdirplus, a dentry the last read of its directory returned is
+ * trusted for a second after that read, which covers the stat of every
+ * entry that usually follows it.
+ *
+ * A negative dentry is trusted for negtimeout, unless the directory was
+ * seen with a new qid version or had a name created or renamed into it
+ * from here in the meantime.
+ */
+
+static int v9fs_dentry_revalidate(struct dentry *dentry, struct nameidata *nd)
+{
+	struct v9fs_session_info *v9ses = dentry->d_sb->s_fs_info;
+	struct v9fs_dentry *dent = dentry->d_fsdata;
+	struct inode *inode = dentry->d_inode;
+	struct v9fs_inode *v9dir;
+	struct dentry *parent;
+	struct p9_fid *dfid, *fid;
+	unsigned long expires;
+	char *name;
+	int ret;
+
 	P9_DPRINTK(P9_DEBUG_VFS, " dentry: %s (%p)\n", dentry->d_name.name,
 									dentry);
+	if (!dent)
+		return 0;
+
+	parent = dget_parent(dentry);
+	v9dir = V9FS_I(parent->d_inode);
+	if (!inode) {
+		expires = dentry->d_time + v9ses->negtimeout;
+		ret = v9ses->negtimeout && time_before(jiffies, expires) &&
+			dent->dir_version == v9dir->qid_version &&
+			dent->dir_gen == v9dir->dir_gen;
+		goto out;
+	}
+
+	if (dent->dir_version && dent->dir_version == v9dir->qid_version &&
+	    v9fs_attr_valid(parent->d_inode)) {
+		ret = 1;
+		goto out;
+	}
 
-	return 1;
+	expires = dent->plus_time + V9FS_RDPLUS_TIMEO;
+	if (dent->plus_time && time_before(jiffies, expires)) {
+		ret = 1;
+		goto out;
+	}
+
+	ret = 0;
+	dfid = v9fs_fid_lookup(parent);
+	if (IS_ERR(dfid))
+		goto out;
+
+	name = (char *) dentry->d_name.name;
+	fid = p9_client_walk(dfid, 1, &name, 1);
+	p9_fid_put(dfid);
+	if (IS_ERR(fid))
+		goto out;
+
+	if (v9fs_qid2ino(&fid->qid) == inode->i_ino) {
+		v9fs_check_qid(inode, &fid->qid);
+		dent->dir_version = v9dir->qid_version;
+		ret = 1;
+		/* the lookup that follows would only walk the name again */
+		if (!dent->fids && v9fs_fid_add(dentry, fid) == 0)
+			goto out;
+	}
+	p9_client_clunk(fid);
+
+out:
+	dput(parent);
+	return ret;
 }
 
 /**
@@ -63,7 +156,8 @@ static int v9fs_dentry_delete(struct dentry *dentry)
  * @dentry:  dentry in question
  *
  * Only return 1 if our inode is invalid.  Only non-synthetic files
- * (ones without mtime == 0) should be calling this function.
+ * (ones without mtime == 0) should be calling this function.  Kept
+ * dentries drop their fids, as in v9fs_dentry_delete.
  *
  */
 
@@ -76,6 +170,7 @@ static int v9fs_cached_dentry_delete(struct dentry *dentry)
 	if(!inode)
 		return 1;
 
+	v9fs_fid_drop_unused(dentry);
 	return 0;
 }
 
@@ -88,17 +183,12 @@ static int v9fs_cached_dentry_delete(struct dentry *dentry)
 void v9fs_dentry_release(struct dentry *dentry)
 {
 	struct v9fs_dentry *dent;
-	struct p9_fid *temp, *current_fid;
 
 	P9_DPRINTK(P9_DEBUG_VFS, " dentry: %s (%p)\n", dentry->d_name.name,
 									dentry);
 	dent = dentry->d_fsdata;
 	if (dent) {
-		list_for_each_entry_safe(current_fid, temp, &dent->fidlist,
-									dlist) {
-			p9_client_clunk(current_fid);
-		}
-
+		v9fs_fid_drop_all(dentry);
 		kfree(dent);
 		dentry->d_fsdata = NULL;
 	}
@@ -110,6 +200,7 @@ const struct dentry_operations v9fs_cached_dentry_operations = {
 };
 
 const struct dentry_operations v9fs_dentry_operations = {
+	.d_revalidate = v9fs_dentry_revalidate,
 	.d_delete = v9fs_dentry_delete,
 	.d_release = v9fs_dentry_release,
 };
@@ -58,12 +58,406 @@ static inline int dt_type(struct p9_wstat *mistat)
 	return rettype;
 }
 
+/* bytes of entries one directory may keep cached */
+#define V9FS_DIRCACHE_MAX	(1 << 20)
+
+/**
+ * struct v9fs_dirent - a cached directory entry
+ * @offset: offset of the entry in the directory, used as its f_pos
+ * @ino: inode number, from the qid
+ * @reclen: size of the stat record of the entry
+ * @namelen: length of @name
+ * @type: DT_ type of the entry
+ * @name: name, not NUL terminated
+ */
+
+struct v9fs_dirent {
+	u64 offset;
+	u64 ino;
+	u32 reclen;
+	u16 namelen;
+	u8 type;
+	char name[0];
+};
+
+#define V9FS_DIRENT_SIZE(namelen) \
+	ALIGN(sizeof(struct v9fs_dirent) + (namelen), sizeof(u64))
+
+/**
+ * struct v9fs_dirchunk - a page of cached directory entries
+ * @list: link in &v9fs_dircache.chunks
+ * @used: bytes of @data in use
+ * @data: packed &struct v9fs_dirent entries
+ */
+
+struct v9fs_dirchunk {
+	struct list_head list;
+	int used;
+	char data[0];
+};
+
+#define V9FS_DIRCHUNK_DATA	(PAGE_SIZE - sizeof(struct v9fs_dirchunk))
+
+/**
+ * struct v9fs_dircache - cached contents of a directory
+ * @version: qid version of the directory the contents were read at
+ * @gen: &v9fs_inode.dir_gen when they were read
+ * @time: when reading started, in jiffies
+ * @fid: fid still reading the contents in, NULL once complete
+ * @end: offset just past the last cached entry
+ * @size: bytes of chunks allocated
+ * @chunks: list of &struct v9fs_dirchunk
+ *
+ * Protected by the i_mutex of the directory, which readdir, create,
+ * remove and rename all hold.
+ */
+
+struct v9fs_dircache {
+	u32 version;
+	unsigned long gen;
+	unsigned long time;
+	struct p9_fid *fid;
+	u64 end;
+	size_t size;
+	struct list_head chunks;
+};
+
+/**
+ * v9fs_dircache_drop - free the cached contents of a directory
+ * @inode: the directory
+ *
+ */
+
+void v9fs_dircache_drop(struct inode *inode)
+{
+	struct v9fs_inode *v9inode = V9FS_I(inode);
+	struct v9fs_dircache *dc = v9inode->dircache;
+	struct v9fs_dirchunk *chunk, *next;
+
+	if (!dc)
+		return;
+
+	list_for_each_entry_safe(chunk, next, &dc->chunks, list)
+		free_page((unsigned long) chunk);
+	kfree(dc);
+	v9inode->dircache = NULL;
+}
+
+/* start caching the contents of a directory that is read from the start */
+static void v9fs_dircache_start(struct inode *inode, struct p9_fid *fid)
+{
+	struct v9fs_inode *v9inode = V9FS_I(inode);
+	struct v9fs_dircache *dc;
+
+	v9fs_dircache_drop(inode);
+	dc = kmalloc(sizeof(struct v9fs_dircache), GFP_KERNEL);
+	if (!dc)
+		return;
+
+	dc->version = fid->qid.version;
+	dc->gen = v9inode->dir_gen;
+	dc->time = jiffies;
+	dc->fid = fid;
+	dc->end = 0;
+	dc->size = 0;
+	INIT_LIST_HEAD(&dc->chunks);
+	v9inode->dircache = dc;
+}
+
+/* add the entry read by @fid at @offset, if it carries on the cache */
+static void v9fs_dircache_add(struct inode *inode, struct p9_fid *fid,
+					struct p9_wstat *st, u64 offset)
+{
+	struct v9fs_dircache *dc = V9FS_I(inode)->dircache;
+	struct v9fs_dirchunk *chunk = NULL;
+	struct v9fs_dirent *de;
+	int namelen, size;
+
+	if (!dc || dc->fid != fid || dc->end != offset)
+		return;
+
+	namelen = strlen(st->name);
+	size = V9FS_DIRENT_SIZE(namelen);
+	if (!list_empty(&dc->chunks))
+		chunk = list_entry(dc->chunks.prev, struct v9fs_dirchunk, list);
+
+	if (!chunk || chunk->used + size > V9FS_DIRCHUNK_DATA) {
+		chunk = NULL;
+		if (size <= V9FS_DIRCHUNK_DATA &&
+		    dc->size + PAGE_SIZE <= V9FS_DIRCACHE_MAX)
+			chunk = (struct v9fs_dirchunk *)
+					__get_free_page(GFP_KERNEL);
+		if (!chunk) {
+			/* too big (or no memory) to cache */
+			v9fs_dircache_drop(inode);
+			return;
+		}
+
+		chunk->used = 0;
+		list_add_tail(&chunk->list, &dc->chunks);
+		dc->size += PAGE_SIZE;
+	}
+
+	de = (struct v9fs_dirent *) (chunk->data + chunk->used);
+	de->offset = offset;
+	de->ino = v9fs_qid2ino(&st->qid);
+	de->reclen = st->size + 2;
+	de->namelen = namelen;
+	de->type = dt_type(st);
+	memcpy(de->name, st->name, namelen);
+	chunk->used += size;
+	dc->end = offset + de->reclen;
+}
+
+/* the directory was read to the end */
+static void v9fs_dircache_complete(struct inode *inode, struct p9_fid *fid,
+								u64 offset)
+{
+	struct v9fs_dircache *dc = V9FS_I(inode)->dircache;
+
+	if (dc && dc->fid == fid) {
+		if (dc->end == offset)
+			dc->fid = NULL;
+		else
+			v9fs_dircache_drop(inode);
+	}
+}
+
+/**
+ * v9fs_dircache_valid - check whether the cached contents can be used
+ * @inode: the directory
+ * @fid: fid the directory is open with
+ *
+ * Cached contents are good while the qid version the directory was
+ * opened with matches the one they were read at and nothing in it was
+ * changed from here.  Servers that leave the version of directories at
+ * 0 get the dircache= timeout instead.
+ */
+
+static int v9fs_dircache_valid(struct inode *inode, struct p9_fid *fid)
+{
+	struct v9fs_session_info *v9ses = v9fs_inode2v9ses(inode);
+	struct v9fs_dircache *dc = V9FS_I(inode)->dircache;
+
+	if (!dc || dc->fid || dc->gen != V9FS_I(inode)->dir_gen)
+		return 0;
+
+	if (dc->version && fid->qid.version)
+		return dc->version == fid->qid.version;
+
+	return time_before(jiffies, dc->time + v9ses->dircache_timeo);
+}
+
+static int v9fs_dircache_readdir(struct file *filp, void *dirent,
+							filldir_t filldir)
+{
+	struct inode *inode = filp->f_path.dentry->d_inode;
+	struct v9fs_dircache *dc = V9FS_I(inode)->dircache;
+	struct v9fs_dirchunk *chunk;
+	struct v9fs_dirent *de;
+	int pos;
+
+	list_for_each_entry(chunk, &dc->chunks, list) {
+		for (pos = 0; pos < chunk->used;
+					pos += V9FS_DIRENT_SIZE(de->namelen)) {
+			de = (struct v9fs_dirent *) (chunk->data + pos);
+			if (de->offset < filp->f_pos)
+				continue;
+
+			if (filldir(dirent, de->name, de->namelen, de->offset,
+							de->ino, de->type))
+				return 0;
+
+			filp->f_pos = de->offset + de->reclen;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * struct v9fs_rdir - directory data read ahead for an open directory
+ * @req: Rread the entries are being decoded from
+ * @data: the data in @req
+ * @head: offset in @data of the next entry to return
+ * @tail: bytes of data in @req
+ * @next: Tread already sent for the data following @req
+ *
+ * Hangs off &p9_fid.rdir.  The directory offset of @data + @head is
+ * &p9_fid.rdir_fpos, and @next reads from where @req ended, so that the
+ * next chunk is on its way while userspace consumes this one.
+ */
+
+struct v9fs_rdir {
+	struct p9_req_t *req;
+	char *data;
+	int head;
+	int tail;
+	struct p9_req_t *next;
+};
+
+/* forget the data read ahead, waiting for the Tread still in flight */
+static void v9fs_rdir_reset(struct p9_fid *fid)
+{
+	struct v9fs_rdir *rdir = fid->rdir;
+	char *data;
+
+	if (rdir->req) {
+		p9_client_put_req(fid->clnt, rdir->req);
+		rdir->req = NULL;
+	}
+
+	if (rdir->next) {
+		p9_client_read_collect(fid->clnt, rdir->next, &data);
+		p9_client_put_req(fid->clnt, rdir->next);
+		rdir->next = NULL;
+	}
+
+	rdir->head = rdir->tail = 0;
+}
+
+/**
+ * v9fs_rdir_fill - move on to the next chunk of a directory
+ * @fid: the open directory, with all of its current chunk returned
+ *
+ * Takes the reply to the Tread sent ahead (or reads now, if there is
+ * none) and sends the Tread for the chunk after it.
+ *
+ * Returns the size of the chunk, 0 at the end of the directory, or a
+ * negative error.
+ */
+
+static int v9fs_rdir_fill(struct p9_fid *fid)
+{
+	struct v9fs_rdir *rdir = fid->rdir;
+	struct p9_req_t *req;
+	int err;
+
+	if (rdir->req) {
+		p9_client_put_req(fid->clnt, rdir->req);
+		rdir->req = NULL;
+	}
+	rdir->head = rdir->tail = 0;
+
+	req = rdir->next;
+	rdir->next = NULL;
+	if (!req) {
+		req = p9_client_read_post(fid, fid->rdir_fpos,
+							v9fs_iosize(fid));
+		if (IS_ERR(req))
+			return PTR_ERR(req);
+	}
+
+	err = p9_client_read_collect(fid->clnt, req, &rdir->data);
+	if (err <= 0) {
+		p9_client_put_req(fid->clnt, req);
+		return err;
+	}
+
+	rdir->req = req;
+	rdir->tail = err;
+
+	/* a failure here is seen again when the data is needed */
+	req = p9_client_read_post(fid, fid->rdir_fpos + err, v9fs_iosize(fid));
+	if (!IS_ERR(req))
+		rdir->next = req;
+
+	return err;
+}
+
+/* dentries one read of a directory from the start may instantiate */
+#define V9FS_RDPLUS_MAX	4096
+
+/**
+ * v9fs_readdirplus - make use of the stat record of a directory entry
+ * @parent: the directory being read
+ * @st: stat record of the entry
+ *
+ * The dentry of the entry is created, with an inode built from @st, or
+ * if it exists and still names the same file, its attributes are
+ * refreshed.  Either way it is trusted for %V9FS_RDPLUS_TIMEO without
+ * walking it again, and so are the attributes.  No fid is attached; the
+ * first operation that needs one walks to it.
+ */
+
+static void v9fs_readdirplus(struct dentry *parent, struct p9_wstat *st)
+{
+	struct inode *dir = parent->d_inode;
+	struct v9fs_session_info *v9ses = v9fs_inode2v9ses(dir);
+	struct v9fs_inode *v9dir = V9FS_I(dir);
+	struct v9fs_inode *v9inode;
+	struct v9fs_dentry *dent;
+	struct dentry *dentry;
+	struct inode *inode;
+	struct qstr name;
+
+	name.name = st->name;
+	name.len = strlen(st->name);
+	if (!name.len || strchr(st->name, '/') ||
+	    !strcmp(st->name, ".") || !strcmp(st->name, ".."))
+		return;
+	name.hash = full_name_hash(name.name, name.len);
+
+	dentry = d_lookup(parent, &name);
+	if (dentry) {
+		inode = dentry->d_inode;
+		dent = dentry->d_fsdata;
+		/* cached modes keep their own idea of the attributes */
+		if (inode && dent && !v9ses->cache &&
+		    inode->i_ino == v9fs_qid2ino(&st->qid) &&
+		    !S_ISDIR(inode->i_mode) == !(st->mode & P9_DMDIR)) {
+			v9fs_stat2inode(st, inode, inode->i_sb);
+			goto trust;
+		}
+
+		dput(dentry);
+		return;
+	}
+
+	if (v9dir->rdplus_count >= V9FS_RDPLUS_MAX)
+		return;
+
+	dentry = d_alloc(parent, &name);
+	if (!dentry)
+		return;
+
+	/* set first: its d_release frees the private data */
+	if ((st->qid.version) && (v9ses->cache))
+		dentry->d_op = &v9fs_cached_dentry_operations;
+	else
+		dentry->d_op = &v9fs_dentry_operations;
+
+	dent = v9fs_dentry_data(dentry);
+	if (!dent)
+		goto out;
+
+	inode = v9fs_inode_from_stat(v9ses, st, dir->i_sb);
+	if (IS_ERR(inode))
+		goto out;
+
+	d_add(dentry, inode);
+	v9dir->rdplus_count++;
+
+trust:
+	dent->dir_version = v9dir->qid_version;
+	dent->plus_time = jiffies;
+	v9inode = V9FS_I(inode);
+	if (v9inode->attr_timeo < V9FS_RDPLUS_TIMEO)
+		v9inode->attr_timeo = V9FS_RDPLUS_TIMEO;
+out:
+	dput(dentry);
+}
+
 /**
  * v9fs_dir_readdir - read a directory
  * @filp: opened file structure
  * @dirent: directory structure ???
  * @filldir: function to populate directory structure ???
  *
+ * With readdirplus, the stat records of the entries are also used to
+ * instantiate their dentries, as long as that pays: a directory whose
+ * entries had no attributes asked for between two reads from the start
+ * is read without it, until that changes or a name in it is looked up.
  */
 
 static int v9fs_dir_readdir(struct file *filp, void *dirent, filldir_t filldir)
@@ -72,54 +466,97 @@ static int v9fs_dir_readdir(struct file *filp, void *dirent, filldir_t filldir)
 	struct p9_wstat st;
 	int err;
 	struct p9_fid *fid;
-	int buflen;
-	char *statbuf;
-	int n, i = 0;
+	struct inode *inode;
+	struct v9fs_inode *v9inode;
+	struct v9fs_session_info *v9ses;
+	struct v9fs_rdir *rdir;
+	int reclen;
+	int plus = 0;
 
 	P9_DPRINTK(P9_DEBUG_VFS, "name %s\n", filp->f_path.dentry->d_name.name);
 	fid = filp->private_data;
+	inode = filp->f_path.dentry->d_inode;
+	v9ses = v9fs_inode2v9ses(inode);
 
-	buflen = fid->clnt->msize - P9_IOHDRSZ;
-	statbuf = kmalloc(buflen, GFP_KERNEL);
-	if (!statbuf)
-		return -ENOMEM;
-
-	while (1) {
-		err = v9fs_file_readn(filp, statbuf, NULL, buflen,
-								fid->rdir_fpos);
-		if (err <= 0)
-			break;
+	if (v9ses->flags & V9FS_DIRCACHE) {
+		if (v9fs_dircache_valid(inode, fid))
+			return v9fs_dircache_readdir(filp, dirent, filldir);
+		if (filp->f_pos == 0)
+			v9fs_dircache_start(inode, fid);
+	}
 
-		n = err;
-		while (i < n) {
-			err = p9stat_read(statbuf + i, buflen-i, &st,
-							fid->clnt->dotu);
-			if (err) {
-				P9_DPRINTK(P9_DEBUG_VFS, "returned %d\n", err);
-				err = -EIO;
-				p9stat_free(&st);
-				goto free_and_exit;
-			}
+	if (v9ses->flags & V9FS_RDPLUS) {
+		v9inode = V9FS_I(inode);
+		if (filp->f_pos == 0) {
+			if (v9inode->rdplus_used)
+				v9inode->rdplus_off = 0;
+			else if (v9inode->rdplus_count)
+				v9inode->rdplus_off = 1;
+			v9inode->rdplus_used = 0;
+			v9inode->rdplus_count = 0;
+		}
+		plus = !v9inode->rdplus_off;
+	}
 
-			i += st.size+2;
-			fid->rdir_fpos += st.size+2;
+	rdir = fid->rdir;
+	if (!rdir) {
+		rdir = kzalloc(sizeof(struct v9fs_rdir), GFP_KERNEL);
+		if (!rdir)
+			return -ENOMEM;
+		fid->rdir = rdir;
+	}
 
-			over = filldir(dirent, st.name, strlen(st.name),
-			    filp->f_pos, v9fs_qid2ino(&st.qid), dt_type(&st));
+	/* the offset of a directory read has to follow the last one */
+	if (fid->rdir_fpos != filp->f_pos) {
+		v9fs_rdir_reset(fid);
+		fid->rdir_fpos = 0;
+	}
 
-			filp->f_pos += st.size+2;
+	while (1) {
+		if (rdir->head == rdir->tail) {
+			err = v9fs_rdir_fill(fid);
+			if (err == 0)
+				v9fs_dircache_complete(inode, fid,
+							fid->rdir_fpos);
+			if (err <= 0)
+				break;
+		}
 
+		err = p9stat_read(rdir->data + rdir->head,
+				rdir->tail - rdir->head, &st, fid->clnt->dotu);
+		if (err) {
+			P9_DPRINTK(P9_DEBUG_VFS, "returned %d\n", err);
+			err = -EIO;
 			p9stat_free(&st);
+			v9fs_rdir_reset(fid);
+			break;
+		}
 
+		reclen = st.size + 2;
+		/* catching up with a position from the cache */
+		if (fid->rdir_fpos + reclen > filp->f_pos) {
+			over = filldir(dirent, st.name, strlen(st.name),
+					fid->rdir_fpos, v9fs_qid2ino(&st.qid),
+					dt_type(&st));
+			/* left for the next call */
 			if (over) {
+				p9stat_free(&st);
 				err = 0;
-				goto free_and_exit;
+				break;
 			}
 		}
+
+		v9fs_dircache_add(inode, fid, &st, fid->rdir_fpos);
+		rdir->head += reclen;
+		fid->rdir_fpos += reclen;
+		if (fid->rdir_fpos > filp->f_pos) {
+			filp->f_pos = fid->rdir_fpos;
+			if (plus)
+				v9fs_readdirplus(filp->f_path.dentry, &st);
+		}
+		p9stat_free(&st);
 	}
 
-free_and_exit:
-	kfree(statbuf);
 	return err;
 }
 
@@ -134,11 +571,26 @@ free_and_exit:
 int v9fs_dir_release(struct inode *inode, struct file *filp)
 {
 	struct p9_fid *fid;
+	struct v9fs_inode *v9inode = V9FS_I(inode);
 
 	fid = filp->private_data;
 	P9_DPRINTK(P9_DEBUG_VFS,
 			"inode: %p filp: %p fid: %d\n", inode, filp, fid->fid);
 	filemap_write_and_wait(inode->i_mapping);
+	/* drops contents this file was still reading in */
+	if (S_ISDIR(inode->i_mode)) {
+		/* the dircache is only touched under i_mutex, as in readdir */
+		mutex_lock(&inode->i_mutex);
+		v9fs_dircache_complete(inode, fid, ~0ULL);
+		mutex_unlock(&inode->i_mutex);
+	}
+	/* readahead may still be reading with this fid */
+	wait_event(v9inode->readahead_wq, !atomic_read(&v9inode->readahead));
+	if (fid->rdir) {
+		v9fs_rdir_reset(fid);
+		kfree(fid->rdir);
+	}
+	v9fs_wcombine_release(fid);
 	p9_client_clunk(fid);
 	return 0;
 }
@@ -32,6 +32,8 @@
 #include <linux/string.h>
 #include <linux/inet.h>
 #include <linux/list.h>
+#include <linux/pagemap.h>
+#include <linux/mm.h>
 #include <asm/uaccess.h>
 #include <linux/idr.h>
 #include "9p.h"
@@ -41,7 +43,266 @@
 #include "v9fs_vfs.h"
 #include "fid.h"
 
+/* full-sized Treads that readahead may keep in flight on a cached file */
+#define V9FS_READAHEAD_TREADS 4
+
+/* how long small writes may sit in a write-combining buffer */
+#define V9FS_WCOMBINE_DELAY (HZ / 20)
+
+/**
+ * struct v9fs_wcombine - write-combining buffer of an uncached open file
+ * @lock: serialises writes to the file and flushes of @buf
+ * @fid: fid of the open file, whose aux points back here
+ * @inode: inode of the file, whose attributes a Twrite changes
+ * @buf: data written but not sent yet
+ * @size: size of @buf, the iounit of @fid
+ * @offset: file offset of @buf
+ * @len: bytes in @buf
+ * @err: error writing out an earlier buffer, not reported yet
+ * @work: writes @buf out once it has been sitting for a while
+ * @list: entry in the &v9fs_inode list of buffers of @inode
+ */
+
+struct v9fs_wcombine {
+	struct mutex lock;
+	struct p9_fid *fid;
+	struct inode *inode;
+	char *buf;
+	u32 size;
+	u64 offset;
+	u32 len;
+	int err;
+	struct delayed_work work;
+	struct list_head list;
+};
+
+static ssize_t v9fs_write_through(struct file *filp, const char __user *data,
+						size_t count, loff_t *offset);
+
+/**
+ * v9fs_wcombine_flush - send the contents of a write-combining buffer
+ * @wc: buffer, locked
+ *
+ * Errors are kept in @wc->err for the next write or close, except for
+ * an interrupted Twrite, which leaves the data in place and is returned.
+ */
+
+static int v9fs_wcombine_flush(struct v9fs_wcombine *wc)
+{
+	int n;
+
+	if (!wc->len)
+		return 0;
+
+	n = p9_client_write(wc->fid, wc->buf, NULL, wc->offset, wc->len);
+	/* the server keeps the modification time */
+	v9fs_invalidate_attr(wc->inode);
+	if (n == -ERESTARTSYS)
+		return n;
+
+	if (n >= 0 && n < wc->len)
+		n = -EIO;
+	if (n < 0 && !wc->err)
+		wc->err = n;
+	wc->len = 0;
+	return 0;
+}
+
+static void v9fs_wcombine_work(struct work_struct *work)
+{
+	struct v9fs_wcombine *wc;
+
+	wc = container_of(work, struct v9fs_wcombine, work.work);
+	mutex_lock(&wc->lock);
+	v9fs_wcombine_flush(wc);
+	mutex_unlock(&wc->lock);
+}
+
+/**
+ * v9fs_wcombine_sync - send a file's buffered writes
+ * @fid: fid of the open file
+ * @report: also return (and clear) an error left by an earlier flush
+ *
+ */
+
+static int v9fs_wcombine_sync(struct p9_fid *fid, int report)
+{
+	struct v9fs_wcombine *wc = fid->aux;
+	int err;
+
+	if (!wc)
+		return 0;
+
+	mutex_lock(&wc->lock);
+	err = v9fs_wcombine_flush(wc);
+	if (!err && report) {
+		err = wc->err;
+		wc->err = 0;
+	}
+	mutex_unlock(&wc->lock);
+	return err;
+}
+
+/**
+ * v9fs_wcombine_sync_inode - send the buffered writes of every open file
+ * @inode: inode whose files to sync
+ *
+ * Anything that looks at or changes the size of the file on the server
+ * must not race with writes still sitting in a buffer.  Errors of earlier
+ * flushes are left for the files' own writes or close.
+ */
+
+int v9fs_wcombine_sync_inode(struct inode *inode)
+{
+	struct v9fs_inode *v9inode = V9FS_I(inode);
+	struct v9fs_wcombine *wc;
+	int err = 0;
+
+	if (list_empty(&v9inode->wcombine))
+		return 0;
+
+	mutex_lock(&v9inode->wcombine_lock);
+	list_for_each_entry(wc, &v9inode->wcombine, list) {
+		mutex_lock(&wc->lock);
+		err = v9fs_wcombine_flush(wc);
+		mutex_unlock(&wc->lock);
+		if (err)
+			break;
+	}
+	mutex_unlock(&v9inode->wcombine_lock);
+	return err;
+}
+
+static void v9fs_wcombine_create(struct p9_fid *fid, struct inode *inode)
+{
+	struct v9fs_wcombine *wc;
+
+	wc = kmalloc(sizeof(struct v9fs_wcombine), GFP_KERNEL);
+	if (!wc)
+		return;
+
+	wc->size = v9fs_iosize(fid);
+	wc->buf = kmalloc(wc->size, GFP_KERNEL);
+	if (!wc->buf) {
+		/* writes just go straight through */
+		kfree(wc);
+		return;
+	}
+
+	mutex_init(&wc->lock);
+	wc->fid = fid;
+	wc->inode = inode;
+	wc->offset = 0;
+	wc->len = 0;
+	wc->err = 0;
+	INIT_DELAYED_WORK(&wc->work, v9fs_wcombine_work);
+	fid->aux = wc;
+
+	mutex_lock(&V9FS_I(inode)->wcombine_lock);
+	list_add(&wc->list, &V9FS_I(inode)->wcombine);
+	mutex_unlock(&V9FS_I(inode)->wcombine_lock);
+}
+
+/**
+ * v9fs_wcombine_release - flush and free a file's write-combining buffer
+ * @fid: fid of the file being released
+ *
+ * Nobody is left to hand an error to, so a write that fails here is
+ * logged.
+ */
+
+void v9fs_wcombine_release(struct p9_fid *fid)
+{
+	struct v9fs_wcombine *wc = fid->aux;
+	int err;
+
+	if (!wc)
+		return;
+
+	mutex_lock(&V9FS_I(wc->inode)->wcombine_lock);
+	list_del(&wc->list);
+	mutex_unlock(&V9FS_I(wc->inode)->wcombine_lock);
+
+	cancel_delayed_work_sync(&wc->work);
+	err = v9fs_wcombine_flush(wc);
+	if (!err)
+		err = wc->err;
+	if (err)
+		printk(KERN_ERR "v9fs: buffered writes to fid %d lost: %d\n",
+								fid->fid, err);
+	fid->aux = NULL;
+	kfree(wc->buf);
+	kfree(wc);
+}
+
+/**
+ * v9fs_wcombine_write - write to a file through its write-combining buffer
+ * @filp: file pointer to write
+ * @data: data buffer to write data from
+ * @count: size of buffer
+ * @offset: offset at which to write data
+ *
+ * Writes that continue the buffered data and fit are only copied; the
+ * buffer goes out when it is full, when a write does not follow on, or
+ * after %V9FS_WCOMBINE_DELAY.  Larger writes go straight through, after
+ * what is buffered.
+ */
+
+static ssize_t
+v9fs_wcombine_write(struct file *filp, const char __user *data,
+					size_t count, loff_t *offset)
+{
+	struct p9_fid *fid = filp->private_data;
+	struct v9fs_wcombine *wc = fid->aux;
+	struct inode *inode = filp->f_path.dentry->d_inode;
+	ssize_t retval;
+
+	mutex_lock(&wc->lock);
+	if (wc->len && (*offset != wc->offset + wc->len ||
+				wc->len + count > wc->size)) {
+		retval = v9fs_wcombine_flush(wc);
+		if (retval)
+			goto out;
+	}
+
+	retval = wc->err;
+	wc->err = 0;
+	if (retval)
+		goto out;
+
+	if (count >= wc->size) {
+		retval = v9fs_write_through(filp, data, count, offset);
+		goto out;
+	}
+
+	if (copy_from_user(wc->buf + wc->len, data, count)) {
+		retval = -EFAULT;
+		goto out;
+	}
+
+	if (!wc->len)
+		wc->offset = *offset;
+	wc->len += count;
+	*offset += count;
+	if (*offset > inode->i_size) {
+		inode->i_size = *offset;
+		inode->i_blocks = (inode->i_size + 512 - 1) >> 9;
+	}
+
+	if (wc->len == wc->size)
+		v9fs_wcombine_flush(wc);
+	else
+		queue_delayed_work(v9fs_wcombine_wq, &wc->work,
+							V9FS_WCOMBINE_DELAY);
+	retval = count;
+
+out:
+	mutex_unlock(&wc->lock);
+	return retval;
+}
+
 static const struct file_operations v9fs_cached_file_operations;
+static const struct file_operations v9fs_writeback_file_operations;
 
 /**
  * v9fs_file_open - open a file (or directory)
@@ -71,20 +332,41 @@ int v9fs_file_open(struct inode *inode, struct file *file)
 			p9_client_clunk(fid);
 			return err;
 		}
+		v9fs_check_qid(inode, &fid->qid);
 		if (omode & P9_OTRUNC) {
 			inode->i_size = 0;
 			inode->i_blocks = 0;
+			v9fs_invalidate_attr(inode);
 		}
 		if ((file->f_flags & O_APPEND) && (!v9fs_extended(v9ses)))
 			generic_file_llseek(file, 0, SEEK_END);
 	}
 
 	file->private_data = fid;
+	if ((v9ses->flags & V9FS_WCOMBINE) && !v9ses->cache &&
+	    S_ISREG(inode->i_mode) && (file->f_mode & FMODE_WRITE) &&
+	    !fid->aux)
+		v9fs_wcombine_create(fid, inode);
 	if ((fid->qid.version) && (v9ses->cache)) {
 		P9_DPRINTK(P9_DEBUG_VFS, "cached");
 		/* enable cached file options */
 		if(file->f_op == &v9fs_file_operations)
 			file->f_op = &v9fs_cached_file_operations;
+
+		/* let readahead keep a few full-sized Treads in flight */
+		file->f_ra.ra_pages = max_t(unsigned long, file->f_ra.ra_pages,
+			(V9FS_READAHEAD_TREADS * v9ses->maxdata) >>
+							PAGE_CACHE_SHIFT);
+
+		/*
+		 * Writes stay in the page cache if there is a fid to write
+		 * them back with, otherwise they go through as with loose.
+		 */
+		if (file->f_op == &v9fs_cached_file_operations &&
+		    v9ses->cache == CACHE_WRITEBACK &&
+		    (!(file->f_mode & FMODE_WRITE) ||
+		     !IS_ERR(v9fs_writeback_fid(file->f_path.dentry))))
+			file->f_op = &v9fs_writeback_file_operations;
 	}
 
 	return 0;
@@ -120,48 +402,116 @@ static int v9fs_file_lock(struct file *filp, int cmd, struct file_lock *fl)
 }
 
 /**
- * v9fs_file_readn - read from a file
- * @filp: file pointer to read
+ * v9fs_fid_readn - read from a fid
+ * @fid: fid to read
  * @data: data buffer to read data into
  * @udata: user data buffer to read data into
  * @count: size of buffer
  * @offset: offset at which to read data
+ * @window: number of Treads to keep in flight
  *
+ * The read is split into iounit-sized Treads whose data is copied to its
+ * place in the buffer as the Rreads come in.  A short Rread ends it;
+ * anything read past that point is dropped.  Directories, append-only
+ * and exclusive-use files are always read one Tread at a time: their
+ * offsets have to follow the replies, or the server may serve them in
+ * order only.  Callers pass a window of 1 for anything but a regular
+ * file.
  */
 
 ssize_t
-v9fs_file_readn(struct file *filp, char *data, char __user *udata, u32 count,
-	       u64 offset)
+v9fs_fid_readn(struct p9_fid *fid, char *data, char __user *udata, u32 count,
+	       u64 offset, int window)
 {
-	int n, total;
-	struct p9_fid *fid = filp->private_data;
+	struct p9_req_t *reqs[V9FS_MAX_PIPELINE];
+	struct p9_req_t *req;
+	u32 rsize, sent, pos, len;
+	int n, err, head, tail, stop;
+	ssize_t total;
 
-	P9_DPRINTK(P9_DEBUG_VFS, "fid %d offset %llu count %d\n", fid->fid,
-					(long long unsigned) offset, count);
+	P9_DPRINTK(P9_DEBUG_VFS, "fid %d offset %llu count %d window %d\n",
+			fid->fid, (long long unsigned) offset, count, window);
+
+	rsize = v9fs_iosize(fid);
+	if (fid->qid.type & (P9_QTDIR | P9_QTAPPEND | P9_QTEXCL))
+		window = 1;
+	window = clamp(window, 1, V9FS_MAX_PIPELINE);
 
-	n = 0;
 	total = 0;
-	do {
-		n = p9_client_read(fid, data, udata, offset, count);
-		if (n <= 0)
+	err = 0;
+	sent = 0;
+	head = tail = 0;
+	stop = 0;
+	for (;;) {
+		while (!stop && sent < count && tail - head < window) {
+			len = min(rsize, count - sent);
+			req = p9_client_read_post(fid, offset + sent, len);
+			if (IS_ERR(req)) {
+				err = PTR_ERR(req);
+				stop = 1;
+				break;
+			}
+			reqs[tail++ % window] = req;
+			sent += len;
+		}
+
+		if (head == tail)
 			break;
 
-		if (data)
-			data += n;
-		if (udata)
-			udata += n;
+		req = reqs[head % window];
+		pos = head++ * rsize;
+		len = min(rsize, count - pos);
+		if (stop) {
+			/* past a short read or an error, just drain */
+			p9_client_read_wait(fid->clnt, req, NULL, NULL, len);
+			continue;
+		}
+
+		n = p9_client_read_wait(fid->clnt, req,
+					data ? data + pos : NULL,
+					udata ? udata + pos : NULL, len);
+		if (n < 0) {
+			err = n;
+			stop = 1;
+			continue;
+		}
 
-		offset += n;
-		count -= n;
 		total += n;
-	} while (count > 0 && n == (fid->clnt->msize - P9_IOHDRSZ));
+		if (n < len)
+			stop = 1;
+	}
 
-	if (n < 0)
-		total = n;
+	if (!total && err)
+		return err;
 
 	return total;
 }
 
+/**
+ * v9fs_file_readn - read from a file
+ * @filp: file pointer to read
+ * @data: data buffer to read data into
+ * @udata: user data buffer to read data into
+ * @count: size of buffer
+ * @offset: offset at which to read data
+ *
+ */
+
+ssize_t
+v9fs_file_readn(struct file *filp, char *data, char __user *udata, u32 count,
+	       u64 offset)
+{
+	struct v9fs_session_info *v9ses;
+	struct inode *inode = filp->f_path.dentry->d_inode;
+	int window;
+
+	v9ses = v9fs_inode2v9ses(inode);
+	/* devices, fifos and the like have no offsets to spread Treads over */
+	window = S_ISREG(inode->i_mode) ? v9ses->pipeline : 1;
+	return v9fs_fid_readn(filp->private_data, data, udata, count, offset,
+								window);
+}
+
 /**
  * v9fs_file_read - read from a file
  * @filp: file pointer to read
@@ -181,7 +531,12 @@ v9fs_file_read(struct file *filp, char __user *udata, size_t count,
 	P9_DPRINTK(P9_DEBUG_VFS, "count %zu offset %lld\n", count, *offset);
 	fid = filp->private_data;
 
-	if (count > (fid->clnt->msize - P9_IOHDRSZ))
+	/* reads have to see what was written before them */
+	ret = v9fs_wcombine_sync(fid, 0);
+	if (ret)
+		return ret;
+
+	if (count > v9fs_iosize(fid))
 		ret = v9fs_file_readn(filp, NULL, udata, count, *offset);
 	else
 		ret = p9_client_read(fid, NULL, udata, *offset, count);
@@ -193,7 +548,94 @@ v9fs_file_read(struct file *filp, char __user *udata, size_t count,
 }
 
 /**
- * v9fs_file_write - write to a file
+ * v9fs_fid_writen - write to a fid
+ * @fid: fid to write
+ * @data: data buffer to write data from
+ * @udata: user data buffer to write data from
+ * @count: size of buffer
+ * @offset: offset at which to write data
+ * @window: number of Twrites to keep in flight
+ *
+ * The write is split into iounit-sized Twrites.  Returns the length of
+ * the longest prefix known to be written, or the error if not even the
+ * first Twrite got through.  Twrites already in flight past a short
+ * write or an error may still have reached the file.  Fids opened for
+ * append and append-only or exclusive-use files write one Twrite at a
+ * time, as the server places appended data in the order it sees it.
+ * Callers pass a window of 1 for anything but a regular file.
+ */
+
+ssize_t
+v9fs_fid_writen(struct p9_fid *fid, char *data, const char __user *udata,
+				u32 count, u64 offset, int window)
+{
+	struct p9_req_t *reqs[V9FS_MAX_PIPELINE];
+	struct p9_req_t *req;
+	u32 wsize, sent, pos, len;
+	int n, err, head, tail, stop;
+	ssize_t total;
+
+	P9_DPRINTK(P9_DEBUG_VFS, "fid %d offset %llu count %d window %d\n",
+			fid->fid, (long long unsigned) offset, count, window);
+
+	wsize = v9fs_iosize(fid);
+	if ((fid->qid.type & (P9_QTAPPEND | P9_QTEXCL)) ||
+	    (fid->mode != -1 && (fid->mode & P9_OAPPEND)))
+		window = 1;
+	window = clamp(window, 1, V9FS_MAX_PIPELINE);
+
+	total = 0;
+	err = 0;
+	sent = 0;
+	head = tail = 0;
+	stop = 0;
+	for (;;) {
+		while (!stop && sent < count && tail - head < window) {
+			len = min(wsize, count - sent);
+			req = p9_client_write_post(fid,
+					data ? data + sent : NULL,
+					udata ? udata + sent : NULL,
+					offset + sent, len);
+			if (IS_ERR(req)) {
+				err = PTR_ERR(req);
+				stop = 1;
+				break;
+			}
+			reqs[tail++ % window] = req;
+			sent += len;
+		}
+
+		if (head == tail)
+			break;
+
+		req = reqs[head % window];
+		pos = head++ * wsize;
+		len = min(wsize, count - pos);
+		n = p9_client_write_wait(fid->clnt, req);
+		if (stop)
+			continue;
+
+		if (n > (int) len)
+			n = -EIO;
+		if (n < 0) {
+			err = n;
+			stop = 1;
+			continue;
+		}
+
+		total += n;
+		if (n < len)
+			stop = 1;
+	}
+
+	if (!total && err)
+		return err;
+
+	return total;
+}
+
+/**
+ * v9fs_write_through - write to a file without buffering
  * @filp: file pointer to write
  * @data: data buffer to write data from
  * @count: size of buffer
@@ -202,54 +644,183 @@ v9fs_file_read(struct file *filp, char __user *udata, size_t count,
  */
 
 static ssize_t
-v9fs_file_write(struct file *filp, const char __user * data,
-		size_t count, loff_t * offset)
+v9fs_write_through(struct file *filp, const char __user *data,
+		size_t count, loff_t *offset)
 {
-	int n, rsize, total = 0;
+	ssize_t n;
 	struct p9_fid *fid;
-	struct p9_client *clnt;
+	struct v9fs_session_info *v9ses;
 	struct inode *inode = filp->f_path.dentry->d_inode;
-	int origin = *offset;
+	loff_t origin = *offset;
 
-	P9_DPRINTK(P9_DEBUG_VFS, "data %p count %d offset %x\n", data,
-		(int)count, (int)*offset);
+	P9_DPRINTK(P9_DEBUG_VFS, "data %p count %d offset %llx\n", data,
+		(int)count, (long long)*offset);
 
 	fid = filp->private_data;
-	clnt = fid->clnt;
-
-	rsize = fid->iounit;
-	if (!rsize || rsize > clnt->msize-P9_IOHDRSZ)
-		rsize = clnt->msize - P9_IOHDRSZ;
+	v9ses = v9fs_inode2v9ses(inode);
 
-	do {
-		if (count < rsize)
-			rsize = count;
+	n = v9fs_fid_writen(fid, NULL, data, count, origin,
+			S_ISREG(inode->i_mode) ? v9ses->pipeline : 1);
 
-		n = p9_client_write(fid, NULL, data+total, *offset+total,
-									rsize);
-		if (n <= 0)
-			break;
-		count -= n;
-		total += n;
-	} while (count > 0);
+	/* even a failed write may have changed any of the range */
+	if (count > 0)
+		invalidate_inode_pages2_range(inode->i_mapping,
+				origin >> PAGE_CACHE_SHIFT,
+				(origin + count - 1) >> PAGE_CACHE_SHIFT);
 
-	if (total > 0) {
-		invalidate_inode_pages2_range(inode->i_mapping, origin,
-								origin+total);
-		*offset += total;
-	}
+	if (n <= 0)
+		return n;
 
+	*offset += n;
 	if (*offset > inode->i_size) {
 		inode->i_size = *offset;
 		inode->i_blocks = (inode->i_size + 512 - 1) >> 9;
 	}
 
-	if (n < 0)
-		return n;
+	return n;
+}
 
-	return total;
+/**
+ * v9fs_file_write - write to a file
+ * @filp: file pointer to write
+ * @data: data buffer to write data from
+ * @count: size of buffer
+ * @offset: offset at which to write data
+ *
+ */
+
+static ssize_t
+v9fs_file_write(struct file *filp, const char __user * data,
+		size_t count, loff_t * offset)
+{
+	struct p9_fid *fid = filp->private_data;
+	ssize_t retval;
+
+	if (fid->aux)
+		retval = v9fs_wcombine_write(filp, data, count, offset);
+	else
+		retval = v9fs_write_through(filp, data, count, offset);
+
+	/* the server keeps the modification time; drop what it sent before */
+	v9fs_invalidate_attr(filp->f_path.dentry->d_inode);
+	return retval;
+}
+
+/**
+ * v9fs_file_fsync - write a file's dirty pages back and commit them
+ * @filp: file to sync
+ * @dentry: its dentry
+ * @datasync: only sync data (ignored)
+ *
+ * A wstat that changes nothing asks the server to commit the file to
+ * stable storage.
+ */
+
+static int v9fs_file_fsync(struct file *filp, struct dentry *dentry,
+								int datasync)
+{
+	struct p9_wstat wstat;
+	int retval;
+
+	P9_DPRINTK(P9_DEBUG_VFS, "filp %p datasync %d\n", filp, datasync);
+	retval = v9fs_wcombine_sync(filp->private_data, 1);
+	if (!retval)
+		retval = filemap_write_and_wait(dentry->d_inode->i_mapping);
+	if (retval)
+		return retval;
+
+	v9fs_blank_wstat(&wstat);
+	return p9_client_wstat(filp->private_data, &wstat);
+}
+
+/**
+ * v9fs_file_flush - write buffered data back when a file is closed
+ * @filp: file being closed
+ * @id: lock owner
+ *
+ */
+
+static int v9fs_file_flush(struct file *filp, fl_owner_t id)
+{
+	struct inode *inode = filp->f_path.dentry->d_inode;
+	int retval;
+
+	if (!(filp->f_mode & FMODE_WRITE))
+		return 0;
+
+	P9_DPRINTK(P9_DEBUG_VFS, "filp %p\n", filp);
+	retval = v9fs_wcombine_sync(filp->private_data, 1);
+	if (retval)
+		return retval;
+
+	return filemap_write_and_wait(inode->i_mapping);
+}
+
+/**
+ * v9fs_vm_page_mkwrite - a page of a shared mapping is about to be written
+ * @vma: the mapping
+ * @vmf: fault information
+ *
+ */
+
+static int v9fs_vm_page_mkwrite(struct vm_area_struct *vma,
+						struct vm_fault *vmf)
+{
+	struct page *page = vmf->page;
+	struct file *filp = vma->vm_file;
+	struct inode *inode = filp->f_path.dentry->d_inode;
+	int retval = 0;
+
+	P9_DPRINTK(P9_DEBUG_VFS, "page %p index %lu\n", page, page->index);
+	file_update_time(filp);
+
+	lock_page(page);
+	if (page->mapping != inode->i_mapping)
+		retval = VM_FAULT_NOPAGE;	/* truncated, fault again */
+	else if (!V9FS_I(inode)->writeback_fid)
+		retval = VM_FAULT_SIGBUS;
+	unlock_page(page);
+
+	return retval;
+}
+
+static struct vm_operations_struct v9fs_file_vm_ops = {
+	.fault = filemap_fault,
+	.page_mkwrite = v9fs_vm_page_mkwrite,
+};
+
+/**
+ * v9fs_file_mmap - map a file, writable shared mappings included
+ * @filp: file to map
+ * @vma: the mapping
+ *
+ */
+
+static int v9fs_file_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	int retval;
+
+	retval = generic_file_mmap(filp, vma);
+	if (!retval)
+		vma->vm_ops = &v9fs_file_vm_ops;
+
+	return retval;
 }
 
+static const struct file_operations v9fs_writeback_file_operations = {
+	.llseek = generic_file_llseek,
+	.read = do_sync_read,
+	.aio_read = generic_file_aio_read,
+	.write = do_sync_write,
+	.aio_write = generic_file_aio_write,
+	.open = v9fs_file_open,
+	.flush = v9fs_file_flush,
+	.release = v9fs_dir_release,
+	.lock = v9fs_file_lock,
+	.mmap = v9fs_file_mmap,
+	.fsync = v9fs_file_fsync,
+};
+
 static const struct file_operations v9fs_cached_file_operations = {
 	.llseek = generic_file_llseek,
 	.read = do_sync_read,
@@ -266,7 +837,9 @@ const struct file_operations v9fs_file_operations = {
 	.read = v9fs_file_read,
 	.write = v9fs_file_write,
 	.open = v9fs_file_open,
+	.flush = v9fs_file_flush,
 	.release = v9fs_dir_release,
 	.lock = v9fs_file_lock,
 	.mmap = generic_file_readonly_mmap,
+	.fsync = v9fs_file_fsync,
 };
@@ -175,7 +175,7 @@ int v9fs_uflags2omode(int uflags, int extended)
  *
  */
 
-static void
+void
 v9fs_blank_wstat(struct p9_wstat *wstat)
 {
 	wstat->type = ~0;
@@ -326,6 +326,31 @@ error:
 }
 */
 
+/**
+ * v9fs_inode_from_stat - create an inode from a stat record
+ * @v9ses: session information
+ * @st: attributes of the file
+ * @sb: superblock on which to create inode
+ *
+ */
+
+struct inode *
+v9fs_inode_from_stat(struct v9fs_session_info *v9ses, struct p9_wstat *st,
+	struct super_block *sb)
+{
+	int umode;
+	struct inode *ret;
+
+	umode = p9mode2unixmode(v9ses, st->mode);
+	ret = v9fs_get_inode(sb, umode);
+	if (IS_ERR(ret))
+		return ret;
+
+	v9fs_stat2inode(st, ret, sb);
+	ret->i_ino = v9fs_qid2ino(&st->qid);
+	return ret;
+}
+
 /**
  * v9fs_inode_from_fid - populate an inode by issuing a attribute request
  * @v9ses: session information
@@ -338,32 +363,17 @@ static struct inode *
 v9fs_inode_from_fid(struct v9fs_session_info *v9ses, struct p9_fid *fid,
 	struct super_block *sb)
 {
-	int err, umode;
 	struct inode *ret;
 	struct p9_wstat *st;
 
-	ret = NULL;
 	st = p9_client_stat(fid);
 	if (IS_ERR(st))
 		return ERR_CAST(st);
 
-	umode = p9mode2unixmode(v9ses, st->mode);
-	ret = v9fs_get_inode(sb, umode);
-	if (IS_ERR(ret)) {
-		err = PTR_ERR(ret);
-		goto error;
-	}
-
-	v9fs_stat2inode(st, ret, sb);
-	ret->i_ino = v9fs_qid2ino(&st->qid);
+	ret = v9fs_inode_from_stat(v9ses, st, sb);
 	p9stat_free(st);
 	kfree(st);
 	return ret;
-
-error:
-	p9stat_free(st);
-	kfree(st);
-	return ERR_PTR(err);
 }
 
 /**
@@ -379,6 +389,7 @@ static int v9fs_remove(struct inode *dir, struct dentry *file, int rmdir)
 	struct inode *file_inode;
 	struct v9fs_session_info *v9ses;
 	struct p9_fid *v9fid;
+	int retval;
 
 	P9_DPRINTK(P9_DEBUG_VFS, "inode: %p dentry: %p rmdir: %d\n", dir, file,
 		rmdir);
@@ -389,7 +400,11 @@ static int v9fs_remove(struct inode *dir, struct dentry *file, int rmdir)
 	if (IS_ERR(v9fid))
 		return PTR_ERR(v9fid);
 
-	return p9_client_remove(v9fid);
+	retval = p9_client_remove(v9fid);
+	v9fs_invalidate_attr(dir);
+	v9fs_invalidate_attr(file_inode);
+	V9FS_I(dir)->dir_gen++;
+	return retval;
 }
 
 static int
@@ -442,6 +457,8 @@ v9fs_create(struct v9fs_session_info *v9ses, struct inode *dir,
 	}
 
 	err = p9_client_fcreate(ofid, name, perm, mode, extension);
+	v9fs_invalidate_attr(dir);
+	V9FS_I(dir)->dir_gen++;
 	if (err < 0) {
 		P9_DPRINTK(P9_DEBUG_VFS, "p9_client_fcreate failed %d\n", err);
 		goto error;
@@ -536,6 +553,10 @@ v9fs_vfs_create(struct inode *dir, struct dentry *dentry, int mode,
 		}
 
 		filp->private_data = fid;
+		/* pick the cached file operations as an open would */
+		err = v9fs_file_open(dentry->d_inode, filp);
+		if (err)
+			return err;
 	} else
 		p9_client_clunk(fid);
 
@@ -593,6 +614,7 @@ static struct dentry *v9fs_vfs_lookup(struct inode *dir, struct dentry *dentry,
 	struct super_block *sb;
 	struct v9fs_session_info *v9ses;
 	struct p9_fid *dfid, *fid;
+	struct v9fs_dentry *dent;
 	struct inode *inode;
 	char *name;
 	int result = 0;
@@ -606,11 +628,26 @@ static struct dentry *v9fs_vfs_lookup(struct inode *dir, struct dentry *dentry,
 	if (IS_ERR(dfid))
 		return ERR_CAST(dfid);
 
+	/* names in it are being looked up: worth reading it with stats */
+	V9FS_I(dir)->rdplus_off = 0;
+
 	name = (char *) dentry->d_name.name;
 	fid = p9_client_walk(dfid, 1, &name, 1);
+	p9_fid_put(dfid);
 	if (IS_ERR(fid)) {
 		result = PTR_ERR(fid);
 		if (result == -ENOENT) {
+			if (!v9ses->cache) {
+				/* see v9fs_dentry_revalidate */
+				dent = v9fs_dentry_data(dentry);
+				if (dent) {
+					dent->dir_version =
+						V9FS_I(dir)->qid_version;
+					dent->dir_gen = V9FS_I(dir)->dir_gen;
+				}
+				dentry->d_time = jiffies;
+				dentry->d_op = &v9fs_dentry_operations;
+			}
 			d_add(dentry, NULL);
 			return NULL;
 		}
@@ -629,6 +666,8 @@ static struct dentry *v9fs_vfs_lookup(struct inode *dir, struct dentry *dentry,
 	if (result < 0)
 		goto error;
 
+	dent = dentry->d_fsdata;
+	dent->dir_version = V9FS_I(dir)->qid_version;
 	if ((fid->qid.version) && (v9ses->cache))
 		dentry->d_op = &v9fs_cached_dentry_operations;
 	else
@@ -699,7 +738,7 @@ v9fs_vfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	olddirfid = v9fs_fid_clone(old_dentry->d_parent);
 	if (IS_ERR(olddirfid)) {
 		retval = PTR_ERR(olddirfid);
-		goto done;
+		goto put_old;
 	}
 
 	newdirfid = v9fs_fid_clone(new_dentry->d_parent);
@@ -720,6 +759,12 @@ v9fs_vfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	wstat.muid = v9ses->uname;
 	wstat.name = (char *) new_dentry->d_name.name;
 	retval = p9_client_wstat(oldfid, &wstat);
+	v9fs_invalidate_attr(old_dir);
+	v9fs_invalidate_attr(old_inode);
+	/* the old name is gone from its directory's cached contents too */
+	V9FS_I(old_dir)->dir_gen++;
+	if (new_dir != old_dir)
+		V9FS_I(new_dir)->dir_gen++;
 
 clunk_newdir:
 	p9_client_clunk(newdirfid);
@@ -727,10 +772,90 @@ clunk_newdir:
 clunk_olddir:
 	p9_client_clunk(olddirfid);
 
-done:
+put_old:
+	p9_fid_put(oldfid);
 	return retval;
 }
 
+/**
+ * v9fs_attr_valid - check whether the cached attributes can be used
+ * @inode: inode to check
+ *
+ */
+
+int v9fs_attr_valid(struct inode *inode)
+{
+	struct v9fs_inode *v9inode = V9FS_I(inode);
+
+	return v9inode->attr_valid &&
+		time_before(jiffies, v9inode->attr_time + v9inode->attr_timeo);
+}
+
+/**
+ * v9fs_invalidate_attr - make the next getattr go to the server
+ * @inode: inode whose attributes changed
+ *
+ */
+
+void v9fs_invalidate_attr(struct inode *inode)
+{
+	V9FS_I(inode)->attr_valid = 0;
+}
+
+/**
+ * v9fs_check_qid - check a qid the server returned for an inode
+ * @inode: inode the qid is for
+ * @qid: the qid
+ *
+ * A version other than the one the attributes were fetched with means
+ * the file changed on the server since.
+ */
+
+void v9fs_check_qid(struct inode *inode, struct p9_qid *qid)
+{
+	struct v9fs_inode *v9inode = V9FS_I(inode);
+
+	if (qid->version != v9inode->qid_version)
+		v9inode->attr_valid = 0;
+}
+
+/**
+ * v9fs_attr_update - work out how long fresh attributes can be trusted
+ * @inode: inode, still holding the previous attributes
+ * @stat: the fresh attributes
+ *
+ * Attributes that changed since last time are trusted for the minimum
+ * time, and the time doubles, up to the maximum, every time they did not.
+ */
+
+static void v9fs_attr_update(struct inode *inode, struct p9_wstat *stat)
+{
+	struct v9fs_session_info *v9ses = v9fs_inode2v9ses(inode);
+	struct v9fs_inode *v9inode = V9FS_I(inode);
+	unsigned long min, max, timeo;
+
+	if (stat->mode & P9_DMDIR) {
+		min = v9ses->acdirmin;
+		max = v9ses->acdirmax;
+	} else {
+		min = v9ses->acregmin;
+		max = v9ses->acregmax;
+	}
+
+	timeo = v9inode->attr_timeo;
+	if (stat->qid.version != v9inode->qid_version ||
+	    stat->mtime != inode->i_mtime.tv_sec ||
+	    stat->length != inode->i_size)
+		timeo = min;
+	else
+		timeo = timeo ? timeo * 2 : HZ;
+
+	v9inode->attr_timeo = clamp(timeo, min, max);
+	v9inode->attr_time = jiffies;
+	v9inode->qid_version = stat->qid.version;
+	v9inode->attr_valid = 1;
+}
+
 /**
  * v9fs_vfs_getattr - retrieve file metadata
  * @mnt: mount information
@@ -745,13 +870,29 @@ v9fs_vfs_getattr(struct vfsmount *mnt, struct dentry *dentry,
 {
 	int err;
 	struct v9fs_session_info *v9ses;
+	struct dentry *parent;
 	struct p9_fid *fid;
 	struct p9_wstat *st;
 
 	P9_DPRINTK(P9_DEBUG_VFS, "dentry: %p\n", dentry);
 	err = -EPERM;
 	v9ses = v9fs_inode2v9ses(dentry->d_inode);
-	if (v9ses->cache == CACHE_LOOSE)
+	if (v9ses->flags & V9FS_RDPLUS) {
+		/* see v9fs_dir_readdir */
+		parent = dget_parent(dentry);
+		V9FS_I(parent->d_inode)->rdplus_used = 1;
+		dput(parent);
+	}
+
+	if (v9ses->cache)
+		return simple_getattr(mnt, dentry, stat);
+
+	/* the server's size and mtime must include our buffered writes */
+	err = v9fs_wcombine_sync_inode(dentry->d_inode);
+	if (err)
+		return err;
+
+	if (v9fs_attr_valid(dentry->d_inode))
 		return simple_getattr(mnt, dentry, stat);
 
 	fid = v9fs_fid_lookup(dentry);
@@ -759,6 +900,7 @@ v9fs_vfs_getattr(struct vfsmount *mnt, struct dentry *dentry,
 		return PTR_ERR(fid);
 
 	st = p9_client_stat(fid);
+	p9_fid_put(fid);
 	if (IS_ERR(st))
 		return PTR_ERR(st);
 
@@ -786,10 +928,21 @@ static int v9fs_vfs_setattr(struct dentry *dentry, struct iattr *iattr)
 	P9_DPRINTK(P9_DEBUG_VFS, "\n");
 	retval = -EPERM;
 	v9ses = v9fs_inode2v9ses(dentry->d_inode);
+	/* buffered writes beyond a new size must not be sent after it */
+	if (iattr->ia_valid & ATTR_SIZE) {
+		retval = v9fs_wcombine_sync_inode(dentry->d_inode);
+		if (retval)
+			return retval;
+	}
+
 	fid = v9fs_fid_lookup(dentry);
 	if(IS_ERR(fid))
 		return PTR_ERR(fid);
 
+	/* dirty pages beyond a new size must not be written after it */
+	if ((iattr->ia_valid & ATTR_SIZE) && v9ses->cache == CACHE_WRITEBACK)
+		filemap_write_and_wait(dentry->d_inode->i_mapping);
+
 	v9fs_blank_wstat(&wstat);
 	if (iattr->ia_valid & ATTR_MODE)
 		wstat.mode = unixmode2p9mode(v9ses, iattr->ia_mode);
@@ -812,6 +965,8 @@ static int v9fs_vfs_setattr(struct dentry *dentry, struct iattr *iattr)
 	}
 
 	retval = p9_client_wstat(fid, &wstat);
+	p9_fid_put(fid);
+	v9fs_invalidate_attr(dentry->d_inode);
 	if (retval >= 0)
 		retval = inode_setattr(dentry->d_inode, iattr);
 
@@ -833,6 +988,7 @@ v9fs_stat2inode(struct p9_wstat *stat, struct inode *inode,
 	char ext[32];
 	struct v9fs_session_info *v9ses = sb->s_fs_info;
 
+	v9fs_attr_update(inode, stat);
 	inode->i_nlink = 1;
 
 	inode->i_atime.tv_sec = stat->atime;
@@ -917,14 +1073,15 @@ static int v9fs_readlink(struct dentry *dentry, char *buffer, int buflen)
 	P9_DPRINTK(P9_DEBUG_VFS, " %s\n", dentry->d_name.name);
 	retval = -EPERM;
 	v9ses = v9fs_inode2v9ses(dentry->d_inode);
+	if (!v9fs_extended(v9ses))
+		return -EBADF;
+
 	fid = v9fs_fid_lookup(dentry);
 	if (IS_ERR(fid))
 		return PTR_ERR(fid);
 
-	if (!v9fs_extended(v9ses))
-		return -EBADF;
-
 	st = p9_client_stat(fid);
+	p9_fid_put(fid);
 	if (IS_ERR(st))
 		return PTR_ERR(st);
 
@@ -37,6 +37,8 @@
 #include <linux/mount.h>
 #include <linux/idr.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/rcupdate.h>
 #include "9p.h"
 #include "client.h"
 
@@ -47,6 +49,46 @@
 static void v9fs_clear_inode(struct inode *);
 static const struct super_operations v9fs_super_ops;
 
+/**
+ * v9fs_alloc_inode - allocate an inode with its 9P private data
+ * @sb: superblock
+ *
+ */
+
+static struct inode *v9fs_alloc_inode(struct super_block *sb)
+{
+	struct v9fs_inode *v9inode;
+
+	v9inode = kmem_cache_alloc(v9fs_inode_cache, GFP_KERNEL);
+	if (!v9inode)
+		return NULL;
+
+	v9inode->writeback_fid = NULL;
+	atomic_set(&v9inode->readahead, 0);
+	v9inode->qid_version = 0;
+	v9inode->attr_valid = 0;
+	v9inode->attr_timeo = 0;
+	INIT_LIST_HEAD(&v9inode->wcombine);
+	v9inode->dir_gen = 0;
+	v9inode->dircache = NULL;
+	v9inode->rdplus_off = 0;
+	v9inode->rdplus_used = 0;
+	v9inode->rdplus_count = 0;
+	return &v9inode->vfs_inode;
+}
+
+/**
+ * v9fs_destroy_inode - free an inode
+ * @inode: inode to free
+ *
+ */
+
+static void v9fs_destroy_inode(struct inode *inode)
+{
+	v9fs_dircache_drop(inode);
+	kmem_cache_free(v9fs_inode_cache, V9FS_I(inode));
+}
+
 /**
  * v9fs_clear_inode - release an inode
  * @inode: inode to release
@@ -55,7 +97,13 @@ static const struct super_operations v9fs_super_ops;
 
 static void v9fs_clear_inode(struct inode *inode)
 {
-	filemap_fdatawrite(inode->i_mapping);
+	struct v9fs_inode *v9inode = V9FS_I(inode);
+
+	filemap_write_and_wait(inode->i_mapping);
+	if (v9inode->writeback_fid) {
+		p9_client_clunk(v9inode->writeback_fid);
+		v9inode->writeback_fid = NULL;
+	}
 }
 
 /**
@@ -89,8 +137,9 @@ v9fs_fill_super(struct super_block *sb, struct v9fs_session_info *v9ses,
 	sb->s_magic = V9FS_MAGIC;
 	sb->s_op = &v9fs_super_ops;
 
-	sb->s_flags = flags | MS_ACTIVE | MS_SYNCHRONOUS | MS_DIRSYNC |
-	    MS_NOATIME;
+	sb->s_flags = flags | MS_ACTIVE | MS_DIRSYNC | MS_NOATIME;
+	if (v9ses->cache != CACHE_WRITEBACK)
+		sb->s_flags |= MS_SYNCHRONOUS;
 
 	save_mount_options(sb, data);
 }
@@ -203,6 +252,9 @@ static void v9fs_kill_super(struct super_block *s)
 
 	kill_anon_super(s);
 
+	/* fids of unused dentries may still be waiting to be clunked */
+	rcu_barrier();
+	flush_scheduled_work();
 	v9fs_session_close(v9ses);
 	kfree(v9ses);
 	s->s_fs_info = NULL;
@@ -219,6 +271,8 @@ v9fs_umount_begin(struct super_block *sb)
 }
 
 static const struct super_operations v9fs_super_ops = {
+	.alloc_inode = v9fs_alloc_inode,
+	.destroy_inode = v9fs_destroy_inode,
 	.statfs = simple_statfs,
 	.clear_inode = v9fs_clear_inode,
 	.show_options = generic_show_options,